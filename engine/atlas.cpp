@@ -0,0 +1,375 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "atlas.hpp"
+#include "texture_cache.hpp"
+#include "caps.hpp"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string.h>
+
+using namespace glm;
+using namespace std;
+
+namespace GL
+{
+   namespace Atlas
+   {
+      enum
+      {
+         MAX_TEXTURE_SIZE = 256,
+         // Gutter and placement alignment in texels. Keeps mip levels
+         // 0 to GUTTER_LEVELS free from bleeding between neighbours.
+         GUTTER           = 8,
+         GUTTER_LEVELS    = 3
+      };
+
+      enum
+      {
+         ALPHA_NONE = 0,
+         ALPHA_CUTOUT,
+         ALPHA_PARTIAL,
+         ALPHA_CLASSES
+      };
+
+      struct Entry
+      {
+         Entry() : candidate(true), page(0), x(0), y(0), width(0), height(0), pixels(NULL) {}
+
+         bool candidate;
+         unsigned page;
+         unsigned x, y;
+         unsigned width, height;
+         const vector<uint8_t>* pixels;
+         vector<Mesh*> users;
+      };
+
+      typedef map<Texture*, Entry> EntryMap;
+
+      static bool compare_height(const Entry* a, const Entry* b)
+      {
+         return a->height > b->height;
+      }
+
+      static unsigned padded(unsigned size)
+      {
+         return (size + 2 * GUTTER + GUTTER - 1) & ~(GUTTER - 1);
+      }
+
+      static bool uvs_in_range(const vector<Vertex>& vertices)
+      {
+         const float eps = 1.0f / 1024.0f;
+         for (unsigned i = 0; i < vertices.size(); i++)
+         {
+            const vec2& tex = vertices[i].tex;
+            if (tex.x < -eps || tex.x > 1.0f + eps || tex.y < -eps || tex.y > 1.0f + eps)
+               return false;
+         }
+         return true;
+      }
+
+      static bool same_material(const Material& a, const Material& b)
+      {
+         return a.diffuse_map == b.diffuse_map &&
+            a.ambient_map == b.ambient_map &&
+            a.ambient == b.ambient &&
+            a.diffuse == b.diffuse &&
+            a.specular == b.specular &&
+            a.specular_power == b.specular_power &&
+            a.alpha_mod == b.alpha_mod;
+      }
+
+      static void blit(vector<uint8_t>& page, unsigned page_size, const Entry& entry)
+      {
+         int w = entry.width;
+         int h = entry.height;
+         const uint8_t* src = &(*entry.pixels)[0];
+
+         // Copy with edges clamped out into the gutter.
+         for (int y = -GUTTER; y < h + GUTTER; y++)
+         {
+            int sy = std::min(std::max(y, 0), h - 1);
+            uint8_t* dst = &page[((entry.y + GUTTER + y) * page_size + entry.x) * 4];
+
+            for (int x = -GUTTER; x < w + GUTTER; x++)
+            {
+               int sx = std::min(std::max(x, 0), w - 1);
+               memcpy(dst + (x + GUTTER) * 4, src + (sy * w + sx) * 4, 4);
+            }
+         }
+      }
+
+      static void collect(vector<std1::shared_ptr<Mesh> >& meshes, EntryMap& entries)
+      {
+         for (unsigned i = 0; i < meshes.size(); i++)
+         {
+            const Material& material = meshes[i]->get_material();
+            Texture* diffuse = material.diffuse_map.get();
+            Texture* ambient = material.ambient_map.get();
+
+            // A separate ambient map would still be sampled with the
+            // original UVs, so neither map can move into a page.
+            bool separate_ambient = ambient && ambient != diffuse;
+            if (separate_ambient)
+               entries[ambient].candidate = false;
+            if (!diffuse)
+               continue;
+
+            Entry& entry = entries[diffuse];
+            entry.users.push_back(meshes[i].get());
+
+            if (separate_ambient || !uvs_in_range(*meshes[i]->get_vertex()))
+               entry.candidate = false;
+         }
+
+         for (EntryMap::iterator itr = entries.begin(); itr != entries.end(); ++itr)
+         {
+            Entry& entry = itr->second;
+            if (!entry.candidate)
+               continue;
+
+            entry.width  = itr->first->get_width();
+            entry.height = itr->first->get_height();
+            entry.pixels = TextureCache::get_pixels(itr->first);
+
+            if (!entry.pixels || !entry.width || !entry.height ||
+                  entry.width > MAX_TEXTURE_SIZE || entry.height > MAX_TEXTURE_SIZE)
+               entry.candidate = false;
+         }
+      }
+
+      static unsigned pack(vector<Entry*>& packed, unsigned page_size)
+      {
+         unsigned page    = 0;
+         unsigned shelf_x = 0;
+         unsigned shelf_y = 0;
+         unsigned shelf_h = 0;
+
+         sort(packed.begin(), packed.end(), compare_height);
+
+         for (unsigned i = 0; i < packed.size(); i++)
+         {
+            unsigned w = padded(packed[i]->width);
+            unsigned h = padded(packed[i]->height);
+
+            if (shelf_x + w > page_size)
+            {
+               shelf_x  = 0;
+               shelf_y += shelf_h;
+               shelf_h  = 0;
+            }
+
+            if (shelf_y + h > page_size)
+            {
+               page++;
+               shelf_x = 0;
+               shelf_y = 0;
+               shelf_h = 0;
+            }
+
+            packed[i]->page = page;
+            packed[i]->x    = shelf_x;
+            packed[i]->y    = shelf_y;
+
+            shelf_x += w;
+            shelf_h  = std::max(shelf_h, h);
+         }
+
+         return packed.size() ? page + 1 : 0;
+      }
+
+      static void remap(Mesh* mesh, const Entry& entry, unsigned page_size,
+            const std1::shared_ptr<Texture>& page)
+      {
+         vec2 scale  = vec2(entry.width, entry.height) / float(page_size);
+         vec2 offset = vec2(entry.x + GUTTER, entry.y + GUTTER) / float(page_size);
+
+         vector<Vertex> vertices = *mesh->get_vertex();
+         for (unsigned i = 0; i < vertices.size(); i++)
+            vertices[i].tex = offset + clamp(vertices[i].tex, vec2(0.0f), vec2(1.0f)) * scale;
+         mesh->set_vertices(vertices);
+
+         Material material = mesh->get_material();
+         bool shared_ambient = material.ambient_map == material.diffuse_map;
+         material.diffuse_map = page;
+         if (shared_ambient)
+            material.ambient_map = page;
+         mesh->set_material(material);
+      }
+
+      // Only meshes moved onto a page are merged; the rest keep their
+      // own draw as before.
+      static void merge(vector<std1::shared_ptr<Mesh> >& meshes, const set<Mesh*>& remapped)
+      {
+         vector<std1::shared_ptr<Mesh> > merged;
+         vector<unsigned> targets;
+
+         for (unsigned i = 0; i < meshes.size(); i++)
+         {
+            if (!remapped.count(meshes[i].get()))
+            {
+               merged.push_back(meshes[i]);
+               continue;
+            }
+
+            unsigned t;
+            for (t = 0; t < targets.size(); t++)
+            {
+               if (same_material(merged[targets[t]]->get_material(), meshes[i]->get_material()))
+                  break;
+            }
+
+            if (t == targets.size())
+            {
+               targets.push_back(merged.size());
+               merged.push_back(meshes[i]);
+               continue;
+            }
+
+            Mesh& target = *merged[targets[t]];
+            vector<Vertex> vertices = *target.get_vertex();
+            const vector<Vertex>& append = *meshes[i]->get_vertex();
+            vertices.insert(vertices.end(), append.begin(), append.end());
+            target.set_vertices(vertices);
+         }
+
+         meshes.swap(merged);
+      }
+
+      // Same classes as the render queue draws textures in. A page only
+      // holds tiles of one class, so it classifies like its tiles would.
+      static unsigned alpha_class(const Entry& entry)
+      {
+         const vector<uint8_t>& pixels = *entry.pixels;
+         unsigned result = ALPHA_NONE;
+
+         for (unsigned i = 3; i < pixels.size(); i += 4)
+         {
+            if (pixels[i] != 0xff && pixels[i] != 0)
+               return ALPHA_PARTIAL;
+            if (pixels[i] != 0xff)
+               result = ALPHA_CUTOUT;
+         }
+         return result;
+      }
+
+      static unsigned build_pages(vector<Entry*>& packed, unsigned max_page,
+            set<Mesh*>& remapped)
+      {
+         // A single texture gains nothing from an atlas page.
+         if (packed.size() < 2)
+            return 0;
+
+         // Use the smallest page which fits everything.
+         unsigned page_size = 256;
+         unsigned pages     = pack(packed, page_size);
+
+         while (pages > 1 && page_size < max_page)
+         {
+            page_size *= 2;
+            pages      = pack(packed, page_size);
+         }
+
+         for (unsigned p = 0; p < pages; p++)
+         {
+            // Space between tiles is opaque, so it does not make the
+            // page look alpha-tested.
+            vector<uint8_t> pixels(page_size * page_size * 4);
+            for (unsigned i = 3; i < pixels.size(); i += 4)
+               pixels[i] = 0xff;
+            std1::shared_ptr<Texture> page(new Texture);
+
+            for (unsigned i = 0; i < packed.size(); i++)
+            {
+               if (packed[i]->page == p)
+                  blit(pixels, page_size, *packed[i]);
+            }
+
+            // The gutter only covers the first mip levels, and GLES2 has
+            // no way to cap the chain there.
+            bool mipmap = !Caps::gles() || Caps::modern();
+            page->upload_data(&pixels[0], page_size, page_size, mipmap);
+#ifdef GL_TEXTURE_MAX_LEVEL
+            if (mipmap)
+            {
+               page->bind();
+               glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GUTTER_LEVELS);
+               Texture::unbind();
+            }
+#endif
+
+            for (unsigned i = 0; i < packed.size(); i++)
+            {
+               if (packed[i]->page != p)
+                  continue;
+
+               for (unsigned u = 0; u < packed[i]->users.size(); u++)
+               {
+                  remap(packed[i]->users[u], *packed[i], page_size, page);
+                  remapped.insert(packed[i]->users[u]);
+               }
+            }
+         }
+
+         return pages;
+      }
+
+      void build(vector<std1::shared_ptr<Mesh> >& meshes)
+      {
+         EntryMap entries;
+         vector<Entry*> packed[ALPHA_CLASSES];
+         set<Mesh*> remapped;
+         GLint max_size = 0;
+
+         collect(meshes, entries);
+
+         for (EntryMap::iterator itr = entries.begin(); itr != entries.end(); ++itr)
+         {
+            if (itr->second.candidate)
+               packed[alpha_class(itr->second)].push_back(&itr->second);
+         }
+
+         glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+         unsigned max_page = max_size >= 2048 ? 2048 : 1024;
+         unsigned textures = 0;
+         unsigned pages    = 0;
+
+         for (unsigned c = 0; c < ALPHA_CLASSES; c++)
+         {
+            unsigned built = build_pages(packed[c], max_page, remapped);
+            if (built)
+            {
+               textures += packed[c].size();
+               pages    += built;
+            }
+         }
+
+         if (!pages)
+            return;
+
+         if (log_cb)
+            log_cb(RETRO_LOG_INFO, "Packed %u textures into %u atlas pages.\n",
+                  textures, pages);
+
+         merge(meshes, remapped);
+
+         // The packed originals are no longer drawn.
+         TextureCache::release_unused();
+      }
+   }
+}
@@ -0,0 +1,39 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATLAS_HPP__
+#define ATLAS_HPP__
+
+#include "mesh.hpp"
+#include <vector>
+
+namespace GL
+{
+   namespace Atlas
+   {
+      // Packs small, non-repeating diffuse textures into shared atlas pages,
+      // rewrites the UVs of the meshes using them and merges meshes which
+      // end up with identical materials. Texture pixels are taken from the
+      // TextureCache, so this has to run before TextureCache::trim().
+      // Cached textures left without users afterwards are released.
+      // Opaque, cut-out and translucent textures get pages of their own,
+      // which the render queue then classifies like the originals.
+      void build(std::vector<std1::shared_ptr<Mesh> >& meshes);
+   }
+}
+
+#endif
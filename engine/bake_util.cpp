@@ -0,0 +1,178 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bake_util.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <stdio.h>
+
+#ifdef HAVE_THREADS
+#include <rthreads/rthreads.h>
+#include <features/features_cpu.h>
+#endif
+
+using namespace std;
+
+namespace GL
+{
+   namespace BakeUtil
+   {
+      struct Job
+      {
+         unsigned count;
+         Work work;
+         void* data;
+         unsigned next;
+#ifdef HAVE_THREADS
+         slock_t* lock;
+#endif
+      };
+
+      float random_unit(uint32_t& state)
+      {
+         state = state * 1664525u + 1013904223u;
+         return (state >> 8) * (1.0f / 16777216.0f);
+      }
+
+      void write_u32(vector<uint8_t>& out, uint32_t v)
+      {
+         for (unsigned i = 0; i < 4; i++)
+            out.push_back((v >> (8 * i)) & 0xff);
+      }
+
+      uint32_t read_u32(const uint8_t* in)
+      {
+         return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+      }
+
+      bool save(const string& path, const vector<uint32_t>& header,
+            const vector<uint8_t>& payload)
+      {
+         if (payload.empty())
+            return false;
+
+         vector<uint8_t> out;
+         for (unsigned i = 0; i < header.size(); i++)
+            write_u32(out, header[i]);
+
+         uLongf size = compressBound(payload.size());
+         size_t start = out.size();
+         out.resize(start + size);
+         if (compress2(&out[start], &size, &payload[0], payload.size(),
+                  Z_BEST_COMPRESSION) != Z_OK)
+            return false;
+         out.resize(start + size);
+
+         FILE* file = fopen(path.c_str(), "wb");
+         if (!file)
+            return false;
+
+         bool ok = fwrite(&out[0], 1, out.size(), file) == out.size();
+         fclose(file);
+         return ok;
+      }
+
+      bool load(const string& path, const vector<uint32_t>& header,
+            vector<uint8_t>& payload)
+      {
+         if (payload.empty())
+            return false;
+
+         FILE* file = fopen(path.c_str(), "rb");
+         if (!file)
+            return false;
+
+         vector<uint8_t> in;
+         uint8_t buf[4096];
+         size_t read;
+         while ((read = fread(buf, 1, sizeof(buf), file)) > 0)
+            in.insert(in.end(), buf, buf + read);
+         fclose(file);
+
+         size_t start = header.size() * 4;
+         if (in.size() <= start)
+            return false;
+         for (unsigned i = 0; i < header.size(); i++)
+            if (read_u32(&in[i * 4]) != header[i])
+               return false;
+
+         uLongf size = payload.size();
+         return uncompress(&payload[0], &size, &in[start], in.size() - start) == Z_OK &&
+            size == payload.size();
+      }
+
+      static void worker(void* data)
+      {
+         Job* job = static_cast<Job*>(data);
+         vector<unsigned> hits;
+
+         for (;;)
+         {
+            unsigned index;
+
+#ifdef HAVE_THREADS
+            if (job->lock)
+               slock_lock(job->lock);
+#endif
+            index = job->next++;
+#ifdef HAVE_THREADS
+            if (job->lock)
+               slock_unlock(job->lock);
+#endif
+
+            if (index >= job->count)
+               break;
+
+            job->work(job->data, index, hits);
+         }
+      }
+
+      void run(unsigned count, Work work, void* data)
+      {
+         Job job;
+         job.count = count;
+         job.work = work;
+         job.data = data;
+         job.next = 0;
+
+#ifdef HAVE_THREADS
+         unsigned threads = min<unsigned>(cpu_features_get_core_amount(), count);
+         job.lock = threads > 1 ? slock_new() : NULL;
+
+         if (job.lock)
+         {
+            vector<sthread_t*> workers;
+
+            for (unsigned i = 1; i < threads; i++)
+            {
+               sthread_t* thread = sthread_create(worker, &job);
+               if (thread)
+                  workers.push_back(thread);
+            }
+
+            worker(&job);
+
+            for (unsigned i = 0; i < workers.size(); i++)
+               sthread_join(workers[i]);
+            slock_free(job.lock);
+            return;
+         }
+#endif
+         worker(&job);
+      }
+   }
+}
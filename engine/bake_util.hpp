@@ -0,0 +1,55 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BAKE_UTIL_HPP__
+#define BAKE_UTIL_HPP__
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+namespace GL
+{
+   // What the offline bakers (PVS, LightBake) have in common: repeatable
+   // random numbers, their sidecar files, and spreading the work over
+   // all cores.
+   namespace BakeUtil
+   {
+      // Next number in [0, 1) from a per-item seed.
+      float random_unit(uint32_t& state);
+
+      void write_u32(std::vector<uint8_t>& out, uint32_t v);
+      uint32_t read_u32(const uint8_t* in);
+
+      // A sidecar is a header of little endian 32-bit words, a magic
+      // number first, then the payload compressed with zlib. load() fails
+      // unless the header matches word for word and the payload unpacks
+      // to exactly payload.size() bytes.
+      bool save(const std::string& path, const std::vector<uint32_t>& header,
+            const std::vector<uint8_t>& payload);
+      bool load(const std::string& path, const std::vector<uint32_t>& header,
+            std::vector<uint8_t>& payload);
+
+      // Calls work(data, index, hits) once for each index below count,
+      // on all cores when threads are available. hits is scratch space
+      // for ray casts, one per thread.
+      typedef void (*Work)(void* data, unsigned index, std::vector<unsigned>& hits);
+      void run(unsigned count, Work work, void* data);
+   }
+}
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "brick_map.hpp"
+#include <algorithm>
+#include <set>
+#include <limits.h>
+#include <string.h>
+
+using namespace std;
+
+namespace GL
+{
+   static int floor_div(int a, int b)
+   {
+      return a >= 0 ? a / b : -((-a + b - 1) / b);
+   }
+
+   static BrickKey brick_of(int x, int y, int z)
+   {
+      BrickKey key = {
+         floor_div(x, BrickMap::BRICK_SIZE),
+         floor_div(y, BrickMap::BRICK_SIZE),
+         floor_div(z, BrickMap::BRICK_SIZE),
+      };
+      return key;
+   }
+
+   static uint64_t cell_bit(int x, int y)
+   {
+      return (uint64_t)1 << ((y & 7) * 8 + (x & 7));
+   }
+
+   static uint64_t hash_mix(uint64_t hash, uint64_t value)
+   {
+      for (unsigned i = 0; i < 8; i++)
+      {
+         hash ^= (value >> (i * 8)) & 0xff;
+         hash *= 1099511628211ull;
+      }
+      return hash;
+   }
+
+   BrickMap::BrickMap() : edits(0)
+   {
+      // Keeps signatures of two maps apart when a grid switches between them.
+      static uint64_t next_serial;
+      serial = ++next_serial;
+   }
+
+   void BrickMap::set(int x, int y, int z, bool solid)
+   {
+      BrickKey key = brick_of(x, y, z);
+      map<BrickKey, Brick>::iterator itr = bricks.find(key);
+
+      if (itr == bricks.end())
+      {
+         if (!solid)
+            return;
+
+         Brick brick;
+         memset(&brick, 0, sizeof(brick));
+         itr = bricks.insert(make_pair(key, brick)).first;
+      }
+
+      Brick& brick = itr->second;
+      uint64_t& word = brick.bits[z & 7];
+      uint64_t bit = cell_bit(x, y);
+
+      if (!(word & bit) == !solid)
+         return;
+
+      word ^= bit;
+      brick.version = ++edits;
+
+      if (solid)
+         brick.count++;
+      else if (!--brick.count)
+         bricks.erase(itr);
+   }
+
+   bool BrickMap::get(int x, int y, int z) const
+   {
+      map<BrickKey, Brick>::const_iterator itr = bricks.find(brick_of(x, y, z));
+      if (itr == bricks.end())
+         return false;
+
+      return itr->second.bits[z & 7] & cell_bit(x, y);
+   }
+
+   size_t BrickMap::cell_count() const
+   {
+      size_t count = 0;
+      for (map<BrickKey, Brick>::const_iterator itr = bricks.begin(); itr != bricks.end(); ++itr)
+         count += itr->second.count;
+      return count;
+   }
+
+   bool BrickMap::bounds(int lo[3], int hi[3]) const
+   {
+      if (bricks.empty())
+         return false;
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         lo[i] = INT_MAX;
+         hi[i] = INT_MIN;
+      }
+
+      for (map<BrickKey, Brick>::const_iterator itr = bricks.begin(); itr != bricks.end(); ++itr)
+      {
+         const BrickKey& key = itr->first;
+         const Brick& brick = itr->second;
+         int base[3] = { key.x * BRICK_SIZE, key.y * BRICK_SIZE, key.z * BRICK_SIZE };
+         uint64_t columns = 0;
+
+         for (int z = 0; z < BRICK_SIZE; z++)
+         {
+            if (!brick.bits[z])
+               continue;
+
+            lo[2] = min(lo[2], base[2] + z);
+            hi[2] = max(hi[2], base[2] + z + 1);
+            columns |= brick.bits[z];
+         }
+
+         for (int y = 0; y < BRICK_SIZE; y++)
+         {
+            unsigned row = (columns >> (y * 8)) & 0xff;
+            if (!row)
+               continue;
+
+            lo[1] = min(lo[1], base[1] + y);
+            hi[1] = max(hi[1], base[1] + y + 1);
+
+            for (int x = 0; x < BRICK_SIZE; x++)
+            {
+               if (row & (1u << x))
+               {
+                  lo[0] = min(lo[0], base[0] + x);
+                  hi[0] = max(hi[0], base[0] + x + 1);
+               }
+            }
+         }
+      }
+
+      return true;
+   }
+
+   void BrickMap::list_chunks(unsigned size, vector<ChunkKey>& keys) const
+   {
+      std::set<ChunkKey> occupied;
+
+      for (map<BrickKey, Brick>::const_iterator itr = bricks.begin(); itr != bricks.end(); ++itr)
+      {
+         ChunkKey key = {
+            floor_div(itr->first.x * BRICK_SIZE, size),
+            floor_div(itr->first.y * BRICK_SIZE, size),
+            floor_div(itr->first.z * BRICK_SIZE, size),
+         };
+         occupied.insert(key);
+      }
+
+      keys.insert(keys.end(), occupied.begin(), occupied.end());
+   }
+
+   void BrickMap::fill(const int origin[3], unsigned size, uint8_t* cells) const
+   {
+      int n = size + 2;
+      int lo[3], hi[3];
+
+      memset(cells, 0, n * n * n);
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         lo[i] = origin[i] - 1;
+         hi[i] = origin[i] + size + 1;
+      }
+
+      BrickKey first = brick_of(lo[0], lo[1], lo[2]);
+      BrickKey last  = brick_of(hi[0] - 1, hi[1] - 1, hi[2] - 1);
+      BrickKey key;
+
+      // Only bricks which exist are visited; the rest of the block stays 0.
+      for (key.z = first.z; key.z <= last.z; key.z++)
+      {
+         for (key.y = first.y; key.y <= last.y; key.y++)
+         {
+            for (key.x = first.x; key.x <= last.x; key.x++)
+            {
+               map<BrickKey, Brick>::const_iterator itr = bricks.find(key);
+               if (itr == bricks.end())
+                  continue;
+
+               const Brick& brick = itr->second;
+               int base[3] = { key.x * BRICK_SIZE, key.y * BRICK_SIZE, key.z * BRICK_SIZE };
+
+               for (int z = max(lo[2], base[2]); z < min(hi[2], base[2] + BRICK_SIZE); z++)
+               {
+                  uint64_t word = brick.bits[z - base[2]];
+                  if (!word)
+                     continue;
+
+                  for (int y = max(lo[1], base[1]); y < min(hi[1], base[1] + BRICK_SIZE); y++)
+                  {
+                     uint8_t* row = cells + ((z - lo[2]) * n + (y - lo[1])) * n;
+
+                     for (int x = max(lo[0], base[0]); x < min(hi[0], base[0] + BRICK_SIZE); x++)
+                        if (word & cell_bit(x, y))
+                           row[x - lo[0]] = 1;
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   uint64_t BrickMap::signature(const int origin[3], unsigned size) const
+   {
+      BrickKey first = brick_of(origin[0] - 1, origin[1] - 1, origin[2] - 1);
+      BrickKey last  = brick_of(origin[0] + size, origin[1] + size, origin[2] + size);
+      BrickKey inner_first = brick_of(origin[0], origin[1], origin[2]);
+      BrickKey inner_last  = brick_of(origin[0] + size - 1, origin[1] + size - 1, origin[2] + size - 1);
+      uint64_t hash = hash_mix(14695981039346656037ull, serial);
+      bool occupied = false;
+      BrickKey key;
+
+      // Bricks touching the one-cell border count too, since fill() reads
+      // them for the faces on the chunk's edge.
+      for (key.z = first.z; key.z <= last.z; key.z++)
+      {
+         for (key.y = first.y; key.y <= last.y; key.y++)
+         {
+            for (key.x = first.x; key.x <= last.x; key.x++)
+            {
+               map<BrickKey, Brick>::const_iterator itr = bricks.find(key);
+               if (itr == bricks.end())
+                  continue;
+
+               if (key.x >= inner_first.x && key.x <= inner_last.x &&
+                     key.y >= inner_first.y && key.y <= inner_last.y &&
+                     key.z >= inner_first.z && key.z <= inner_last.z)
+                  occupied = true;
+
+               hash = hash_mix(hash, ((uint64_t)(uint32_t)key.x << 32) | (uint32_t)key.y);
+               hash = hash_mix(hash, ((uint64_t)(uint32_t)key.z << 32) | itr->second.version);
+            }
+         }
+      }
+
+      return occupied ? (hash | 1) : 0;
+   }
+
+   static uint32_t read_le32(const uint8_t* data)
+   {
+      return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+   }
+
+   bool BrickMap::load_vox(const char* path)
+   {
+      FILE* file = fopen(path, "rb");
+      vector<uint8_t> data;
+
+      if (!file)
+      {
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "Couldn't open voxel file: %s\n", path);
+         return false;
+      }
+
+      fseek(file, 0, SEEK_END);
+      long file_size = ftell(file);
+      fseek(file, 0, SEEK_SET);
+
+      if (file_size > 0)
+      {
+         data.resize(file_size);
+         if (fread(&data[0], 1, file_size, file) != (size_t)file_size)
+            data.clear();
+      }
+      fclose(file);
+
+      if (data.size() < 20 || memcmp(&data[0], "VOX ", 4) || memcmp(&data[8], "MAIN", 4))
+      {
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "Not a MagicaVoxel file: %s\n", path);
+         return false;
+      }
+
+      // Children of MAIN: SIZE and XYZI for every model, plus palette and
+      // scene graph chunks which are skipped.
+      size_t pos = 20 + read_le32(&data[12]);
+      int offset = 0;
+      int width = 0;
+      unsigned models = 0;
+
+      while (pos + 12 <= data.size())
+      {
+         const uint8_t* chunk = &data[pos];
+         size_t content = read_le32(chunk + 4);
+         size_t children = read_le32(chunk + 8);
+         size_t body = pos + 12;
+
+         if (content > data.size() - body || children > data.size() - body - content)
+            break;
+
+         if (!memcmp(chunk, "SIZE", 4) && content >= 12)
+            width = read_le32(&data[body]);
+         else if (!memcmp(chunk, "XYZI", 4) && content >= 4)
+         {
+            size_t count = min<size_t>(read_le32(&data[body]), (content - 4) / 4);
+
+            // .vox is z-up.
+            for (size_t i = 0; i < count; i++)
+            {
+               const uint8_t* voxel = &data[body + 4 + i * 4];
+               set(offset + voxel[0], voxel[2], voxel[1], true);
+            }
+
+            offset += width + 1;
+            models++;
+         }
+
+         pos = body + content + children;
+      }
+
+      if (log_cb)
+         log_cb(RETRO_LOG_INFO, "Loaded %u voxel models, %u cells in %u bricks.\n",
+               models, (unsigned)cell_count(), (unsigned)bricks.size());
+
+      return models != 0;
+   }
+}
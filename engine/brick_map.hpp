@@ -0,0 +1,70 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BRICK_MAP_HPP__
+#define BRICK_MAP_HPP__
+
+#include "chunk_grid.hpp"
+#include <map>
+
+namespace GL
+{
+   typedef ChunkKey BrickKey;
+
+   // Sparse voxel storage: occupied space is kept as 8³ bricks of one bit
+   // per cell, keyed by brick coordinate, and empty space costs nothing.
+   // Cells are addressed with signed 32-bit coordinates on every axis.
+   class BrickMap : public VoxelSource
+   {
+      public:
+         enum { BRICK_SIZE = 8 };
+
+         BrickMap();
+
+         void set(int x, int y, int z, bool solid);
+         bool get(int x, int y, int z) const;
+
+         // Bounding box of all solid cells, hi exclusive; false if empty.
+         bool bounds(int lo[3], int hi[3]) const;
+         size_t brick_count() const { return bricks.size(); }
+         size_t cell_count() const;
+
+         // MagicaVoxel .vox; every model of the file is placed side by
+         // side along x. Colours are not kept.
+         bool load_vox(const char* path);
+
+         void list_chunks(unsigned size, std::vector<ChunkKey>& keys) const;
+         void fill(const int origin[3], unsigned size, uint8_t* cells) const;
+         uint64_t signature(const int origin[3], unsigned size) const;
+
+      private:
+         struct Brick
+         {
+            // One word per z slice, bit y * 8 + x.
+            uint64_t bits[BRICK_SIZE];
+            unsigned count;
+            // Value of edits when the brick last changed.
+            uint64_t version;
+         };
+
+         std::map<BrickKey, Brick> bricks;
+         uint64_t serial;
+         uint64_t edits;
+   };
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bvh.hpp"
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+
+using namespace std;
+
+// Items per leaf.
+#define BVH_LEAF_SIZE 2
+
+namespace GL
+{
+   struct CenterLess
+   {
+      CenterLess(const vector<AABB>& boxes, unsigned axis) : boxes(boxes), axis(axis) {}
+
+      bool operator()(unsigned a, unsigned b) const
+      {
+         return boxes[a].lo[axis] + boxes[a].hi[axis] < boxes[b].lo[axis] + boxes[b].hi[axis];
+      }
+
+      const vector<AABB>& boxes;
+      unsigned axis;
+   };
+
+   BVH::BVH()
+   {
+      memset(&stats, 0, sizeof(stats));
+   }
+
+   void BVH::clear()
+   {
+      nodes.clear();
+      items.clear();
+      boxes.clear();
+   }
+
+   void BVH::build(const vector<AABB>& boxes)
+   {
+      clear();
+      this->boxes = boxes;
+
+      for (unsigned i = 0; i < boxes.size(); i++)
+         items.push_back(i);
+
+      if (!items.empty())
+      {
+         nodes.reserve(2 * items.size());
+         build_node(0, items.size());
+      }
+   }
+
+   unsigned BVH::build_node(unsigned first, unsigned count)
+   {
+      unsigned index = nodes.size();
+      Node node;
+
+      node.box = boxes[items[first]];
+      node.first = first;
+      node.count = count;
+      node.right = 0;
+
+      AABB centers(node.box.center(), node.box.center());
+      for (unsigned i = 1; i < count; i++)
+      {
+         const AABB& box = boxes[items[first + i]];
+         node.box.expand(box);
+         centers.expand(AABB(box.center(), box.center()));
+      }
+
+      nodes.push_back(node);
+
+      if (count <= BVH_LEAF_SIZE)
+         return index;
+
+      // Median split along the axis the centres spread the most on.
+      glm::vec3 spread = centers.hi - centers.lo;
+      unsigned axis = 0;
+      if (spread.y > spread[axis])
+         axis = 1;
+      if (spread.z > spread[axis])
+         axis = 2;
+
+      unsigned half = count / 2;
+      nth_element(items.begin() + first, items.begin() + first + half,
+            items.begin() + first + count, CenterLess(boxes, axis));
+
+      build_node(first, half);
+      unsigned right = build_node(first + half, count - half);
+      nodes[index].right = right;
+
+      return index;
+   }
+
+   void BVH::update(unsigned item, const AABB& box)
+   {
+      boxes[item] = box;
+   }
+
+   void BVH::refit()
+   {
+      for (unsigned i = nodes.size(); i-- > 0; )
+      {
+         Node& node = nodes[i];
+
+         if (node.right)
+         {
+            node.box = nodes[i + 1].box;
+            node.box.expand(nodes[node.right].box);
+            continue;
+         }
+
+         node.box = boxes[items[node.first]];
+         for (unsigned j = 1; j < node.count; j++)
+            node.box.expand(boxes[items[node.first + j]]);
+      }
+   }
+
+   void BVH::cull_node(unsigned index, const Frustum& frustum, unsigned mask,
+         vector<unsigned>& visible) const
+   {
+      const Node& node = nodes[index];
+      Frustum::Result result = frustum.test(node.box, mask);
+
+      if (result == Frustum::OUTSIDE)
+         return;
+
+      if (result == Frustum::INSIDE || !node.right)
+      {
+         // Leaf boxes are tested on their own so a loose leaf does not let
+         // its neighbour through.
+         for (unsigned i = 0; i < node.count; i++)
+         {
+            unsigned item = items[node.first + i];
+            if (!mask || node.count == 1 || frustum.visible(boxes[item]))
+               visible.push_back(item);
+         }
+         return;
+      }
+
+      cull_node(index + 1, frustum, mask, visible);
+      cull_node(node.right, frustum, mask, visible);
+   }
+
+   static bool segment_hits(const AABB& box, const glm::vec3& origin, const glm::vec3& inv_dir)
+   {
+      float near = 0.0f;
+      float far = 1.0f;
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         float t0 = (box.lo[i] - origin[i]) * inv_dir[i];
+         float t1 = (box.hi[i] - origin[i]) * inv_dir[i];
+         if (t0 > t1)
+            swap(t0, t1);
+
+         // NaN from a flat axis the segment lies in compares false here.
+         if (t0 > near)
+            near = t0;
+         if (t1 < far)
+            far = t1;
+         if (near > far)
+            return false;
+      }
+
+      return true;
+   }
+
+   void BVH::raycast(const glm::vec3& origin, const glm::vec3& dir,
+         vector<unsigned>& hits) const
+   {
+      if (nodes.empty())
+         return;
+
+      glm::vec3 inv_dir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+      unsigned stack[64];
+      unsigned depth = 0;
+      stack[depth++] = 0;
+
+      while (depth)
+      {
+         unsigned index = stack[--depth];
+         const Node& node = nodes[index];
+
+         if (!segment_hits(node.box, origin, inv_dir))
+            continue;
+
+         if (node.right)
+         {
+            stack[depth++] = node.right;
+            stack[depth++] = index + 1;
+            continue;
+         }
+
+         for (unsigned i = 0; i < node.count; i++)
+         {
+            unsigned item = items[node.first + i];
+            if (node.count == 1 || segment_hits(boxes[item], origin, inv_dir))
+               hits.push_back(item);
+         }
+      }
+   }
+
+   void BVH::cull(const Frustum& frustum, vector<unsigned>& visible)
+   {
+      size_t start = visible.size();
+
+      if (!nodes.empty())
+         cull_node(0, frustum, Frustum::ALL_PLANES, visible);
+
+      stats.visible = visible.size() - start;
+      stats.culled  = boxes.size() - stats.visible;
+   }
+
+   bool intersect_triangle(const glm::vec3* tri, const glm::vec3& origin,
+         const glm::vec3& dir, float& t)
+   {
+      glm::vec3 e1 = tri[1] - tri[0];
+      glm::vec3 e2 = tri[2] - tri[0];
+      glm::vec3 p = glm::cross(dir, e2);
+      float det = glm::dot(e1, p);
+      if (fabsf(det) < 1e-12f)
+         return false;
+
+      float inv = 1.0f / det;
+      glm::vec3 s = origin - tri[0];
+      float u = glm::dot(s, p) * inv;
+      if (u < 0.0f || u > 1.0f)
+         return false;
+
+      glm::vec3 q = glm::cross(s, e1);
+      float v = glm::dot(dir, q) * inv;
+      if (v < 0.0f || u + v > 1.0f)
+         return false;
+
+      t = glm::dot(e2, q) * inv;
+      return true;
+   }
+}
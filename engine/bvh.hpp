@@ -0,0 +1,83 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BVH_HPP__
+#define BVH_HPP__
+
+#include "frustum.hpp"
+#include <vector>
+
+namespace GL
+{
+   // Bounding volume hierarchy over a fixed set of boxes, referred to by
+   // their index in build(). Moving items only needs update() and a
+   // refit(), which keeps the tree shape and just recomputes the boxes.
+   class BVH
+   {
+      public:
+         struct Stats
+         {
+            unsigned visible;
+            unsigned culled;
+         };
+
+         BVH();
+
+         void build(const std::vector<AABB>& boxes);
+         void update(unsigned item, const AABB& box);
+         void refit();
+         void clear();
+
+         // Appends the items whose box intersects the frustum.
+         void cull(const Frustum& frustum, std::vector<unsigned>& visible);
+
+         // Appends the items whose box the segment origin + t * dir,
+         // 0 <= t <= 1 passes through. Does not touch the stats, so
+         // several threads can query at once.
+         void raycast(const glm::vec3& origin, const glm::vec3& dir,
+               std::vector<unsigned>& hits) const;
+
+         unsigned size() const { return boxes.size(); }
+         const Stats& get_stats() const { return stats; }
+
+      private:
+         // Children follow their parent in the array, left first, and every
+         // node covers a contiguous run of items.
+         struct Node
+         {
+            AABB box;
+            unsigned first;
+            unsigned count;
+            unsigned right; // 0 for leaves
+         };
+
+         std::vector<Node> nodes;
+         std::vector<unsigned> items;
+         std::vector<AABB> boxes;
+         Stats stats;
+
+         unsigned build_node(unsigned first, unsigned count);
+         void cull_node(unsigned index, const Frustum& frustum, unsigned mask,
+               std::vector<unsigned>& visible) const;
+   };
+
+   // Moller-Trumbore, both faces count. t is in units of dir.
+   bool intersect_triangle(const glm::vec3* tri, const glm::vec3& origin,
+         const glm::vec3& dir, float& t);
+}
+
+#endif
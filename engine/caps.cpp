@@ -0,0 +1,145 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "caps.hpp"
+#include <string.h>
+
+#ifdef GL_APIENTRYP
+#define CAPS_APIENTRYP GL_APIENTRYP
+#else
+#define CAPS_APIENTRYP APIENTRYP
+#endif
+
+namespace GL
+{
+   namespace Caps
+   {
+      static bool is_modern;
+      static bool is_gles;
+      static bool has_parallel_compile;
+      static bool has_buffer_storage;
+      static bool has_timer_query;
+      static bool has_depth_texture;
+
+      typedef const GLubyte* (CAPS_APIENTRYP get_stringi_proc)(GLenum name, GLuint index);
+      typedef void (CAPS_APIENTRYP max_compiler_threads_proc)(GLuint count);
+
+      static bool has_token(const char* list, const char* name)
+      {
+         size_t len = strlen(name);
+
+         for (const char* str = list; str && (str = strstr(str, name)); str += len)
+            if ((str == list || str[-1] == ' ') && (str[len] == ' ' || str[len] == '\0'))
+               return true;
+         return false;
+      }
+
+      // Core contexts only list extensions through glGetStringi, which
+      // the programs have not resolved yet at this point.
+      static bool has_extension(const char* name, retro_hw_get_proc_address_t get_proc_address)
+      {
+#ifdef HAVE_GL3
+         if (is_modern)
+         {
+            GLint count = 0;
+            get_stringi_proc get_stringi = (get_stringi_proc)get_proc_address("glGetStringi");
+            if (!get_stringi)
+               return false;
+
+            glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+            for (GLint i = 0; i < count; i++)
+            {
+               const char* ext = (const char*)get_stringi(GL_EXTENSIONS, i);
+               if (ext && strcmp(ext, name) == 0)
+                  return true;
+            }
+            return false;
+         }
+#endif
+         return has_token((const char*)glGetString(GL_EXTENSIONS), name);
+      }
+
+      void init(enum retro_hw_context_type type, retro_hw_get_proc_address_t get_proc_address)
+      {
+         is_gles   = type == RETRO_HW_CONTEXT_OPENGLES2 ||
+            type == RETRO_HW_CONTEXT_OPENGLES3;
+#ifdef HAVE_GL3
+         is_modern = type == RETRO_HW_CONTEXT_OPENGL_CORE ||
+            type == RETRO_HW_CONTEXT_OPENGLES3;
+#else
+         is_modern = false;
+#endif
+
+         if (log_cb)
+            log_cb(RETRO_LOG_INFO, "Renderer path: %s.\n",
+                  is_modern ? (is_gles ? "GLES3" : "GL 3.3 core") :
+                  (is_gles ? "GLES2" : "GL2"));
+
+         max_compiler_threads_proc max_threads = NULL;
+         if (has_extension("GL_KHR_parallel_shader_compile", get_proc_address))
+            max_threads = (max_compiler_threads_proc)get_proc_address("glMaxShaderCompilerThreadsKHR");
+         else if (has_extension("GL_ARB_parallel_shader_compile", get_proc_address))
+            max_threads = (max_compiler_threads_proc)get_proc_address("glMaxShaderCompilerThreadsARB");
+
+         has_parallel_compile = max_threads != NULL;
+         if (max_threads)
+            max_threads(0xffffffffu); // As many threads as the driver likes.
+
+         if (log_cb)
+            log_cb(RETRO_LOG_INFO, "Parallel shader compile: %s.\n",
+                  has_parallel_compile ? "yes" : "no");
+
+         has_buffer_storage = is_modern && !is_gles &&
+            has_extension("GL_ARB_buffer_storage", get_proc_address);
+         has_timer_query = is_gles ?
+            has_extension("GL_EXT_disjoint_timer_query", get_proc_address) :
+            is_modern || has_extension("GL_ARB_timer_query", get_proc_address);
+         has_depth_texture = !is_gles || is_modern ||
+            has_extension("GL_OES_depth_texture", get_proc_address);
+      }
+
+      bool modern()
+      {
+         return is_modern;
+      }
+
+      bool gles()
+      {
+         return is_gles;
+      }
+
+      bool parallel_compile()
+      {
+         return has_parallel_compile;
+      }
+
+      bool buffer_storage()
+      {
+         return has_buffer_storage;
+      }
+
+      bool timer_query()
+      {
+         return has_timer_query;
+      }
+
+      bool depth_texture()
+      {
+         return has_depth_texture;
+      }
+   }
+}
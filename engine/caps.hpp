@@ -0,0 +1,53 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPS_HPP__
+#define CAPS_HPP__
+
+#include "gl.hpp"
+
+namespace GL
+{
+   // What the context handed to us by the frontend can do. Filled in on
+   // every context reset, before any GL object is created.
+   namespace Caps
+   {
+      void init(enum retro_hw_context_type type, retro_hw_get_proc_address_t get_proc_address);
+
+      // GL 3.3 core or GLES3: VAOs, uniform buffers and GLSL 3.x.
+      bool modern();
+      bool gles();
+
+      // KHR/ARB_parallel_shader_compile: the driver compiles on its own
+      // threads and GL_COMPLETION_STATUS_KHR can be polled without waiting.
+      bool parallel_compile();
+
+      // ARB_buffer_storage on a desktop core context: persistently
+      // mapped buffers.
+      bool buffer_storage();
+
+      // GL_TIME_ELAPSED queries: core 3.3 or ARB_timer_query on desktop
+      // GL, EXT_disjoint_timer_query on GLES.
+      bool timer_query();
+
+      // Depth textures which can be sampled: anything but GLES2, where
+      // they need OES_depth_texture.
+      bool depth_texture();
+   }
+}
+
+#endif
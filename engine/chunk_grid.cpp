@@ -0,0 +1,497 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunk_grid.hpp"
+#include "gl_state.hpp"
+#include "frustum.hpp"
+#include <algorithm>
+#include <string.h>
+
+#ifdef HAVE_THREADS
+#include <rthreads/rthreads.h>
+#include <features/features_cpu.h>
+#endif
+
+using namespace std;
+
+// Quads per draw; keeps indices within 16 bits for GLES2.
+#define CHUNK_MAX_QUADS 16384
+
+namespace GL
+{
+   struct ChunkGrid::Build
+   {
+      vector<Chunk*> chunks;
+      const VoxelSource* source;
+      bool cull_hidden;
+      bool greedy;
+      unsigned next;
+#ifdef HAVE_THREADS
+      slock_t* lock;
+#endif
+   };
+
+   struct FaceInfo
+   {
+      int axis;
+      int sign;
+      // Axes the texture u and v coordinates run along.
+      int u_axis;
+      int v_axis;
+      GLbyte corners[4][3];
+   };
+
+   // Same winding and texture layout as the instancing viewer's cube.
+   static const FaceInfo faces[ChunkGrid::FACE_COUNT] = {
+      { 2, -1, 0, 1, { { -1, -1, -1 }, {  1, -1, -1 }, { -1,  1, -1 }, {  1,  1, -1 } } }, // Front
+      { 2,  1, 0, 1, { {  1, -1,  1 }, { -1, -1,  1 }, {  1,  1,  1 }, { -1,  1,  1 } } }, // Back
+      { 0, -1, 2, 1, { { -1, -1,  1 }, { -1, -1, -1 }, { -1,  1,  1 }, { -1,  1, -1 } } }, // Left
+      { 0,  1, 2, 1, { {  1, -1, -1 }, {  1, -1,  1 }, {  1,  1, -1 }, {  1,  1,  1 } } }, // Right
+      { 1,  1, 0, 2, { { -1,  1, -1 }, {  1,  1, -1 }, { -1,  1,  1 }, {  1,  1,  1 } } }, // Top
+      { 1, -1, 0, 2, { { -1, -1,  1 }, {  1, -1,  1 }, { -1, -1, -1 }, {  1, -1, -1 } } }, // Bottom
+   };
+
+   static const GLubyte face_uv[4][2] = {
+      { 0, 1 }, { 1, 1 }, { 0, 0 }, { 1, 0 },
+   };
+
+   void VoxelBox::list_chunks(unsigned chunk_size, vector<ChunkKey>& keys) const
+   {
+      int n = (size + chunk_size - 1) / chunk_size;
+
+      for (int z = 0; z < n; z++)
+      {
+         for (int y = 0; y < n; y++)
+         {
+            for (int x = 0; x < n; x++)
+            {
+               ChunkKey key = { x, y, z };
+               keys.push_back(key);
+            }
+         }
+      }
+   }
+
+   void VoxelBox::fill(const int origin[3], unsigned chunk_size, uint8_t* cells) const
+   {
+      int n = chunk_size + 2;
+      int end[3];
+      int begin[3];
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         begin[i] = max(0, -(origin[i] - 1));
+         end[i] = min(n, (int)size - (origin[i] - 1));
+      }
+
+      memset(cells, 0, n * n * n);
+
+      for (int z = begin[2]; z < end[2]; z++)
+         for (int y = begin[1]; y < end[1]; y++)
+            if (end[0] > begin[0])
+               memset(cells + (z * n + y) * n + begin[0], 1, end[0] - begin[0]);
+   }
+
+   uint64_t VoxelBox::signature(const int origin[3], unsigned chunk_size) const
+   {
+      // The clipped extent of the box, one cell past the chunk on either
+      // side, is all fill() depends on.
+      uint64_t sig = 1;
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         int extent = (int)size - origin[i];
+         if (extent <= 0)
+            return 0;
+
+         extent = min<int>(extent, chunk_size + 1);
+         sig = (sig << 9) | (extent << 1) | (origin[i] > 0);
+      }
+
+      return sig;
+   }
+
+   ChunkGrid::ChunkGrid() : ibo(0)
+   {
+      memset(&stats, 0, sizeof(stats));
+   }
+
+   ChunkGrid::~ChunkGrid()
+   {
+      if (renderer_dead_state)
+         return;
+
+      for (map<ChunkKey, Chunk>::iterator itr = chunks.begin(); itr != chunks.end(); ++itr)
+         if (itr->second.vbo)
+            State::delete_buffer(itr->second.vbo);
+      if (ibo)
+         State::delete_buffer(ibo);
+   }
+
+   void ChunkGrid::reset()
+   {
+      chunks.clear();
+      ibo = 0;
+   }
+
+   void ChunkGrid::build_chunk(Chunk& chunk, const Build& build, vector<uint8_t>& cells)
+   {
+      const int n = CHUNK_SIZE;
+      const int p = CHUNK_SIZE + 2;
+      const int step[3] = { 1, p, p * p };
+      uint8_t mask[CHUNK_SIZE * CHUNK_SIZE];
+
+      cells.resize(p * p * p);
+      build.source->fill(chunk.origin, CHUNK_SIZE, &cells[0]);
+
+      chunk.vertices.clear();
+      memset(chunk.count, 0, sizeof(chunk.count));
+      for (unsigned i = 0; i < 3; i++)
+      {
+         chunk.bounds_min[i] = n;
+         chunk.bounds_max[i] = -1;
+      }
+
+      // Chunks buried inside a solid region are common and have nothing
+      // to show once hidden faces go.
+      if (build.cull_hidden &&
+            find(cells.begin(), cells.end(), 0) == cells.end())
+         return;
+
+      for (unsigned f = 0; f < FACE_COUNT; f++)
+      {
+         const FaceInfo& face = faces[f];
+         int neighbour = face.sign * step[face.axis];
+
+         chunk.first[f] = chunk.vertices.size() / 4;
+
+         for (int d = 0; d < n; d++)
+         {
+            for (int v = 0; v < n; v++)
+            {
+               for (int u = 0; u < n; u++)
+               {
+                  int c[3];
+                  c[face.axis] = d;
+                  c[face.u_axis] = u;
+                  c[face.v_axis] = v;
+
+                  const uint8_t* cell = &cells[((c[2] + 1) * p + c[1] + 1) * p + c[0] + 1];
+                  mask[v * n + u] = cell[0] && !(build.cull_hidden && cell[neighbour]);
+               }
+            }
+
+            for (int v = 0; v < n; v++)
+            {
+               for (int u = 0; u < n; u++)
+               {
+                  if (!mask[v * n + u])
+                     continue;
+
+                  int w = 1;
+                  int h = 1;
+
+                  if (build.greedy)
+                  {
+                     while (u + w < n && mask[v * n + u + w])
+                        w++;
+
+                     for (; v + h < n; h++)
+                     {
+                        int i;
+                        for (i = 0; i < w; i++)
+                           if (!mask[(v + h) * n + u + i])
+                              break;
+                        if (i < w)
+                           break;
+                     }
+                  }
+
+                  for (int j = 0; j < h; j++)
+                     memset(&mask[(v + j) * n + u], 0, w);
+
+                  int lo[3], hi[3];
+                  lo[face.axis] = hi[face.axis] = d;
+                  lo[face.u_axis] = u;
+                  hi[face.u_axis] = u + w - 1;
+                  lo[face.v_axis] = v;
+                  hi[face.v_axis] = v + h - 1;
+
+                  for (unsigned k = 0; k < 4; k++)
+                  {
+                     ChunkVertex vert;
+                     for (unsigned i = 0; i < 3; i++)
+                     {
+                        vert.cell[i] = face.corners[k][i] < 0 ? lo[i] : hi[i];
+                        vert.corner[i] = face.corners[k][i];
+                     }
+                     vert.cell[3] = face_uv[k][0] * w;
+                     vert.corner[3] = face_uv[k][1] * h;
+                     chunk.vertices.push_back(vert);
+                  }
+
+                  for (unsigned i = 0; i < 3; i++)
+                  {
+                     chunk.bounds_min[i] = min(chunk.bounds_min[i], lo[i]);
+                     chunk.bounds_max[i] = max(chunk.bounds_max[i], hi[i]);
+                  }
+               }
+            }
+         }
+
+         chunk.count[f] = chunk.vertices.size() / 4 - chunk.first[f];
+      }
+   }
+
+   void ChunkGrid::build_worker(void* data)
+   {
+      Build* build = static_cast<Build*>(data);
+      vector<uint8_t> cells;
+
+      for (;;)
+      {
+         unsigned index;
+
+#ifdef HAVE_THREADS
+         if (build->lock)
+            slock_lock(build->lock);
+#endif
+         index = build->next++;
+#ifdef HAVE_THREADS
+         if (build->lock)
+            slock_unlock(build->lock);
+#endif
+
+         if (index >= build->chunks.size())
+            break;
+
+         build_chunk(*build->chunks[index], *build, cells);
+      }
+   }
+
+   void ChunkGrid::upload(Chunk& chunk)
+   {
+      if (chunk.vertices.empty())
+      {
+         if (chunk.vbo)
+            State::delete_buffer(chunk.vbo);
+         chunk.vbo = 0;
+         return;
+      }
+
+      if (!chunk.vbo)
+         glGenBuffers(1, &chunk.vbo);
+
+      State::bind_buffer(GL_ARRAY_BUFFER, chunk.vbo);
+      glBufferData(GL_ARRAY_BUFFER, chunk.vertices.size() * sizeof(ChunkVertex),
+            &chunk.vertices[0], GL_STATIC_DRAW);
+
+      // The staging copy is only needed until the upload.
+      vector<ChunkVertex>().swap(chunk.vertices);
+   }
+
+   unsigned ChunkGrid::update(const VoxelSource& source, bool cull_hidden, bool greedy)
+   {
+      vector<ChunkKey> keys;
+      map<ChunkKey, Chunk> live;
+      greedy = greedy && cull_hidden;
+      unsigned flags = (cull_hidden ? 1 : 0) | (greedy ? 2 : 0);
+      Build build;
+
+      build.source      = &source;
+      build.cull_hidden = cull_hidden;
+      build.greedy      = greedy;
+      build.next        = 0;
+
+      source.list_chunks(CHUNK_SIZE, keys);
+
+      for (unsigned i = 0; i < keys.size(); i++)
+      {
+         int origin[3] = {
+            keys[i].x * CHUNK_SIZE, keys[i].y * CHUNK_SIZE, keys[i].z * CHUNK_SIZE,
+         };
+         uint64_t sig = source.signature(origin, CHUNK_SIZE);
+         if (!sig)
+            continue;
+
+         map<ChunkKey, Chunk>::iterator itr = chunks.find(keys[i]);
+         if (itr != chunks.end() && itr->second.signature == sig && itr->second.flags == flags)
+         {
+            live[keys[i]] = itr->second;
+            itr->second.vbo = 0;
+            continue;
+         }
+
+         Chunk& chunk = live[keys[i]];
+         chunk.vbo = 0;
+         if (itr != chunks.end())
+         {
+            chunk.vbo = itr->second.vbo;
+            itr->second.vbo = 0;
+         }
+
+         memcpy(chunk.origin, origin, sizeof(origin));
+         chunk.signature = sig;
+         chunk.flags = flags;
+         build.chunks.push_back(&chunk);
+      }
+
+      // Whatever was not carried over has left the world.
+      for (map<ChunkKey, Chunk>::iterator itr = chunks.begin(); itr != chunks.end(); ++itr)
+         if (itr->second.vbo)
+            State::delete_buffer(itr->second.vbo);
+      chunks.swap(live);
+      stats.chunks = chunks.size();
+
+#ifdef HAVE_THREADS
+      unsigned threads = min<unsigned>(cpu_features_get_core_amount(), build.chunks.size());
+      build.lock = threads > 1 ? slock_new() : NULL;
+
+      if (build.lock)
+      {
+         vector<sthread_t*> workers;
+
+         for (unsigned i = 1; i < threads; i++)
+         {
+            sthread_t* thread = sthread_create(build_worker, &build);
+            if (thread)
+               workers.push_back(thread);
+         }
+
+         build_worker(&build);
+
+         for (unsigned i = 0; i < workers.size(); i++)
+            sthread_join(workers[i]);
+         slock_free(build.lock);
+      }
+      else
+#endif
+         build_worker(&build);
+
+      for (unsigned i = 0; i < build.chunks.size(); i++)
+         upload(*build.chunks[i]);
+      State::bind_buffer(GL_ARRAY_BUFFER, 0);
+
+      return build.chunks.size();
+   }
+
+   static glm::vec3 to_vec3(const int v[3])
+   {
+      return glm::vec3(v[0], v[1], v[2]);
+   }
+
+   void ChunkGrid::draw_range(GLint cell_loc, GLint corner_loc, unsigned first, unsigned count)
+   {
+      while (count)
+      {
+         unsigned quads = min<unsigned>(count, CHUNK_MAX_QUADS);
+         size_t offset = first * 4 * sizeof(ChunkVertex);
+
+         glVertexAttribPointer(cell_loc, 4, GL_UNSIGNED_BYTE, GL_FALSE, sizeof(ChunkVertex),
+               (void*)(offset + offsetof(ChunkVertex, cell)));
+         glVertexAttribPointer(corner_loc, 4, GL_BYTE, GL_FALSE, sizeof(ChunkVertex),
+               (void*)(offset + offsetof(ChunkVertex, corner)));
+         glDrawElements(GL_TRIANGLES, quads * 6, GL_UNSIGNED_SHORT, 0);
+
+         first += quads;
+         count -= quads;
+      }
+   }
+
+   void ChunkGrid::render(Shader& shader, const View& view)
+   {
+      Frustum frustum(view.view_projection);
+
+      stats.chunks = chunks.size();
+      stats.drawn  = 0;
+      stats.quads  = 0;
+
+      if (chunks.empty())
+         return;
+
+      if (!ibo)
+      {
+         vector<GLushort> indices(CHUNK_MAX_QUADS * 6);
+         for (unsigned i = 0; i < CHUNK_MAX_QUADS; i++)
+         {
+            indices[i * 6 + 0] = i * 4 + 0;
+            indices[i * 6 + 1] = i * 4 + 1;
+            indices[i * 6 + 2] = i * 4 + 2;
+            indices[i * 6 + 3] = i * 4 + 3;
+            indices[i * 6 + 4] = i * 4 + 2;
+            indices[i * 6 + 5] = i * 4 + 1;
+         }
+
+         glGenBuffers(1, &ibo);
+         State::bind_buffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+         glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort),
+               &indices[0], GL_STATIC_DRAW);
+      }
+
+      GLint cell_loc   = shader.attrib("aCell");
+      GLint corner_loc = shader.attrib("aCorner");
+      GLint chunk_loc  = shader.uniform("uChunk");
+      GLint normal_loc = shader.uniform("uNormal");
+
+      State::bind_buffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+      State::enable_vertex_attrib(cell_loc);
+      State::enable_vertex_attrib(corner_loc);
+
+      for (map<ChunkKey, Chunk>::iterator itr = chunks.begin(); itr != chunks.end(); ++itr)
+      {
+         const Chunk& chunk = itr->second;
+         if (!chunk.vbo)
+            continue;
+
+         glm::vec3 base = view.origin + view.stride * to_vec3(chunk.origin);
+         glm::vec3 lo = base + view.stride * to_vec3(chunk.bounds_min) - glm::vec3(1.0f);
+         glm::vec3 hi = base + view.stride * to_vec3(chunk.bounds_max) + glm::vec3(1.0f);
+
+         if (!frustum.visible(AABB(lo, hi)))
+            continue;
+
+         stats.drawn++;
+         glUniform4f(chunk_loc, base.x, base.y, base.z, view.stride);
+         State::bind_buffer(GL_ARRAY_BUFFER, chunk.vbo);
+
+         for (unsigned f = 0; f < FACE_COUNT; f++)
+         {
+            const FaceInfo& face = faces[f];
+            if (!chunk.count[f])
+               continue;
+
+            // Every face of this direction lies between these two planes;
+            // if the eye is behind both, none of them can be seen.
+            if (face.sign > 0 && !(view.eye[face.axis] > lo[face.axis] + 2.0f))
+               continue;
+            if (face.sign < 0 && !(view.eye[face.axis] < hi[face.axis] - 2.0f))
+               continue;
+
+            glm::vec3 normal(0.0f);
+            normal[face.axis] = face.sign;
+            glUniform3fv(normal_loc, 1, &normal[0]);
+
+            draw_range(cell_loc, corner_loc, chunk.first[f], chunk.count[f]);
+            stats.quads += chunk.count[f];
+         }
+      }
+
+      State::disable_vertex_attrib(cell_loc);
+      State::disable_vertex_attrib(corner_loc);
+      State::bind_buffer(GL_ARRAY_BUFFER, 0);
+   }
+}
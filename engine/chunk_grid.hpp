@@ -0,0 +1,170 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHUNK_GRID_HPP__
+#define CHUNK_GRID_HPP__
+
+#include "gl.hpp"
+#include "shader.hpp"
+#include "glm/glm.hpp"
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+namespace GL
+{
+   struct ChunkKey
+   {
+      int x, y, z;
+
+      bool operator<(const ChunkKey& other) const
+      {
+         if (z != other.z)
+            return z < other.z;
+         if (y != other.y)
+            return y < other.y;
+         return x < other.x;
+      }
+   };
+
+   // Occupancy of a voxel world. Meshing only ever asks for whole chunks,
+   // so a backend can answer from whatever storage suits it.
+   class VoxelSource
+   {
+      public:
+         virtual ~VoxelSource() {}
+
+         // Chunks of size³ cells which may hold anything at all.
+         virtual void list_chunks(unsigned size, std::vector<ChunkKey>& keys) const = 0;
+
+         // Fills (size + 2)³ bytes, x fastest, with 1 for solid cells. The
+         // block starts one cell before origin so faces on the chunk border
+         // can be tested against their neighbours.
+         virtual void fill(const int origin[3], unsigned size, uint8_t* cells) const = 0;
+
+         // Must change whenever fill() for the same chunk would; 0 if the
+         // chunk is empty.
+         virtual uint64_t signature(const int origin[3], unsigned size) const = 0;
+   };
+
+   // Solid cube of size³ cells, the instancing viewer's default world.
+   class VoxelBox : public VoxelSource
+   {
+      public:
+         VoxelBox(unsigned size) : size(size) {}
+
+         void list_chunks(unsigned chunk_size, std::vector<ChunkKey>& keys) const;
+         void fill(const int origin[3], unsigned chunk_size, uint8_t* cells) const;
+         uint64_t signature(const int origin[3], unsigned chunk_size) const;
+
+      private:
+         unsigned size;
+   };
+
+   // Packed quad vertex. The position is rebuilt in the vertex shader as
+   //   uChunk.xyz + uChunk.w * aCell.xyz + aCorner.xyz
+   // with aCell.w and aCorner.w carrying the texture coordinate, which
+   // runs past 1 on merged quads so the texture repeats once per cell.
+   struct ChunkVertex
+   {
+      GLubyte cell[4];
+      GLbyte corner[4];
+   };
+
+   // Splits a voxel world into CHUNK_SIZE³ chunks with one vertex buffer
+   // each. Chunks are meshed on all cores and only re-meshed when their
+   // signature changes; drawing skips chunks outside the frustum and face
+   // directions pointing away from the eye.
+   //
+   // Shader interface: attributes aCell and aCorner, uniforms uChunk and
+   // uNormal (the face normal of the current draw).
+   class ChunkGrid
+   {
+      public:
+         enum { CHUNK_SIZE = 32 };
+
+         enum Face
+         {
+            FACE_FRONT = 0,
+            FACE_BACK,
+            FACE_LEFT,
+            FACE_RIGHT,
+            FACE_TOP,
+            FACE_BOTTOM,
+            FACE_COUNT
+         };
+
+         struct View
+         {
+            glm::mat4 view_projection;
+            glm::vec3 eye;
+            // World position of cell (0, 0, 0).
+            glm::vec3 origin;
+            float stride;
+         };
+
+         struct Stats
+         {
+            unsigned chunks;
+            unsigned drawn;
+            unsigned quads;
+         };
+
+         ChunkGrid();
+         ~ChunkGrid();
+
+         // Faces between two solid cells are dropped when cull_hidden is
+         // set, which is only correct while neighbouring cubes touch; the
+         // same goes for merging faces, so greedy implies cull_hidden.
+         // Returns the number of chunks which were re-meshed.
+         unsigned update(const VoxelSource& source, bool cull_hidden, bool greedy);
+
+         void render(Shader& shader, const View& view);
+
+         // Forgets all GL objects; for context loss.
+         void reset();
+
+         const Stats& get_stats() const { return stats; }
+
+      private:
+         struct Chunk
+         {
+            int origin[3];
+            uint64_t signature;
+            unsigned flags;
+            GLuint vbo;
+            unsigned first[FACE_COUNT];
+            unsigned count[FACE_COUNT];
+            int bounds_min[3];
+            int bounds_max[3];
+            std::vector<ChunkVertex> vertices;
+         };
+
+         struct Build;
+
+         std::map<ChunkKey, Chunk> chunks;
+         GLuint ibo;
+         Stats stats;
+
+         static void build_worker(void* data);
+         static void build_chunk(Chunk& chunk, const Build& build, std::vector<uint8_t>& cells);
+         void upload(Chunk& chunk);
+         void draw_range(GLint cell_loc, GLint corner_loc, unsigned first, unsigned count);
+   };
+}
+
+#endif
@@ -0,0 +1,797 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dynamic_resolution.hpp"
+#include "gl_state.hpp"
+#include "caps.hpp"
+#include "shader.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include <features/features_cpu.h>
+#include <algorithm>
+#include <math.h>
+
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24 0x81A6
+#endif
+
+#ifdef HAVE_OPENGLES
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT_EXT
+#define GL_QUERY_RESULT_EXT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE_EXT
+#define GL_QUERY_RESULT_AVAILABLE_EXT 0x8867
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+#endif
+
+#define DYNRES_QUERIES  4     // Timer queries in flight.
+#define DYNRES_WINDOW   8     // Frames averaged per adjustment.
+#define DYNRES_HEADROOM 0.85f // Grow only below this share of the budget.
+#define DYNRES_GROW     0.05f // Largest step up per adjustment.
+
+#define TEMPORAL_SCALE  0.5f  // Render scale without a budget.
+#define TEMPORAL_PHASES 8     // Length of the jitter sequence.
+#define TEMPORAL_BLEND  0.25f // Weight of a new sample right on a pixel.
+
+using namespace std;
+using namespace glm;
+
+namespace GL
+{
+   namespace DynamicResolution
+   {
+      static const char* vertex_src =
+         "attribute vec2 aVertex;\n"
+         "uniform vec2 uScale;\n"
+         "varying vec2 vTex;\n"
+         "void main() {\n"
+         "  gl_Position = vec4(aVertex, 0.0, 1.0);\n"
+         "  vTex = (aVertex * 0.5 + 0.5) * uScale;\n"
+         "}";
+
+      // uTexel is the texel size in xy and the last texel centre inside
+      // the rendered area in zw; nothing past it is ever sampled.
+      static const char* fragment_src =
+         "#ifdef GL_ES\n"
+         "precision mediump float;\n"
+         "#endif\n"
+         "uniform sampler2D sSource;\n"
+         "uniform vec4 uTexel;\n"
+         "varying vec2 vTex;\n"
+         "vec4 fetch(vec2 uv) {\n"
+         "  return texture2D(sSource, clamp(uv, uTexel.xy * 0.5, uTexel.zw));\n"
+         "}\n"
+         "void main() {\n"
+         "  vec4 color = fetch(vTex);\n"
+         "#ifdef SHARPEN\n"
+         "  vec4 sides = fetch(vTex + vec2(uTexel.x, 0.0)) + fetch(vTex - vec2(uTexel.x, 0.0)) +\n"
+         "     fetch(vTex + vec2(0.0, uTexel.y)) + fetch(vTex - vec2(0.0, uTexel.y));\n"
+         "  color = clamp(color * 1.5 - sides * 0.125, 0.0, 1.0);\n"
+         "#endif\n"
+         "  gl_FragColor = color;\n"
+         "}";
+
+      // vTex is the output position. uRegion maps it into the rendered
+      // area of the target, uJitter is this frame's offset in output
+      // units. uReproject takes the unjittered NDC position of a pixel to
+      // the clip space of the previous frame.
+      static const char* resolve_src =
+         "#ifdef GL_ES\n"
+         "precision highp float;\n"
+         "#endif\n"
+         "uniform sampler2D sSource;\n"
+         "uniform sampler2D sDepth;\n"
+         "uniform sampler2D sHistory;\n"
+         "uniform vec4 uTexel;\n"
+         "uniform vec2 uRegion;\n"
+         "uniform vec2 uJitter;\n"
+         "uniform mat4 uReproject;\n"
+         "uniform float uBlend;\n"
+         "varying vec2 vTex;\n"
+         "vec4 fetch(vec2 uv) {\n"
+         "  return texture2D(sSource, clamp(uv, uTexel.xy * 0.5, uTexel.zw));\n"
+         "}\n"
+         "void main() {\n"
+         "  vec2 uv = (vTex + uJitter) * uRegion;\n"
+         "  vec2 texel = uv / uTexel.xy;\n"
+         "  vec2 offset = fract(texel) - 0.5;\n"
+         "  vec2 centre = (floor(texel) + 0.5) * uTexel.xy;\n"
+         "  vec4 color = fetch(centre);\n"
+         "  vec4 low = color;\n"
+         "  vec4 high = color;\n"
+         "  for (int y = -1; y <= 1; y++) {\n"
+         "    for (int x = -1; x <= 1; x++) {\n"
+         "      vec4 tap = fetch(centre + vec2(float(x), float(y)) * uTexel.xy);\n"
+         "      low = min(low, tap);\n"
+         "      high = max(high, tap);\n"
+         "    }\n"
+         "  }\n"
+         "  float depth = texture2D(sDepth, clamp(centre, uTexel.xy * 0.5, uTexel.zw)).r;\n"
+         "  vec4 prev = uReproject * vec4(vTex * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);\n"
+         "  vec2 history_uv = prev.xy / prev.w * 0.5 + 0.5;\n"
+         "  float blend = uBlend * exp(-8.0 * dot(offset, offset));\n"
+         "  if (uBlend >= 1.0 || any(lessThan(history_uv, vec2(0.0))) ||\n"
+         "        any(greaterThan(history_uv, vec2(1.0))))\n"
+         "    blend = 1.0;\n"
+         "  vec4 history = clamp(texture2D(sHistory, history_uv), low, high);\n"
+         "  gl_FragColor = mix(history, color, blend);\n"
+         "}";
+
+      static float target_ms;
+      static float min_scale = 0.5f;
+      static float max_scale = 1.0f;
+      // Zero until the next begin(), which starts from max_scale.
+      static float scale;
+      static bool sharpen;
+      static bool temporal;
+
+      static GLuint fbo;
+      static GLuint color;
+      static GLuint depth;
+      static bool depth_texture;
+      static GLuint quad;
+      static GLuint vao;
+      static unsigned fbo_width;
+      static unsigned fbo_height;
+      static std1::shared_ptr<Shader> shaders[2];
+
+      // Uniforms of the programs here, looked up once when each is built.
+      enum
+      {
+         LOC_SOURCE = 0,
+         LOC_SCALE,
+         LOC_TEXEL,
+         LOC_DEPTH,
+         LOC_HISTORY,
+         LOC_REGION,
+         LOC_JITTER,
+         LOC_REPROJECT,
+         LOC_BLEND,
+         LOC_COUNT
+      };
+
+      static const char* location_names[LOC_COUNT] = {
+         "sSource",
+         "uScale",
+         "uTexel",
+         "sDepth",
+         "sHistory",
+         "uRegion",
+         "uJitter",
+         "uReproject",
+         "uBlend",
+      };
+
+      static GLint shader_locations[2][LOC_COUNT];
+
+      static GLuint output;
+      static unsigned output_width;
+      static unsigned output_height;
+      static unsigned render_width;
+      static unsigned render_height;
+      static bool offscreen;
+
+      static GLuint history[2];
+      static GLuint history_fbo[2];
+      static unsigned history_width;
+      static unsigned history_height;
+      static unsigned history_index;
+      static bool history_valid;
+      static std1::shared_ptr<Shader> resolve_shader;
+      static GLint resolve_locations[LOC_COUNT];
+      static bool resolving;
+      static unsigned phase;
+      static vec2 jitter_offset;
+      static mat4 view_projection;
+      static mat4 prev_view_projection;
+
+      static GLuint queries[DYNRES_QUERIES];
+      static unsigned query_first;
+      static unsigned query_count;
+#ifdef HAVE_GL3
+      static GLsync fence;
+#endif
+      static retro_time_t frame_start;
+      static float window_ms;
+      static unsigned window_frames;
+
+      void set_target(float ms)
+      {
+         if (target_ms <= 0.0f && ms > 0.0f)
+            scale = 0.0f;
+
+         target_ms     = ms;
+         window_ms     = 0.0f;
+         window_frames = 0;
+      }
+
+      void set_temporal(bool enable)
+      {
+         temporal      = enable;
+         history_valid = false;
+      }
+
+      bool enabled()
+      {
+         return target_ms > 0.0f || temporal;
+      }
+
+      void set_range(float min, float max)
+      {
+         min_scale = min;
+         max_scale = std::max(min, max);
+         if (scale > 0.0f)
+            scale = std::max(min_scale, std::min(max_scale, scale));
+      }
+
+      void set_sharpen(bool enable)
+      {
+         sharpen = enable;
+      }
+
+      unsigned width()
+      {
+         return render_width;
+      }
+
+      unsigned height()
+      {
+         return render_height;
+      }
+
+      float get_scale()
+      {
+         return offscreen ? float(render_width) / output_width : 1.0f;
+      }
+
+      // Depth has to be sampled to reproject; GLES2 only has that with
+      // OES_depth_texture.
+      static bool temporal_supported()
+      {
+         return Caps::depth_texture();
+      }
+
+      static GLuint create_texture(GLenum filter)
+      {
+         GLuint tex;
+         glGenTextures(1, &tex);
+         State::bind_texture(0, GL_TEXTURE_2D, tex);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+         return tex;
+      }
+
+      static bool framebuffer_complete(const char* what)
+      {
+         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE)
+            return true;
+
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "%s is incomplete, rendering at full size.\n", what);
+         return false;
+      }
+
+      static void release_target()
+      {
+         if (fbo)
+            State::delete_framebuffer(fbo);
+         if (depth && depth_texture)
+            State::delete_texture(depth);
+         else if (depth)
+            State::delete_renderbuffer(depth);
+         if (color)
+            State::delete_texture(color);
+         fbo = color = depth = 0;
+         fbo_width = fbo_height = 0;
+      }
+
+      static void init_target(unsigned width, unsigned height)
+      {
+         release_target();
+         fbo_width  = width;
+         fbo_height = height;
+
+         color = create_texture(GL_LINEAR);
+         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+         glGenFramebuffers(1, &fbo);
+         State::bind_framebuffer(fbo);
+         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+
+         depth_texture = temporal_supported();
+         if (depth_texture)
+         {
+            // OES_depth_texture takes no sized formats.
+            GLenum format = Caps::gles() && !Caps::modern() ? GL_DEPTH_COMPONENT : GL_DEPTH_COMPONENT24;
+            depth = create_texture(GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0,
+                  GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+         }
+         else
+         {
+            glGenRenderbuffers(1, &depth);
+            State::bind_renderbuffer(depth);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, width, height);
+            State::bind_renderbuffer(0);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+         }
+         State::bind_texture(0, GL_TEXTURE_2D, 0);
+
+         if (!framebuffer_complete("Dynamic resolution target"))
+            release_target();
+      }
+
+      static void release_history()
+      {
+         for (unsigned i = 0; i < 2; i++)
+         {
+            if (history_fbo[i])
+               State::delete_framebuffer(history_fbo[i]);
+            if (history[i])
+               State::delete_texture(history[i]);
+            history_fbo[i] = history[i] = 0;
+         }
+         history_width = history_height = 0;
+         history_valid = false;
+      }
+
+      static void init_history(unsigned width, unsigned height)
+      {
+         release_history();
+         history_width  = width;
+         history_height = height;
+
+         for (unsigned i = 0; i < 2; i++)
+         {
+            history[i] = create_texture(GL_LINEAR);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+            glGenFramebuffers(1, &history_fbo[i]);
+            State::bind_framebuffer(history_fbo[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, history[i], 0);
+            if (!framebuffer_complete("Temporal history"))
+            {
+               release_history();
+               break;
+            }
+         }
+         State::bind_texture(0, GL_TEXTURE_2D, 0);
+      }
+
+      static void init_quad()
+      {
+         static const GLfloat vertices[] = {
+            -1.0f, -1.0f,
+             1.0f, -1.0f,
+            -1.0f,  1.0f,
+             1.0f,  1.0f,
+         };
+
+         glGenBuffers(1, &quad);
+         State::bind_buffer(GL_ARRAY_BUFFER, quad);
+         glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+         State::bind_buffer(GL_ARRAY_BUFFER, 0);
+
+#ifdef HAVE_GL3
+         if (Caps::modern())
+            glGenVertexArrays(1, &vao);
+#endif
+      }
+
+      static void find_locations(Shader& shader, GLint locations[LOC_COUNT])
+      {
+         for (unsigned i = 0; i < LOC_COUNT; i++)
+            locations[i] = shader.uniform(location_names[i]);
+      }
+
+      static Shader& get_shader()
+      {
+         std1::shared_ptr<Shader>& shader = shaders[sharpen];
+         if (!shader)
+         {
+            shader = std1::shared_ptr<Shader>(new Shader(vertex_src,
+                     sharpen ? string("#define SHARPEN\n") + fragment_src : string(fragment_src)));
+            find_locations(*shader, shader_locations[sharpen]);
+         }
+         return *shader;
+      }
+
+      static void draw_quad(Shader& shader)
+      {
+         GLint loc = shader.attrib(Shader::ATTRIB_VERTEX);
+         State::bind_buffer(GL_ARRAY_BUFFER, quad);
+         glVertexAttribPointer(loc, 2, GL_FLOAT, GL_FALSE, 0, 0);
+         State::enable_vertex_attrib(loc);
+         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+         State::disable_vertex_attrib(loc);
+      }
+
+      static float halton(unsigned index, unsigned base)
+      {
+         float result = 0.0f;
+         float f = 1.0f;
+         while (index)
+         {
+            f /= base;
+            result += f * (index % base);
+            index /= base;
+         }
+         return result;
+      }
+
+      // Timer queries are core or ARB_timer_query on desktop GL, and
+      // EXT_disjoint_timer_query on GLES, which has no 64-bit results.
+      static void begin_query(GLuint query)
+      {
+#ifdef HAVE_OPENGLES
+         glBeginQueryEXT(GL_TIME_ELAPSED_EXT, query);
+#else
+         glBeginQuery(GL_TIME_ELAPSED, query);
+#endif
+      }
+
+      static void end_query()
+      {
+#ifdef HAVE_OPENGLES
+         glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+#else
+         glEndQuery(GL_TIME_ELAPSED);
+#endif
+      }
+
+      // Adds the oldest query to the window, unless wait is false and
+      // its result is not in yet.
+      static bool collect_query(bool wait)
+      {
+         GLuint query = queries[query_first];
+         GLuint available = 0;
+#ifdef HAVE_OPENGLES
+         GLuint elapsed = 0;
+         if (!wait)
+            glGetQueryObjectuivEXT(query, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+         if (!wait && !available)
+            return false;
+         glGetQueryObjectuivEXT(query, GL_QUERY_RESULT_EXT, &elapsed);
+#else
+         GLuint64 elapsed = 0;
+         if (!wait)
+            glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+         if (!wait && !available)
+            return false;
+         glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+#endif
+
+         // Some drivers report a bogus time for the first query; no real
+         // frame takes a second.
+         float ms = elapsed * 1e-6f;
+         if (ms < 1000.0f)
+         {
+            window_ms += ms;
+            window_frames++;
+         }
+         query_first = (query_first + 1) % DYNRES_QUERIES;
+         query_count--;
+         return true;
+      }
+
+      static void start_timing()
+      {
+         frame_start = cpu_features_get_time_usec();
+
+         if (!Caps::timer_query())
+            return;
+
+         if (!queries[0])
+         {
+#ifdef HAVE_OPENGLES
+            glGenQueriesEXT(DYNRES_QUERIES, queries);
+#else
+            glGenQueries(DYNRES_QUERIES, queries);
+#endif
+         }
+
+         // Out of queries: the oldest one has to be waited for.
+         if (query_count == DYNRES_QUERIES)
+            collect_query(true);
+
+         begin_query(queries[(query_first + query_count) % DYNRES_QUERIES]);
+      }
+
+      // Adds the cost of finished frames to the window.
+      static void stop_timing()
+      {
+         if (Caps::timer_query())
+         {
+            end_query();
+            query_count++;
+
+            while (query_count)
+            {
+               if (!collect_query(false))
+                  break;
+            }
+
+#ifdef HAVE_OPENGLES
+            // The GPU changed clocks or was preempted; what was measured
+            // across that means nothing.
+            GLint disjoint = 0;
+            glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+            if (disjoint)
+            {
+               window_ms     = 0.0f;
+               window_frames = 0;
+            }
+#endif
+            return;
+         }
+
+#ifdef HAVE_GL3
+         // Waiting for the previous frame lets this one queue up behind it
+         // without stalling; the wait shows how far the GPU lags behind.
+         if (Caps::modern())
+         {
+            if (fence)
+            {
+               glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+               glDeleteSync(fence);
+            }
+            fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+         }
+#endif
+
+         // Without fences this is CPU time only. Waiting for the GPU would
+         // stall every frame, so its share goes unmeasured.
+         window_ms += (cpu_features_get_time_usec() - frame_start) * 1e-3f;
+         window_frames++;
+      }
+
+      static void adjust()
+      {
+         if (window_frames < DYNRES_WINDOW)
+            return;
+
+         float average = window_ms / window_frames;
+         window_ms     = 0.0f;
+         window_frames = 0;
+
+         // Cost goes with the pixel count, so with the square of the scale.
+         if (average > target_ms)
+            scale *= sqrtf(target_ms / average);
+         else if (average < target_ms * DYNRES_HEADROOM)
+            scale = std::min(scale + DYNRES_GROW, scale * sqrtf(target_ms * DYNRES_HEADROOM / average));
+
+         scale = std::max(min_scale, std::min(max_scale, scale));
+      }
+
+      void begin(GLuint output_fbo, unsigned width, unsigned height)
+      {
+         static bool warned;
+
+         output        = output_fbo;
+         output_width  = width;
+         output_height = height;
+         render_width  = width;
+         render_height = height;
+         offscreen     = false;
+         resolving     = false;
+         jitter_offset = vec2(0.0f);
+
+         bool temporal_on = temporal && temporal_supported();
+         if (temporal && !temporal_on && !warned)
+         {
+            if (log_cb)
+               log_cb(RETRO_LOG_WARN, "Temporal upsampling needs depth textures, which this context lacks.\n");
+            warned = true;
+         }
+
+         if (target_ms > 0.0f || temporal_on)
+         {
+            float largest = target_ms > 0.0f ? max_scale : TEMPORAL_SCALE;
+            unsigned target_width  = unsigned(ceilf(width * largest));
+            unsigned target_height = unsigned(ceilf(height * largest));
+            if (target_width != fbo_width || target_height != fbo_height)
+               init_target(target_width, target_height);
+            offscreen = fbo != 0;
+         }
+
+         if (!offscreen)
+         {
+            history_valid = false;
+            State::bind_framebuffer(output);
+            glViewport(0, 0, width, height);
+            return;
+         }
+
+         if (!(scale > 0.0f))
+            scale = max_scale;
+         float current = target_ms > 0.0f ? scale : TEMPORAL_SCALE;
+         render_width  = std::max(1u, std::min(fbo_width, unsigned(width * current + 0.5f)));
+         render_height = std::max(1u, std::min(fbo_height, unsigned(height * current + 0.5f)));
+
+         if (temporal_on)
+         {
+            if (history_width != width || history_height != height)
+               init_history(width, height);
+            resolving = history[0] != 0;
+         }
+         else if (history[0])
+            release_history();
+
+         if (resolving)
+         {
+            // Halton (2, 3) sub-pixel offsets, in NDC.
+            phase = (phase + 1) % TEMPORAL_PHASES;
+            jitter_offset = vec2((halton(phase + 1, 2) - 0.5f) * 2.0f / render_width,
+                  (halton(phase + 1, 3) - 0.5f) * 2.0f / render_height);
+         }
+
+         // The target is sized for the largest scale; the scissor keeps
+         // clears to the part which is drawn to.
+         State::bind_framebuffer(fbo);
+         glViewport(0, 0, render_width, render_height);
+         glScissor(0, 0, render_width, render_height);
+         State::enable(GL_SCISSOR_TEST);
+
+         if (target_ms > 0.0f)
+            start_timing();
+      }
+
+      mat4 jitter(const mat4& projection, const mat4& view)
+      {
+         view_projection = projection * view;
+         if (!resolving)
+            return projection;
+         return translate(mat4(1.0f), vec3(jitter_offset, 0.0f)) * projection;
+      }
+
+      static void resolve()
+      {
+         unsigned next = history_index ^ 1;
+
+         if (!resolve_shader)
+         {
+            resolve_shader = std1::shared_ptr<Shader>(new Shader(vertex_src, resolve_src));
+            find_locations(*resolve_shader, resolve_locations);
+         }
+         Shader& shader = *resolve_shader;
+         const GLint* loc = resolve_locations;
+
+         mat4 reproject = prev_view_projection * inverse(view_projection);
+
+         State::bind_framebuffer(history_fbo[next]);
+         glViewport(0, 0, history_width, history_height);
+
+         shader.use();
+         glUniform1i(loc[LOC_SOURCE], 0);
+         glUniform1i(loc[LOC_DEPTH], 1);
+         glUniform1i(loc[LOC_HISTORY], 2);
+         glUniform2f(loc[LOC_SCALE], 1.0f, 1.0f);
+         glUniform4f(loc[LOC_TEXEL], 1.0f / fbo_width, 1.0f / fbo_height,
+               (render_width - 0.5f) / fbo_width, (render_height - 0.5f) / fbo_height);
+         glUniform2f(loc[LOC_REGION],
+               float(render_width) / fbo_width, float(render_height) / fbo_height);
+         glUniform2f(loc[LOC_JITTER], jitter_offset.x * 0.5f, jitter_offset.y * 0.5f);
+         glUniformMatrix4fv(loc[LOC_REPROJECT], 1, GL_FALSE, &reproject[0][0]);
+         glUniform1f(loc[LOC_BLEND], history_valid ? TEMPORAL_BLEND : 1.0f);
+
+         State::bind_texture(0, GL_TEXTURE_2D, color);
+         State::bind_texture(1, GL_TEXTURE_2D, depth);
+         State::bind_texture(2, GL_TEXTURE_2D, history[history_index]);
+
+         draw_quad(shader);
+
+         State::bind_texture(1, GL_TEXTURE_2D, 0);
+         State::bind_texture(2, GL_TEXTURE_2D, 0);
+
+         history_index        = next;
+         history_valid        = true;
+         prev_view_projection = view_projection;
+      }
+
+      void end()
+      {
+         if (!offscreen)
+            return;
+
+         State::disable(GL_SCISSOR_TEST);
+         State::disable(GL_DEPTH_TEST);
+         State::disable(GL_CULL_FACE);
+         State::disable(GL_BLEND);
+
+         if (!quad)
+            init_quad();
+#ifdef HAVE_GL3
+         if (vao)
+            State::bind_vertex_array(vao);
+#endif
+
+         if (resolving)
+            resolve();
+
+         State::bind_framebuffer(output);
+         glViewport(0, 0, output_width, output_height);
+
+         // The resolved history is already at output size; it is only
+         // copied, or sharpened on the way.
+         Shader& shader = get_shader();
+         const GLint* loc = shader_locations[sharpen];
+         shader.use();
+         glUniform1i(loc[LOC_SOURCE], 0);
+         if (resolving)
+         {
+            glUniform2f(loc[LOC_SCALE], 1.0f, 1.0f);
+            glUniform4f(loc[LOC_TEXEL], 1.0f / history_width, 1.0f / history_height,
+                  1.0f - 0.5f / history_width, 1.0f - 0.5f / history_height);
+            State::bind_texture(0, GL_TEXTURE_2D, history[history_index]);
+         }
+         else
+         {
+            glUniform2f(loc[LOC_SCALE],
+                  float(render_width) / fbo_width, float(render_height) / fbo_height);
+            glUniform4f(loc[LOC_TEXEL], 1.0f / fbo_width, 1.0f / fbo_height,
+                  (render_width - 0.5f) / fbo_width, (render_height - 0.5f) / fbo_height);
+            State::bind_texture(0, GL_TEXTURE_2D, color);
+         }
+
+         draw_quad(shader);
+
+         State::bind_texture(0, GL_TEXTURE_2D, 0);
+         State::bind_buffer(GL_ARRAY_BUFFER, 0);
+#ifdef HAVE_GL3
+         if (vao)
+            State::bind_vertex_array(0);
+#endif
+         Shader::unbind();
+
+         if (target_ms > 0.0f)
+         {
+            stop_timing();
+            adjust();
+         }
+      }
+
+      void reset()
+      {
+         fbo = color = depth = 0;
+         fbo_width = fbo_height = 0;
+         quad = vao = 0;
+         shaders[0].reset();
+         shaders[1].reset();
+         for (unsigned i = 0; i < 2; i++)
+            history_fbo[i] = history[i] = 0;
+         history_width = history_height = 0;
+         history_valid = false;
+         resolve_shader.reset();
+         for (unsigned i = 0; i < DYNRES_QUERIES; i++)
+            queries[i] = 0;
+         query_first = query_count = 0;
+#ifdef HAVE_GL3
+         fence = NULL;
+#endif
+         window_ms     = 0.0f;
+         window_frames = 0;
+      }
+   }
+}
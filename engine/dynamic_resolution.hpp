@@ -0,0 +1,72 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DYNAMIC_RESOLUTION_HPP__
+#define DYNAMIC_RESOLUTION_HPP__
+
+#include "gl.hpp"
+#include "glm/glm.hpp"
+
+namespace GL
+{
+   // Renders frames into an offscreen target whose size follows the
+   // measured frame cost, then scales them up to the output. The scale
+   // is adjusted every few frames to keep the cost under a budget.
+   //
+   // Cost is GPU time from timer queries where the context has them.
+   // Otherwise it is CPU time plus the wait on the previous frame's
+   // fence, or only CPU time on contexts without fences.
+   //
+   // Temporal upsampling renders at half size, or at the dynamic scale
+   // with a budget set, with a sub-pixel jitter which changes every
+   // frame. The history at output size is reprojected with the camera
+   // motion, clamped to the colours around each pixel and blended with
+   // the new frame. It needs depth textures, which GLES2 only has with
+   // OES_depth_texture.
+   namespace DynamicResolution
+   {
+      // Frame budget in milliseconds. 0 turns the dynamic scale off.
+      void set_target(float ms);
+      void set_temporal(bool temporal);
+      // Whether frames go through the offscreen target at all.
+      bool enabled();
+
+      // Bounds of the render scale, per axis. Above 1 supersamples.
+      void set_range(float min_scale, float max_scale);
+      // Sharpens while scaling up, instead of a plain bilinear filter.
+      void set_sharpen(bool sharpen);
+
+      // Binds the framebuffer to draw the frame into and sets the
+      // viewport; width() and height() are its size until end().
+      void begin(GLuint output, unsigned output_width, unsigned output_height);
+      unsigned width();
+      unsigned height();
+      // The camera projection to draw the frame with: jittered when
+      // upsampling temporally, which also keeps projection * view to
+      // reproject the history with. Only valid after begin().
+      glm::mat4 jitter(const glm::mat4& projection, const glm::mat4& view);
+      // Scales the frame up into the output, left bound.
+      void end();
+
+      float get_scale();
+
+      // Forgets the GL objects of a context which is gone.
+      void reset();
+   }
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frustum.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace GL
+{
+   void AABB::expand(const AABB& other)
+   {
+      lo = glm::min(lo, other.lo);
+      hi = glm::max(hi, other.hi);
+   }
+
+   AABB AABB::transformed(const glm::mat4& transform) const
+   {
+      glm::vec3 center = glm::vec3(transform * glm::vec4(this->center(), 1.0f));
+      glm::vec3 extent = (hi - lo) * 0.5f;
+      glm::vec3 radius(0.0f);
+
+      for (unsigned i = 0; i < 3; i++)
+         radius += glm::abs(glm::vec3(transform[i])) * extent[i];
+
+      return AABB(center - radius, center + radius);
+   }
+
+   Frustum::Frustum(const glm::mat4& m)
+   {
+      glm::vec4 rows[4];
+
+      for (unsigned i = 0; i < 4; i++)
+         rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         planes[i * 2 + 0] = rows[3] + rows[i];
+         planes[i * 2 + 1] = rows[3] - rows[i];
+      }
+
+      // Padding planes hold every point inside.
+      for (unsigned i = 0; i < 8; i++)
+      {
+         glm::vec4 plane = i < 6 ? planes[i] : glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+         for (unsigned c = 0; c < 4; c++)
+            plane_rows[c][i] = plane[c];
+      }
+   }
+
+   Frustum::Result Frustum::test(const AABB& box, unsigned& mask) const
+   {
+#ifdef __SSE2__
+      // The far corner along a plane's normal gives the larger product on
+      // each axis, the near corner the smaller one.
+      __m128 lo_x = _mm_set1_ps(box.lo.x), hi_x = _mm_set1_ps(box.hi.x);
+      __m128 lo_y = _mm_set1_ps(box.lo.y), hi_y = _mm_set1_ps(box.hi.y);
+      __m128 lo_z = _mm_set1_ps(box.lo.z), hi_z = _mm_set1_ps(box.hi.z);
+      __m128 zero = _mm_setzero_ps();
+
+      for (unsigned base = 0; base < 8; base += 4)
+      {
+         unsigned group = (mask >> base) & 0xf;
+         if (!group)
+            continue;
+
+         __m128 x  = _mm_loadu_ps(plane_rows[0] + base);
+         __m128 y  = _mm_loadu_ps(plane_rows[1] + base);
+         __m128 z  = _mm_loadu_ps(plane_rows[2] + base);
+         __m128 w  = _mm_loadu_ps(plane_rows[3] + base);
+         __m128 px = _mm_mul_ps(x, lo_x), qx = _mm_mul_ps(x, hi_x);
+         __m128 py = _mm_mul_ps(y, lo_y), qy = _mm_mul_ps(y, hi_y);
+         __m128 pz = _mm_mul_ps(z, lo_z), qz = _mm_mul_ps(z, hi_z);
+
+         __m128 far_dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_max_ps(px, qx),
+                     _mm_max_ps(py, qy)), _mm_max_ps(pz, qz)), w);
+         if (_mm_movemask_ps(_mm_cmplt_ps(far_dist, zero)) & group)
+            return OUTSIDE;
+
+         __m128 near_dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_min_ps(px, qx),
+                     _mm_min_ps(py, qy)), _mm_min_ps(pz, qz)), w);
+         mask &= ~((_mm_movemask_ps(_mm_cmpge_ps(near_dist, zero)) & group) << base);
+      }
+#else
+      for (unsigned i = 0; i < 6; i++)
+      {
+         if (!(mask & (1 << i)))
+            continue;
+
+         const glm::vec4& plane = planes[i];
+         glm::vec3 normal(plane);
+         glm::vec3 near_corner(
+               plane.x > 0.0f ? box.lo.x : box.hi.x,
+               plane.y > 0.0f ? box.lo.y : box.hi.y,
+               plane.z > 0.0f ? box.lo.z : box.hi.z);
+         glm::vec3 far_corner(
+               plane.x > 0.0f ? box.hi.x : box.lo.x,
+               plane.y > 0.0f ? box.hi.y : box.lo.y,
+               plane.z > 0.0f ? box.hi.z : box.lo.z);
+
+         if (glm::dot(normal, far_corner) + plane.w < 0.0f)
+            return OUTSIDE;
+         if (glm::dot(normal, near_corner) + plane.w >= 0.0f)
+            mask &= ~(1u << i);
+      }
+#endif
+
+      return mask ? INTERSECTS : INSIDE;
+   }
+
+   bool Frustum::visible(const AABB& box) const
+   {
+      unsigned mask = ALL_PLANES;
+      return test(box, mask) != OUTSIDE;
+   }
+}
@@ -0,0 +1,68 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRUSTUM_HPP__
+#define FRUSTUM_HPP__
+
+#include "glm/glm.hpp"
+
+namespace GL
+{
+   struct AABB
+   {
+      AABB() : lo(0.0f), hi(0.0f) {}
+      AABB(const glm::vec3& lo, const glm::vec3& hi) : lo(lo), hi(hi) {}
+
+      glm::vec3 lo;
+      glm::vec3 hi;
+
+      glm::vec3 center() const { return (lo + hi) * 0.5f; }
+      void expand(const AABB& other);
+
+      // Box around this one after an affine transform.
+      AABB transformed(const glm::mat4& transform) const;
+   };
+
+   // The six clip planes of a view-projection matrix, in world space.
+   class Frustum
+   {
+      public:
+         enum Result
+         {
+            OUTSIDE = 0,
+            INTERSECTS,
+            INSIDE
+         };
+
+         enum { ALL_PLANES = (1 << 6) - 1 };
+
+         Frustum(const glm::mat4& view_projection);
+
+         // Only planes set in mask are tested; those the box lies fully
+         // inside of are cleared, so children of the box can skip them.
+         Result test(const AABB& box, unsigned& mask) const;
+         bool visible(const AABB& box) const;
+
+      private:
+         glm::vec4 planes[6];
+         // The same planes as x, y, z and w rows, padded to two groups of
+         // four, for testing four planes at once.
+         float plane_rows[4][8];
+   };
+}
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "geometry_pool.hpp"
+#include "gl_state.hpp"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace GL
+{
+   namespace GeometryPool
+   {
+      struct Block
+      {
+         Block() : buffer(0), vao(0), stride(0), size(0), used(0) {}
+
+         GLuint buffer;
+         GLuint vao;
+         GLsizei stride;
+         GLsizei size;
+         GLsizei used;
+         // Free runs as (first, count), sorted by first.
+         vector<pair<GLint, GLsizei> > free_list;
+      };
+
+      static vector<Block> blocks;
+
+      static bool allocate_from(Block& block, GLsizei count, GeometryRange& range)
+      {
+         for (unsigned i = 0; i < block.free_list.size(); i++)
+         {
+            pair<GLint, GLsizei>& run = block.free_list[i];
+            if (run.second < count)
+               continue;
+
+            range.first = run.first;
+            range.count = count;
+            run.first  += count;
+            run.second -= count;
+            if (!run.second)
+               block.free_list.erase(block.free_list.begin() + i);
+
+            block.used += count;
+            return true;
+         }
+
+         return false;
+      }
+
+      GeometryRange allocate(GLsizei count, GLsizei stride)
+      {
+         GeometryRange range;
+         if (count <= 0)
+            return range;
+
+         for (unsigned i = 0; i < blocks.size(); i++)
+         {
+            if (blocks[i].buffer && blocks[i].stride == stride &&
+                  allocate_from(blocks[i], count, range))
+            {
+               range.block = i;
+               return range;
+            }
+         }
+
+         unsigned index = 0;
+         while (index < blocks.size() && blocks[index].buffer)
+            index++;
+         if (index == blocks.size())
+            blocks.push_back(Block());
+
+         Block& block = blocks[index];
+         block.stride = stride;
+         block.size   = max<GLsizei>(BLOCK_BYTES / stride, count);
+         block.used   = 0;
+         block.free_list.assign(1, make_pair(GLint(0), block.size));
+
+         glGenBuffers(1, &block.buffer);
+         State::bind_buffer(GL_ARRAY_BUFFER, block.buffer);
+         glBufferData(GL_ARRAY_BUFFER, block.size * stride, NULL, GL_STATIC_DRAW);
+         State::bind_buffer(GL_ARRAY_BUFFER, 0);
+
+         allocate_from(block, count, range);
+         range.block = index;
+         return range;
+      }
+
+      void free(GeometryRange& range)
+      {
+         if (range.block >= blocks.size() || !blocks[range.block].buffer)
+         {
+            range = GeometryRange();
+            return;
+         }
+
+         Block& block = blocks[range.block];
+         vector<pair<GLint, GLsizei> >& list = block.free_list;
+         vector<pair<GLint, GLsizei> >::iterator itr = lower_bound(list.begin(), list.end(),
+               make_pair(range.first, GLsizei(0)));
+
+         itr = list.insert(itr, make_pair(range.first, range.count));
+         if (itr + 1 != list.end() && itr->first + itr->second == (itr + 1)->first)
+         {
+            itr->second += (itr + 1)->second;
+            list.erase(itr + 1);
+         }
+         if (itr != list.begin() && (itr - 1)->first + (itr - 1)->second == itr->first)
+         {
+            (itr - 1)->second += itr->second;
+            list.erase(itr);
+         }
+
+         block.used -= range.count;
+         range = GeometryRange();
+
+         if (!block.used && !renderer_dead_state)
+         {
+            State::delete_buffer(block.buffer);
+#ifdef HAVE_GL3
+            if (block.vao)
+               State::delete_vertex_array(block.vao);
+#endif
+            block = Block();
+         }
+      }
+
+      void write(const GeometryRange& range, const void* data)
+      {
+         if (range.block >= blocks.size() || !range.count)
+            return;
+
+         const Block& block = blocks[range.block];
+         State::bind_buffer(GL_ARRAY_BUFFER, block.buffer);
+         glBufferSubData(GL_ARRAY_BUFFER, range.first * block.stride,
+               range.count * block.stride, data);
+         State::bind_buffer(GL_ARRAY_BUFFER, 0);
+      }
+
+      GLuint buffer(unsigned block)
+      {
+         return block < blocks.size() ? blocks[block].buffer : 0;
+      }
+
+      GLuint vertex_array(unsigned block)
+      {
+         return block < blocks.size() ? blocks[block].vao : 0;
+      }
+
+      void set_vertex_array(unsigned block, GLuint vao)
+      {
+         if (block < blocks.size())
+            blocks[block].vao = vao;
+      }
+
+      void release()
+      {
+         for (unsigned i = 0; i < blocks.size() && !renderer_dead_state; i++)
+         {
+            if (blocks[i].buffer)
+               State::delete_buffer(blocks[i].buffer);
+#ifdef HAVE_GL3
+            if (blocks[i].vao)
+               State::delete_vertex_array(blocks[i].vao);
+#endif
+         }
+         blocks.clear();
+      }
+   }
+}
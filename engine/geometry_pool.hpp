@@ -0,0 +1,61 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GEOMETRY_POOL_HPP__
+#define GEOMETRY_POOL_HPP__
+
+#include "gl.hpp"
+
+namespace GL
+{
+   // A run of vertices inside one of the pool's buffers. Draw it with
+   // glDrawArrays(mode, first, count) while the block is bound.
+   struct GeometryRange
+   {
+      GeometryRange() : block(~0u), first(0), count(0) {}
+
+      unsigned block;
+      GLint first;
+      GLsizei count;
+   };
+
+   // Suballocates vertex storage out of a few large buffers, so meshes
+   // drawn one after the other share a buffer and their attribute setup.
+   // Blocks hold vertices of one stride each; a mesh bigger than a block
+   // gets a block of its own.
+   namespace GeometryPool
+   {
+      enum { BLOCK_BYTES = 4 << 20 };
+
+      // count == 0 gives an empty range which is never drawn.
+      GeometryRange allocate(GLsizei count, GLsizei stride);
+      void free(GeometryRange& range);
+      void write(const GeometryRange& range, const void* data);
+
+      GLuint buffer(unsigned block);
+
+      // VAO recorded for the block on the GL3 path, 0 until set.
+      GLuint vertex_array(unsigned block);
+      void set_vertex_array(unsigned block, GLuint vao);
+
+      // Drops every block. With renderer_dead_state set the buffers are
+      // only forgotten, as on context teardown.
+      void release();
+   }
+}
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gl_state.hpp"
+#include <string.h>
+
+#define UNKNOWN_NAME   (~0u)
+#define MAX_UNITS      8
+#define MAX_ATTRIBS    16
+#define MAX_BINDINGS   4
+
+namespace GL
+{
+   namespace State
+   {
+      enum Cap
+      {
+         CAP_DEPTH_TEST = 0,
+         CAP_CULL_FACE,
+         CAP_BLEND,
+         CAP_COUNT
+      };
+
+      // Every tracked value starts out unknown, which forces the first
+      // request to be issued.
+      static signed char caps[CAP_COUNT];
+      static signed char attribs[MAX_ATTRIBS];
+      static GLuint blend_src;
+      static GLuint blend_dst;
+      static GLuint front;
+      static GLuint depth_write;
+      static GLuint depth_compare;
+      static GLuint color_write;
+      static GLuint program;
+      static GLuint array_buffer;
+      static GLuint element_buffer;
+      static GLuint active_unit;
+      static GLuint textures[MAX_UNITS];
+      static GLuint framebuffer;
+      static GLuint renderbuffer;
+#ifdef HAVE_GL3
+      static GLuint uniform_buffer;
+      static GLuint uniform_bindings[MAX_BINDINGS];
+      static GLuint vertex_array;
+#endif
+      static Stats stats;
+
+      static int cap_index(GLenum cap)
+      {
+         switch (cap)
+         {
+            case GL_DEPTH_TEST:
+               return CAP_DEPTH_TEST;
+            case GL_CULL_FACE:
+               return CAP_CULL_FACE;
+            case GL_BLEND:
+               return CAP_BLEND;
+            default:
+               return -1;
+         }
+      }
+
+      static inline bool changed(GLuint& shadow, GLuint value)
+      {
+         if (shadow == value)
+         {
+            stats.elided++;
+            return false;
+         }
+
+         shadow = value;
+         stats.issued++;
+         return true;
+      }
+
+      void reset()
+      {
+         unsigned i;
+
+         memset(caps, -1, sizeof(caps));
+         memset(attribs, -1, sizeof(attribs));
+         blend_src      = UNKNOWN_NAME;
+         blend_dst      = UNKNOWN_NAME;
+         front          = UNKNOWN_NAME;
+         depth_write    = UNKNOWN_NAME;
+         depth_compare  = UNKNOWN_NAME;
+         color_write    = UNKNOWN_NAME;
+         program        = UNKNOWN_NAME;
+         array_buffer   = UNKNOWN_NAME;
+         element_buffer = UNKNOWN_NAME;
+         active_unit    = UNKNOWN_NAME;
+         framebuffer    = UNKNOWN_NAME;
+         renderbuffer   = UNKNOWN_NAME;
+
+         for (i = 0; i < MAX_UNITS; i++)
+            textures[i] = UNKNOWN_NAME;
+
+#ifdef HAVE_GL3
+         uniform_buffer = UNKNOWN_NAME;
+         vertex_array   = UNKNOWN_NAME;
+         for (i = 0; i < MAX_BINDINGS; i++)
+            uniform_bindings[i] = UNKNOWN_NAME;
+#endif
+      }
+
+      static void set_cap(GLenum cap, bool enable)
+      {
+         int index = cap_index(cap);
+
+         if (index >= 0)
+         {
+            if (caps[index] == (signed char)enable)
+            {
+               stats.elided++;
+               return;
+            }
+            caps[index] = enable;
+         }
+
+         stats.issued++;
+         if (enable)
+            glEnable(cap);
+         else
+            glDisable(cap);
+      }
+
+      void enable(GLenum cap)
+      {
+         set_cap(cap, true);
+      }
+
+      void disable(GLenum cap)
+      {
+         set_cap(cap, false);
+      }
+
+      void blend_func(GLenum src, GLenum dst)
+      {
+         if (blend_src == src && blend_dst == dst)
+         {
+            stats.elided++;
+            return;
+         }
+
+         blend_src = src;
+         blend_dst = dst;
+         stats.issued++;
+         glBlendFunc(src, dst);
+      }
+
+      void front_face(GLenum mode)
+      {
+         if (changed(front, mode))
+            glFrontFace(mode);
+      }
+
+      void depth_mask(GLboolean mask)
+      {
+         if (changed(depth_write, mask))
+            glDepthMask(mask);
+      }
+
+      void depth_func(GLenum func)
+      {
+         if (changed(depth_compare, func))
+            glDepthFunc(func);
+      }
+
+      void color_mask(GLboolean mask)
+      {
+         if (changed(color_write, mask))
+            glColorMask(mask, mask, mask, mask);
+      }
+
+      void use_program(GLuint prog)
+      {
+         if (changed(program, prog))
+            glUseProgram(prog);
+      }
+
+      void bind_buffer(GLenum target, GLuint buffer)
+      {
+         GLuint* shadow = NULL;
+
+         if (target == GL_ARRAY_BUFFER)
+            shadow = &array_buffer;
+         else if (target == GL_ELEMENT_ARRAY_BUFFER)
+            shadow = &element_buffer;
+#ifdef HAVE_GL3
+         else if (target == GL_UNIFORM_BUFFER)
+            shadow = &uniform_buffer;
+#endif
+
+         if (!shadow)
+         {
+            stats.issued++;
+            glBindBuffer(target, buffer);
+         }
+         else if (changed(*shadow, buffer))
+            glBindBuffer(target, buffer);
+      }
+
+      void bind_texture(unsigned unit, GLenum target, GLuint tex)
+      {
+         // Callers may go on to edit the texture, so the unit is made
+         // active even when the binding itself is elided.
+         if (changed(active_unit, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+
+         if (target == GL_TEXTURE_2D && unit < MAX_UNITS &&
+               textures[unit] == tex)
+         {
+            stats.elided++;
+            return;
+         }
+
+         // Only 2D bindings are tracked; anything else is passed through
+         // and the unit's 2D binding left as it was.
+         if (target == GL_TEXTURE_2D && unit < MAX_UNITS)
+            textures[unit] = tex;
+
+         stats.issued++;
+         glBindTexture(target, tex);
+      }
+
+      void bind_framebuffer(GLuint fbo)
+      {
+         if (changed(framebuffer, fbo))
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+      }
+
+      void bind_renderbuffer(GLuint rbo)
+      {
+         if (changed(renderbuffer, rbo))
+            glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+      }
+
+      static void set_attrib(GLuint index, bool enable)
+      {
+         if (index < MAX_ATTRIBS)
+         {
+            if (attribs[index] == (signed char)enable)
+            {
+               stats.elided++;
+               return;
+            }
+            attribs[index] = enable;
+         }
+
+         stats.issued++;
+         if (enable)
+            glEnableVertexAttribArray(index);
+         else
+            glDisableVertexAttribArray(index);
+      }
+
+      void enable_vertex_attrib(GLuint index)
+      {
+         set_attrib(index, true);
+      }
+
+      void disable_vertex_attrib(GLuint index)
+      {
+         set_attrib(index, false);
+      }
+
+#ifdef HAVE_GL3
+      void bind_buffer_base(GLenum target, GLuint index, GLuint buffer)
+      {
+         bool tracked = target == GL_UNIFORM_BUFFER && index < MAX_BINDINGS;
+
+         if (tracked && uniform_bindings[index] == buffer)
+         {
+            stats.elided++;
+            return;
+         }
+
+         // Indexed binds also replace the generic binding point.
+         if (tracked)
+         {
+            uniform_bindings[index] = buffer;
+            uniform_buffer          = buffer;
+         }
+         else if (target == GL_UNIFORM_BUFFER)
+            uniform_buffer = UNKNOWN_NAME;
+
+         stats.issued++;
+         glBindBufferBase(target, index, buffer);
+      }
+
+      void bind_buffer_range(GLenum target, GLuint index, GLuint buffer,
+            GLintptr offset, GLsizeiptr size)
+      {
+         // A later base bind of the same buffer still has to go out.
+         if (target == GL_UNIFORM_BUFFER)
+         {
+            if (index < MAX_BINDINGS)
+               uniform_bindings[index] = UNKNOWN_NAME;
+            uniform_buffer = buffer;
+         }
+
+         stats.issued++;
+         glBindBufferRange(target, index, buffer, offset, size);
+      }
+
+      void bind_vertex_array(GLuint vao)
+      {
+         if (!changed(vertex_array, vao))
+            return;
+
+         glBindVertexArray(vao);
+
+         // Attribute enables and the element buffer belong to the VAO.
+         element_buffer = UNKNOWN_NAME;
+         memset(attribs, -1, sizeof(attribs));
+      }
+#endif
+
+      void delete_program(GLuint prog)
+      {
+         // A program in use is only flagged for deletion, so its name
+         // stays current until something else is bound.
+         glDeleteProgram(prog);
+         if (program == prog)
+            program = UNKNOWN_NAME;
+      }
+
+      void delete_buffer(GLuint buffer)
+      {
+         glDeleteBuffers(1, &buffer);
+         if (array_buffer == buffer)
+            array_buffer = 0;
+         if (element_buffer == buffer)
+            element_buffer = 0;
+#ifdef HAVE_GL3
+         if (uniform_buffer == buffer)
+            uniform_buffer = 0;
+         for (unsigned i = 0; i < MAX_BINDINGS; i++)
+         {
+            if (uniform_bindings[i] == buffer)
+               uniform_bindings[i] = 0;
+         }
+#endif
+      }
+
+      void delete_texture(GLuint tex)
+      {
+         unsigned i;
+
+         glDeleteTextures(1, &tex);
+         for (i = 0; i < MAX_UNITS; i++)
+         {
+            if (textures[i] == tex)
+               textures[i] = 0;
+         }
+      }
+
+      // A bound framebuffer or renderbuffer reverts to zero, which for
+      // the framebuffer is not necessarily the frontend's.
+      void delete_framebuffer(GLuint fbo)
+      {
+         glDeleteFramebuffers(1, &fbo);
+         if (framebuffer == fbo)
+            framebuffer = 0;
+      }
+
+      void delete_renderbuffer(GLuint rbo)
+      {
+         glDeleteRenderbuffers(1, &rbo);
+         if (renderbuffer == rbo)
+            renderbuffer = 0;
+      }
+
+#ifdef HAVE_GL3
+      void delete_vertex_array(GLuint vao)
+      {
+         glDeleteVertexArrays(1, &vao);
+         if (vertex_array == vao)
+         {
+            vertex_array   = 0;
+            element_buffer = UNKNOWN_NAME;
+            memset(attribs, -1, sizeof(attribs));
+         }
+      }
+#endif
+
+      const Stats& get_stats()
+      {
+         return stats;
+      }
+
+      void reset_stats()
+      {
+         stats.issued = 0;
+         stats.elided = 0;
+      }
+   }
+}
@@ -0,0 +1,82 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GL_STATE_HPP__
+#define GL_STATE_HPP__
+
+#include "gl.hpp"
+
+namespace GL
+{
+   // Shadow copy of the GL state the engine touches. Requests which would
+   // not change the current state are dropped before they reach the driver.
+   //
+   // The frontend is free to change state between frames, so the shadow
+   // must be invalidated with reset() before the core renders again.
+   namespace State
+   {
+      struct Stats
+      {
+         unsigned issued;
+         unsigned elided;
+      };
+
+      void reset();
+
+      void enable(GLenum cap);
+      void disable(GLenum cap);
+      void blend_func(GLenum src, GLenum dst);
+      void front_face(GLenum mode);
+      void depth_mask(GLboolean mask);
+      void depth_func(GLenum func);
+      void color_mask(GLboolean mask);
+
+      void use_program(GLuint prog);
+      void bind_buffer(GLenum target, GLuint buffer);
+      // Leaves the unit active, so glTexParameter and glTexImage calls
+      // which follow apply to tex.
+      void bind_texture(unsigned unit, GLenum target, GLuint tex);
+      // Binds GL_FRAMEBUFFER, so both the draw and read framebuffers.
+      void bind_framebuffer(GLuint fbo);
+      void bind_renderbuffer(GLuint rbo);
+      void enable_vertex_attrib(GLuint index);
+      void disable_vertex_attrib(GLuint index);
+#ifdef HAVE_GL3
+      void bind_buffer_base(GLenum target, GLuint index, GLuint buffer);
+      // Never elided; the range usually moves between calls.
+      void bind_buffer_range(GLenum target, GLuint index, GLuint buffer,
+            GLintptr offset, GLsizeiptr size);
+      void bind_vertex_array(GLuint vao);
+#endif
+
+      // Deleting an object implicitly unbinds it, so these keep the
+      // shadow in sync with what the driver does.
+      void delete_program(GLuint prog);
+      void delete_buffer(GLuint buffer);
+      void delete_texture(GLuint tex);
+      void delete_framebuffer(GLuint fbo);
+      void delete_renderbuffer(GLuint rbo);
+#ifdef HAVE_GL3
+      void delete_vertex_array(GLuint vao);
+#endif
+
+      const Stats& get_stats();
+      void reset_stats();
+   }
+}
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "light_bake.hpp"
+#include "bake_util.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+
+using namespace std;
+
+// Hemisphere rays per vertex, shared by ambient occlusion and the bounce.
+#define LIGHT_BAKE_SAMPLES 64
+// Occluders further away than this share of the level's longest side
+// do not darken the ambient term.
+#define LIGHT_BAKE_AO_RANGE 0.1f
+// Textures are not kept on the CPU, so bounced light takes a grey.
+#define LIGHT_BAKE_ALBEDO 0.5f
+#define LIGHT_BAKE_MAGIC 0x3154494c // "LIT1"
+
+namespace GL
+{
+   struct LightBake::Bake
+   {
+      LightBake* light_bake;
+      // Three corners per triangle, in world space.
+      vector<glm::vec3> triangles;
+      BVH bvh;
+      vector<glm::vec3> positions;
+      vector<glm::vec3> normals;
+      glm::vec3 light_pos;
+      float extent;
+      float epsilon;
+   };
+
+   // Nearest triangle along origin + t * dir, 0 < t <= 1.
+   static bool trace(const vector<glm::vec3>& triangles, const BVH& bvh,
+         const glm::vec3& origin, const glm::vec3& dir,
+         vector<unsigned>& hits, float& nearest, unsigned& hit)
+   {
+      nearest = 1.0f;
+      hit = ~0u;
+
+      hits.clear();
+      bvh.raycast(origin, dir, hits);
+      for (unsigned i = 0; i < hits.size(); i++)
+      {
+         float t;
+         if (intersect_triangle(&triangles[hits[i] * 3], origin, dir, t) &&
+               t > 1e-5f && t < nearest)
+         {
+            nearest = t;
+            hit = hits[i];
+         }
+      }
+
+      return hit != ~0u;
+   }
+
+   // Lambert term of the point light, zero in shadow.
+   float LightBake::direct_light(const Bake& bake, const glm::vec3& pos,
+         const glm::vec3& normal, vector<unsigned>& hits)
+   {
+      glm::vec3 origin = pos + normal * bake.epsilon;
+      glm::vec3 to_light = bake.light_pos - origin;
+      float lambert = glm::dot(glm::normalize(to_light), normal);
+      float t;
+      unsigned hit;
+
+      if (!(lambert > 0.0f) ||
+            trace(bake.triangles, bake.bvh, origin, to_light, hits, t, hit))
+         return 0.0f;
+      return lambert;
+   }
+
+   LightBake::LightBake() : signature(0), light_pos(0.0f), vertices(0)
+   {}
+
+   void LightBake::clear()
+   {
+      light.clear();
+   }
+
+   uint32_t LightBake::sign(const vector<std1::shared_ptr<Mesh> >& meshes,
+         const glm::vec3& light_pos)
+   {
+      const float params[] = {
+         light_pos.x, light_pos.y, light_pos.z,
+         LIGHT_BAKE_SAMPLES, LIGHT_BAKE_AO_RANGE, LIGHT_BAKE_ALBEDO,
+      };
+      uint32_t crc = crc32(0, (const Bytef*)params, sizeof(params));
+
+      for (unsigned i = 0; i < meshes.size(); i++)
+      {
+         const vector<Vertex>& verts = *meshes[i]->get_vertex();
+         if (!verts.empty())
+            crc = crc32(crc, (const Bytef*)&verts[0], verts.size() * sizeof(Vertex));
+         crc = crc32(crc, (const Bytef*)&meshes[i]->get_model(), sizeof(glm::mat4));
+      }
+
+      return crc;
+   }
+
+   void LightBake::setup(const vector<std1::shared_ptr<Mesh> >& meshes,
+         const glm::vec3& light_pos)
+   {
+      clear();
+      vertices = 0;
+      this->light_pos = light_pos;
+      signature = sign(meshes, light_pos);
+
+      for (unsigned i = 0; i < meshes.size(); i++)
+         vertices += meshes[i]->get_vertex()->size();
+   }
+
+   void LightBake::bake_vertex(void* data, unsigned index, vector<unsigned>& hits)
+   {
+      Bake& bake = *static_cast<Bake*>(data);
+      glm::vec3 pos = bake.positions[index];
+      glm::vec3 normal = bake.normals[index];
+      float* out = &bake.light_bake->light[index * 2];
+      uint32_t state = index * 2654435761u + 1;
+
+      out[0] = 0.0f;
+      out[1] = 1.0f;
+      if (!(glm::dot(normal, normal) > 0.0f))
+         return;
+      normal = glm::normalize(normal);
+
+      glm::vec3 tangent = fabsf(normal.x) > 0.5f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+      tangent = glm::normalize(glm::cross(tangent, normal));
+      glm::vec3 bitangent = glm::cross(normal, tangent);
+      glm::vec3 origin = pos + normal * bake.epsilon;
+
+      float bounce = 0.0f;
+      unsigned occluded = 0;
+
+      // Cosine weighted, so the bounce is a plain average of what the
+      // rays hit.
+      for (unsigned s = 0; s < LIGHT_BAKE_SAMPLES; s++)
+      {
+         float phi = 2.0f * 3.14159265f * BakeUtil::random_unit(state);
+         float r2 = BakeUtil::random_unit(state);
+         float r = sqrtf(r2);
+         glm::vec3 dir = (tangent * (r * cosf(phi)) + bitangent * (r * sinf(phi)) +
+               normal * sqrtf(1.0f - r2)) * bake.extent;
+
+         float t;
+         unsigned hit;
+         if (!trace(bake.triangles, bake.bvh, origin, dir, hits, t, hit))
+            continue;
+
+         if (t < LIGHT_BAKE_AO_RANGE)
+            occluded++;
+
+         const glm::vec3* tri = &bake.triangles[hit * 3];
+         glm::vec3 hit_normal = glm::cross(tri[1] - tri[0], tri[2] - tri[0]);
+         if (glm::dot(hit_normal, dir) > 0.0f)
+            hit_normal = -hit_normal;
+
+         bounce += direct_light(bake, origin + dir * t, glm::normalize(hit_normal), hits);
+      }
+
+      out[0] = direct_light(bake, pos, normal, hits) +
+         LIGHT_BAKE_ALBEDO * bounce / LIGHT_BAKE_SAMPLES;
+      out[1] = 1.0f - float(occluded) / LIGHT_BAKE_SAMPLES;
+   }
+
+   void LightBake::bake(const vector<std1::shared_ptr<Mesh> >& meshes,
+         const glm::vec3& light_pos)
+   {
+      setup(meshes, light_pos);
+      if (!vertices)
+         return;
+
+      Bake bake;
+      bake.light_bake = this;
+      bake.light_pos = light_pos;
+
+      AABB bounds;
+      vector<AABB> boxes;
+      for (unsigned i = 0; i < meshes.size(); i++)
+      {
+         const vector<Vertex>& verts = *meshes[i]->get_vertex();
+         const glm::mat4& model = meshes[i]->get_model();
+         bool triangles = meshes[i]->get_vertex_type() == GL_TRIANGLES;
+
+         if (i == 0)
+            bounds = meshes[i]->get_world_bounds();
+         else
+            bounds.expand(meshes[i]->get_world_bounds());
+
+         for (unsigned v = 0; v < verts.size(); v++)
+         {
+            bake.positions.push_back(glm::vec3(model * glm::vec4(verts[v].vert, 1.0f)));
+            bake.normals.push_back(glm::vec3(model * glm::vec4(verts[v].normal, 0.0f)));
+         }
+
+         if (!triangles)
+            continue;
+
+         for (unsigned v = 0; v + 2 < verts.size(); v += 3)
+         {
+            const glm::vec3* tri = &bake.positions[bake.positions.size() - verts.size() + v];
+            AABB box(tri[0], tri[0]);
+            box.expand(AABB(tri[1], tri[1]));
+            box.expand(AABB(tri[2], tri[2]));
+
+            bake.triangles.insert(bake.triangles.end(), tri, tri + 3);
+            boxes.push_back(box);
+         }
+      }
+      bake.bvh.build(boxes);
+
+      glm::vec3 size = bounds.hi - bounds.lo;
+      bake.extent = max(size.x, max(size.y, size.z));
+      bake.epsilon = bake.extent * 1e-4f;
+
+      light.assign(vertices * 2, 0.0f);
+
+      BakeUtil::run(vertices, bake_vertex, &bake);
+
+      if (log_cb)
+         log_cb(RETRO_LOG_INFO, "Baked lighting: %u vertices, %u triangles.\n",
+               vertices, (unsigned)boxes.size());
+   }
+
+   bool LightBake::apply(const vector<std1::shared_ptr<Mesh> >& meshes) const
+   {
+      unsigned index = 0;
+
+      if (light.empty())
+         return false;
+
+      if (sign(meshes, light_pos) != signature)
+      {
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "Baked lighting does not match the meshes, "
+                  "or was applied already.\n");
+         return false;
+      }
+
+      for (unsigned i = 0; i < meshes.size(); i++)
+      {
+         vector<Vertex> verts = *meshes[i]->get_vertex();
+
+         for (unsigned v = 0; v < verts.size(); v++, index++)
+            verts[v].normal = glm::vec3(light[index * 2], light[index * 2 + 1], 0.0f);
+         meshes[i]->set_vertices(verts);
+      }
+
+      return true;
+   }
+
+   void LightBake::header(vector<uint32_t>& out) const
+   {
+      out.clear();
+      out.push_back(LIGHT_BAKE_MAGIC);
+      out.push_back(signature);
+      out.push_back(vertices);
+   }
+
+   bool LightBake::save(const string& path) const
+   {
+      vector<uint8_t> data;
+      for (unsigned i = 0; i < light.size(); i++)
+      {
+         uint32_t bits;
+         memcpy(&bits, &light[i], sizeof(bits));
+         BakeUtil::write_u32(data, bits);
+      }
+
+      vector<uint32_t> words;
+      header(words);
+      return BakeUtil::save(path, words, data);
+   }
+
+   bool LightBake::load(const string& path, const vector<std1::shared_ptr<Mesh> >& meshes,
+         const glm::vec3& light_pos)
+   {
+      setup(meshes, light_pos);
+      if (!vertices)
+         return false;
+
+      vector<uint32_t> words;
+      vector<uint8_t> data(vertices * 2 * 4);
+      header(words);
+      if (!BakeUtil::load(path, words, data))
+         return false;
+
+      light.resize(vertices * 2);
+      for (unsigned i = 0; i < light.size(); i++)
+      {
+         uint32_t bits = BakeUtil::read_u32(&data[i * 4]);
+         memcpy(&light[i], &bits, sizeof(bits));
+      }
+
+      return true;
+   }
+}
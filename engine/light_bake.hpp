@@ -0,0 +1,82 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIGHT_BAKE_HPP__
+#define LIGHT_BAKE_HPP__
+
+#include "mesh.hpp"
+#include "bvh.hpp"
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+namespace GL
+{
+   // Static lighting baked per vertex for levels which do not move: the
+   // point light with shadows plus one diffuse bounce, and ambient
+   // occlusion. Rays are cast on the CPU over a BVH of the level's
+   // triangles, on all cores.
+   //
+   // apply() hands the result to the meshes in place of their normals,
+   // as (irradiance, ambient occlusion, 0), for a shader which only
+   // needs to scale its texture fetch by it. So it has to come after
+   // everything else which reads the normals, and once applied the light
+   // is fixed: moving it at run time would need another bake.
+   class LightBake
+   {
+      public:
+         LightBake();
+
+         void bake(const std::vector<std1::shared_ptr<Mesh> >& meshes,
+               const glm::vec3& light_pos);
+
+         // Sidecar cache. load() fails if the file was baked for other
+         // geometry or another light position.
+         bool load(const std::string& path, const std::vector<std1::shared_ptr<Mesh> >& meshes,
+               const glm::vec3& light_pos);
+         bool save(const std::string& path) const;
+
+         void clear();
+         bool empty() const { return light.empty(); }
+
+         // Fails, leaving the meshes alone, unless they still hold the
+         // vertices baked for.
+         bool apply(const std::vector<std1::shared_ptr<Mesh> >& meshes) const;
+
+      private:
+         struct Bake;
+
+         uint32_t signature;
+         glm::vec3 light_pos;
+         unsigned vertices;
+         // Two per vertex, over all meshes in order.
+         std::vector<float> light;
+
+         void setup(const std::vector<std1::shared_ptr<Mesh> >& meshes,
+               const glm::vec3& light_pos);
+
+         void header(std::vector<uint32_t>& out) const;
+
+         static uint32_t sign(const std::vector<std1::shared_ptr<Mesh> >& meshes,
+               const glm::vec3& light_pos);
+         static float direct_light(const Bake& bake, const glm::vec3& pos,
+               const glm::vec3& normal, std::vector<unsigned>& hits);
+         static void bake_vertex(void* data, unsigned index, std::vector<unsigned>& hits);
+   };
+}
+
+#endif
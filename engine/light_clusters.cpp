@@ -0,0 +1,313 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "light_clusters.hpp"
+#include "gl_state.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace glm;
+
+#ifdef HAVE_GL3
+namespace GL
+{
+   enum
+   {
+      TEXTURE_LIGHTS = 0,
+      TEXTURE_CLUSTERS,
+      TEXTURE_INDICES
+   };
+
+   std::string LightClusters::get_shader_defines()
+   {
+      char defines[256];
+      snprintf(defines, sizeof(defines),
+            "#define CLUSTER_TILES_X %d\n"
+            "#define CLUSTER_TILES_Y %d\n"
+            "#define CLUSTER_SLICES %d\n"
+            "#define CLUSTER_TEXTURE_WIDTH %d\n",
+            TILES_X, TILES_Y, SLICES, TEXTURE_WIDTH);
+      return defines;
+   }
+
+   LightClusters::LightClusters() : scale(0.0f), depth(0.0f), cluster_projection(0.0f)
+   {
+      glGenTextures(3, textures);
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         rows[i] = 0;
+         State::bind_texture(0, GL_TEXTURE_2D, textures[i]);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      }
+      State::bind_texture(0, GL_TEXTURE_2D, 0);
+   }
+
+   LightClusters::~LightClusters()
+   {
+      if (renderer_dead_state)
+         return;
+
+      for (unsigned i = 0; i < 3; i++)
+         State::delete_texture(textures[i]);
+   }
+
+   // View space boxes around each froxel. They only depend on the
+   // projection, so they are kept until it changes. The arrays run three
+   // past the end, so four wide loads near the last froxel stay in them.
+   void LightClusters::update_bounds(const mat4& projection, float near, float far)
+   {
+      mat4 inv = inverse(projection);
+      for (unsigned i = 0; i < BOUND_COUNT; i++)
+         cluster_bounds[i].assign(CLUSTERS + 3, 0.0f);
+      cluster_projection = projection;
+
+      for (unsigned s = 0; s < SLICES; s++)
+      {
+         float z0 = near * powf(far / near, float(s) / SLICES);
+         float z1 = near * powf(far / near, float(s + 1) / SLICES);
+
+         for (unsigned y = 0; y < TILES_Y; y++)
+         {
+            for (unsigned x = 0; x < TILES_X; x++)
+            {
+               AABB box;
+
+               for (unsigned c = 0; c < 4; c++)
+               {
+                  vec2 ndc(2.0f * (x + (c & 1)) / TILES_X - 1.0f,
+                        2.0f * (y + (c >> 1)) / TILES_Y - 1.0f);
+                  vec4 p = inv * vec4(ndc, -1.0f, 1.0f);
+                  vec3 ray = vec3(p) / -p.z;
+
+                  AABB corners(min(ray * z0, ray * z1), max(ray * z0, ray * z1));
+                  if (c)
+                     box.expand(corners);
+                  else
+                     box = corners;
+               }
+
+               unsigned cluster = (s * TILES_Y + y) * TILES_X + x;
+               for (unsigned i = 0; i < 3; i++)
+               {
+                  cluster_bounds[BOUND_LO_X + i][cluster] = box.lo[i];
+                  cluster_bounds[BOUND_HI_X + i][cluster] = box.hi[i];
+               }
+            }
+         }
+      }
+   }
+
+   void LightClusters::build(const std::vector<PointLight>& lights,
+         const mat4& view, const mat4& projection,
+         unsigned width, unsigned height)
+   {
+      unsigned i;
+
+      // Planes of a glm::perspective() matrix, vertical flip or not.
+      float near = projection[3][2] / (projection[2][2] - 1.0f);
+      float far  = projection[3][2] / (projection[2][2] + 1.0f);
+      float slice_scale = SLICES / logf(far / near);
+
+      if (cluster_bounds[0].empty() || projection != cluster_projection)
+         update_bounds(projection, near, far);
+
+      scale = vec4(float(TILES_X) / width, float(TILES_Y) / height,
+            slice_scale, -logf(near) * slice_scale);
+      depth = vec4(near * far, far, far - near, 0.0f);
+
+      hits.clear();
+      light_data.resize(lights.size() * 8);
+
+      for (i = 0; i < lights.size(); i++)
+      {
+         const PointLight& light = lights[i];
+         float* data = &light_data[i * 8];
+         data[0] = light.position.x;
+         data[1] = light.position.y;
+         data[2] = light.position.z;
+         data[3] = light.radius;
+         data[4] = light.color.r;
+         data[5] = light.color.g;
+         data[6] = light.color.b;
+         data[7] = 0.0f;
+
+         vec3 center = vec3(view * vec4(light.position, 1.0f));
+         float r = light.radius;
+         float d = -center.z;
+
+         if (d + r < near || d - r > far)
+            continue;
+
+         int s0 = int(logf(std::max(d - r, near)) * slice_scale + scale.w);
+         int s1 = int(logf(std::min(d + r, far)) * slice_scale + scale.w);
+         s0 = clamp(s0, 0, SLICES - 1);
+         s1 = clamp(s1, 0, SLICES - 1);
+
+         // Screen rectangle of the box around the sphere, unless part of
+         // it is behind the near plane.
+         int x0 = 0, x1 = TILES_X - 1, y0 = 0, y1 = TILES_Y - 1;
+         if (d - r > near)
+         {
+            vec2 lo(1.0f), hi(-1.0f);
+            for (unsigned c = 0; c < 8; c++)
+            {
+               vec3 corner = center + vec3(c & 1 ? r : -r, c & 2 ? r : -r, c & 4 ? r : -r);
+               vec4 clip = projection * vec4(corner, 1.0f);
+               vec2 ndc = vec2(clip) / clip.w;
+               lo = min(lo, ndc);
+               hi = max(hi, ndc);
+            }
+
+            x0 = clamp(int((lo.x + 1.0f) * 0.5f * TILES_X), 0, TILES_X - 1);
+            x1 = clamp(int((hi.x + 1.0f) * 0.5f * TILES_X), 0, TILES_X - 1);
+            y0 = clamp(int((lo.y + 1.0f) * 0.5f * TILES_Y), 0, TILES_Y - 1);
+            y1 = clamp(int((hi.y + 1.0f) * 0.5f * TILES_Y), 0, TILES_Y - 1);
+         }
+
+         const float* lo_x = &cluster_bounds[BOUND_LO_X][0];
+         const float* lo_y = &cluster_bounds[BOUND_LO_Y][0];
+         const float* lo_z = &cluster_bounds[BOUND_LO_Z][0];
+         const float* hi_x = &cluster_bounds[BOUND_HI_X][0];
+         const float* hi_y = &cluster_bounds[BOUND_HI_Y][0];
+         const float* hi_z = &cluster_bounds[BOUND_HI_Z][0];
+#ifdef __SSE2__
+         __m128 cx = _mm_set1_ps(center.x);
+         __m128 cy = _mm_set1_ps(center.y);
+         __m128 cz = _mm_set1_ps(center.z);
+         __m128 r2 = _mm_set1_ps(r * r);
+#endif
+
+         for (int s = s0; s <= s1; s++)
+         {
+            for (int y = y0; y <= y1; y++)
+            {
+               unsigned row = (s * TILES_Y + y) * TILES_X;
+               int x = x0;
+
+#ifdef __SSE2__
+               // Distance from the centre to the nearest point of four
+               // boxes at once; lanes past x1 are masked off.
+               for (; x <= x1; x += 4)
+               {
+                  unsigned c = row + x;
+                  __m128 dx = _mm_sub_ps(cx, _mm_min_ps(_mm_max_ps(cx,
+                              _mm_loadu_ps(lo_x + c)), _mm_loadu_ps(hi_x + c)));
+                  __m128 dy = _mm_sub_ps(cy, _mm_min_ps(_mm_max_ps(cy,
+                              _mm_loadu_ps(lo_y + c)), _mm_loadu_ps(hi_y + c)));
+                  __m128 dz = _mm_sub_ps(cz, _mm_min_ps(_mm_max_ps(cz,
+                              _mm_loadu_ps(lo_z + c)), _mm_loadu_ps(hi_z + c)));
+                  __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+                           _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+                  int mask = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+                  mask &= (1 << std::min(x1 - x + 1, 4)) - 1;
+                  for (unsigned lane = 0; mask; lane++, mask >>= 1)
+                     if (mask & 1)
+                        hits.push_back(std::make_pair(c + lane, i));
+               }
+#endif
+
+               for (; x <= x1; x++)
+               {
+                  unsigned c = row + x;
+                  float dx = center.x - clamp(center.x, lo_x[c], hi_x[c]);
+                  float dy = center.y - clamp(center.y, lo_y[c], hi_y[c]);
+                  float dz = center.z - clamp(center.z, lo_z[c], hi_z[c]);
+
+                  if (dx * dx + dy * dy + dz * dz <= r * r)
+                     hits.push_back(std::make_pair(c, i));
+               }
+            }
+         }
+      }
+
+      // Counting sort of the hits by froxel.
+      cluster_data.assign(CLUSTERS * 2, 0.0f);
+      for (i = 0; i < hits.size(); i++)
+         cluster_data[hits[i].first * 2 + 1] += 1.0f;
+
+      float offset = 0.0f;
+      for (i = 0; i < CLUSTERS; i++)
+      {
+         cluster_data[i * 2] = offset;
+         offset += cluster_data[i * 2 + 1];
+         cluster_data[i * 2 + 1] = 0.0f;
+      }
+
+      indices.resize(hits.size());
+      for (i = 0; i < hits.size(); i++)
+      {
+         float* cluster = &cluster_data[hits[i].first * 2];
+         indices[unsigned(cluster[0] + cluster[1])] = hits[i].second;
+         cluster[1] += 1.0f;
+      }
+
+      upload(TEXTURE_LIGHTS, GL_RGBA32F, GL_RGBA, 4, light_data);
+      upload(TEXTURE_CLUSTERS, GL_RG32F, GL_RG, 2, cluster_data);
+      upload(TEXTURE_INDICES, GL_R32F, GL_RED, 1, indices);
+   }
+
+   // Rows past the used ones keep stale data, which is never indexed.
+   void LightClusters::upload(unsigned texture, GLenum internal_format, GLenum format,
+         unsigned components, const std::vector<float>& data)
+   {
+      unsigned row = TEXTURE_WIDTH * components;
+      unsigned used = std::max<unsigned>((data.size() + row - 1) / row, 1);
+      std::vector<float> padded(data);
+      padded.resize(used * row, 0.0f);
+
+      State::bind_texture(0, GL_TEXTURE_2D, textures[texture]);
+      if (used > rows[texture])
+      {
+         rows[texture] = used;
+         glTexImage2D(GL_TEXTURE_2D, 0, internal_format, TEXTURE_WIDTH, used,
+               0, format, GL_FLOAT, &padded[0]);
+      }
+      else
+         glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TEXTURE_WIDTH, used,
+               format, GL_FLOAT, &padded[0]);
+      State::bind_texture(0, GL_TEXTURE_2D, 0);
+   }
+
+   void LightClusters::bind(unsigned unit)
+   {
+      for (unsigned i = 0; i < 3; i++)
+         State::bind_texture(unit + i, GL_TEXTURE_2D, textures[i]);
+   }
+
+   void LightClusters::unbind(unsigned unit)
+   {
+      for (unsigned i = 0; i < 3; i++)
+         State::bind_texture(unit + i, GL_TEXTURE_2D, 0);
+   }
+
+   void LightClusters::get_frame_uniforms(FrameUniforms& frame) const
+   {
+      frame.cluster_scale = scale;
+      frame.cluster_depth = depth;
+   }
+}
+#endif
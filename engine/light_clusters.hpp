@@ -0,0 +1,113 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIGHT_CLUSTERS_HPP__
+#define LIGHT_CLUSTERS_HPP__
+
+#include "gl.hpp"
+#include "frustum.hpp"
+#include "mesh.hpp"
+#include <string>
+#include <vector>
+#include "glm/glm.hpp"
+
+#ifdef HAVE_GL3
+namespace GL
+{
+   struct PointLight
+   {
+      glm::vec3 position;
+      float radius;
+      glm::vec3 color;
+   };
+
+   // Clustered forward lighting. Point lights are binned on the CPU into
+   // a froxel grid: screen tiles times exponential depth slices. Three
+   // float textures go to the shaders:
+   //   lights  - two texels per light: position and radius, then colour
+   //   clusters - (first index, count) per froxel
+   //   indices  - light numbers, grouped by froxel
+   // All three are LIGHT_TEXTURE_WIDTH texels wide, so texel i sits at
+   // (i % width, i / width). Needs texelFetch, so GL3/GLES3 only.
+   class LightClusters
+   {
+      public:
+         enum
+         {
+            TILES_X = 16,
+            TILES_Y = 8,
+            SLICES  = 24,
+            CLUSTERS = TILES_X * TILES_Y * SLICES,
+            TEXTURE_WIDTH = 64
+         };
+
+         // #defines CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES and
+         // CLUSTER_TEXTURE_WIDTH for the shaders, from the values above.
+         static std::string get_shader_defines();
+
+         LightClusters();
+         ~LightClusters();
+
+         // view and projection must be what the meshes are drawn with,
+         // into a width x height viewport.
+         void build(const std::vector<PointLight>& lights,
+               const glm::mat4& view, const glm::mat4& projection,
+               unsigned width, unsigned height);
+
+         // Textures go to units unit, unit + 1 and unit + 2.
+         void bind(unsigned unit);
+         static void unbind(unsigned unit);
+
+         void get_frame_uniforms(FrameUniforms& frame) const;
+
+         // Light references over all froxels, from the last build().
+         size_t get_entries() const { return indices.size(); }
+
+      private:
+         GLuint textures[3];
+         unsigned rows[3];
+         glm::vec4 scale;
+         glm::vec4 depth;
+
+         // View space box around each froxel, one array per component so
+         // a row of froxels can be tested against a light four at a time.
+         enum
+         {
+            BOUND_LO_X = 0,
+            BOUND_LO_Y,
+            BOUND_LO_Z,
+            BOUND_HI_X,
+            BOUND_HI_Y,
+            BOUND_HI_Z,
+            BOUND_COUNT
+         };
+         glm::mat4 cluster_projection;
+         std::vector<float> cluster_bounds[BOUND_COUNT];
+
+         std::vector<float> light_data;
+         std::vector<float> cluster_data;
+         std::vector<float> indices;
+         std::vector<std::pair<unsigned, unsigned> > hits;
+
+         void update_bounds(const glm::mat4& projection, float near, float far);
+         void upload(unsigned texture, GLenum internal_format, GLenum format,
+               unsigned components, const std::vector<float>& data);
+   };
+}
+#endif
+
+#endif
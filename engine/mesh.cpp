@@ -16,6 +16,12 @@
  */
 
 #include "mesh.hpp"
+#include "gl_state.hpp"
+#include "caps.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace glm;
 using namespace std;
@@ -24,7 +30,10 @@ using namespace std1;
 namespace GL
 {
    Mesh::Mesh() : 
+      position_vbo(0),
+      position_vao(0),
       vertex_type(GL_TRIANGLES),
+      queued(false),
       light_pos(normalize(vec3(-1, -1, -1))),
       //light_pos(0, 10, 0),
       light_ambient(0.25f, 0.25f, 0.25f),
@@ -32,16 +41,25 @@ namespace GL
       view(mat4(1.0)),
       projection(mat4(1.0))
    {
-      glGenBuffers(1, &vbo);
       mvp = projection * view * model;
    }
 
    Mesh::~Mesh()
    {
+      if (queued)
+         UploadQueue::remove(this);
+
+      GeometryPool::free(range);
+
       if (renderer_dead_state)
          return;
 
-      glDeleteBuffers(1, &vbo);
+      if (position_vbo)
+         State::delete_buffer(position_vbo);
+#ifdef HAVE_GL3
+      if (position_vao)
+         State::delete_vertex_array(position_vao);
+#endif
    }
 
    void Mesh::set_lighting(float r, float g, float b)
@@ -78,15 +96,88 @@ namespace GL
    {
       this->vertex = vertex;
 
-      glBindBuffer(GL_ARRAY_BUFFER, vbo);
-      glBufferData(GL_ARRAY_BUFFER, vertex->size() * sizeof(Vertex),
-            &(*vertex)[0], GL_STATIC_DRAW);
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      bounds = AABB();
+      if (!vertex->empty())
+      {
+#ifdef __SSE2__
+         // The fourth lane reads the normal which follows the position
+         // and is thrown away.
+         const Vertex* v = &(*vertex)[0];
+         __m128 lo = _mm_loadu_ps(&v[0].vert.x);
+         __m128 hi = lo;
+         for (unsigned i = 1; i < vertex->size(); i++)
+         {
+            __m128 pos = _mm_loadu_ps(&v[i].vert.x);
+            lo = _mm_min_ps(lo, pos);
+            hi = _mm_max_ps(hi, pos);
+         }
+
+         float lo_out[4], hi_out[4];
+         _mm_storeu_ps(lo_out, lo);
+         _mm_storeu_ps(hi_out, hi);
+         bounds = AABB(vec3(lo_out[0], lo_out[1], lo_out[2]),
+               vec3(hi_out[0], hi_out[1], hi_out[2]));
+#else
+         bounds = AABB((*vertex)[0].vert, (*vertex)[0].vert);
+         for (unsigned i = 1; i < vertex->size(); i++)
+         {
+            bounds.lo = min(bounds.lo, (*vertex)[i].vert);
+            bounds.hi = max(bounds.hi, (*vertex)[i].vert);
+         }
+#endif
+      }
+
+      GeometryPool::free(range);
+      range = GeometryPool::allocate(vertex->size(), sizeof(Vertex));
+
+      if (UploadQueue::deferred())
+      {
+         if (!queued)
+            UploadQueue::push(this);
+         queued = true;
+      }
+      else
+      {
+         if (queued)
+            UploadQueue::remove(this);
+         upload();
+      }
+
+      if (position_vbo)
+      {
+         State::delete_buffer(position_vbo);
+         position_vbo = 0;
+      }
+#ifdef HAVE_GL3
+      if (position_vao)
+      {
+         State::delete_vertex_array(position_vao);
+         position_vao = 0;
+      }
+#endif
+   }
+
+   size_t Mesh::upload()
+   {
+      if (range.count)
+         GeometryPool::write(range, &(*vertex)[0]);
+      queued = false;
+      return range.count * sizeof(Vertex);
+   }
+
+   bool Mesh::ready() const
+   {
+      Texture* tex0 = get_texture(0);
+      Texture* tex1 = get_texture(1);
+      return !queued && (!tex0 || tex0->ready()) && (!tex1 || tex1->ready());
    }
 
    void Mesh::set_material(const Material& material)
    {
       this->material = material;
+#ifdef HAVE_GL3
+      material_buffer.reset();
+#endif
    }
 
    void Mesh::set_blank(const std1::shared_ptr<Texture>& blank)
@@ -117,62 +208,129 @@ namespace GL
       mvp = projection * view * model;
    }
 
-   void Mesh::render()
+   Texture* Mesh::get_texture(unsigned unit) const
    {
-      if (!vertex || !shader)
-         return;
-
+      if (unit == 1 && material.ambient_map)
+         return material.ambient_map.get();
       if (material.diffuse_map)
-         material.diffuse_map->bind(0);
-      else if (blank)
-         blank->bind(0);
+         return material.diffuse_map.get();
+      return blank.get();
+   }
 
-      if (material.ambient_map)
-         material.ambient_map->bind(1);
-      else if (material.diffuse_map)
-         material.diffuse_map->bind(1);
-      else if (blank)
-         blank->bind(1);
+   float Mesh::get_view_depth() const
+   {
+      return -(view * model * vec4(bounds.center(), 1.0f)).z;
+   }
 
-      shader->use();
+   bool Mesh::same_material(const Mesh& other) const
+   {
+      return material.ambient == other.material.ambient &&
+         material.diffuse == other.material.diffuse &&
+         material.specular == other.material.specular &&
+         material.specular_power == other.material.specular_power &&
+         material.alpha_mod == other.material.alpha_mod;
+   }
 
-      glUniform1i(shader->uniform("sDiffuse"), 0);
-      glUniform1i(shader->uniform("sAmbient"), 1);
+   bool Mesh::same_lighting(const Mesh& other) const
+   {
+      return light_pos == other.light_pos &&
+         light_ambient == other.light_ambient &&
+         eye_pos == other.eye_pos;
+   }
 
-      glUniformMatrix4fv(shader->uniform("uModel"),
-            1, GL_FALSE, value_ptr(model));
-      glUniformMatrix4fv(shader->uniform("uMVP"),
-            1, GL_FALSE, value_ptr(mvp));
-      glUniform3fv(shader->uniform("uEyePos"),
-            1, value_ptr(eye_pos));
+   bool Mesh::same_transform(const Mesh& other) const
+   {
+      return model == other.model && mvp == other.mvp;
+   }
+
+   bool Mesh::same_frame(const Mesh& other) const
+   {
+      return view == other.view && projection == other.projection &&
+         same_lighting(other);
+   }
+
+   bool Mesh::same_geometry(const Mesh& other) const
+   {
+      return range.block == other.range.block && vertex_type == other.vertex_type;
+   }
 
-      glUniform3fv(shader->uniform("uMTLAmbient"),
+   void Mesh::get_frame_uniforms(FrameUniforms& frame) const
+   {
+      frame.view_projection = projection * view;
+      frame.eye_pos         = vec4(eye_pos, 1.0f);
+      frame.light_pos       = vec4(light_pos, 1.0f);
+      frame.light_ambient   = vec4(light_ambient, 1.0f);
+      frame.cluster_scale   = vec4(0.0f);
+      frame.cluster_depth   = vec4(0.0f);
+   }
+
+   void Mesh::set_material_uniforms()
+   {
+#ifdef HAVE_GL3
+      if (shader->has_block(Shader::BLOCK_MATERIAL))
+      {
+         if (!material_buffer)
+         {
+            MaterialUniforms data;
+            data.ambient  = vec4(material.ambient, material.alpha_mod);
+            data.diffuse  = vec4(material.diffuse, 0.0f);
+            data.specular = vec4(material.specular, material.specular_power);
+
+            material_buffer = std1::shared_ptr<UniformBuffer>(new UniformBuffer);
+            material_buffer->set_data(&data, sizeof(data));
+         }
+
+         material_buffer->bind(Shader::BLOCK_MATERIAL);
+         return;
+      }
+#endif
+
+      glUniform3fv(shader->uniform(Shader::UNIFORM_MTL_AMBIENT),
             1, value_ptr(material.ambient));
-      glUniform3fv(shader->uniform("uMTLDiffuse"),
+      glUniform3fv(shader->uniform(Shader::UNIFORM_MTL_DIFFUSE),
             1, value_ptr(material.diffuse));
-      glUniform3fv(shader->uniform("uMTLSpecular"),
+      glUniform3fv(shader->uniform(Shader::UNIFORM_MTL_SPECULAR),
             1, value_ptr(material.specular));
-      glUniform1f(shader->uniform("uMTLSpecularPower"),
+      glUniform1f(shader->uniform(Shader::UNIFORM_MTL_SPECULAR_POWER),
             material.specular_power);
-      glUniform1f(shader->uniform("uMTLAlphaMod"),
+      glUniform1f(shader->uniform(Shader::UNIFORM_MTL_ALPHA_MOD),
             material.alpha_mod);
+   }
+
+   void Mesh::set_lighting_uniforms()
+   {
+      // Lives in the Frame block, which RenderQueue writes.
+      if (shader->has_block(Shader::BLOCK_FRAME))
+         return;
 
-      glUniform3fv(shader->uniform("uLightPos"),
+      glUniform3fv(shader->uniform(Shader::UNIFORM_EYE_POS),
+            1, value_ptr(eye_pos));
+
+      glUniform3fv(shader->uniform(Shader::UNIFORM_LIGHT_POS),
             1, value_ptr(light_pos));
 
-      glUniform3fv(shader->uniform("uLightAmbient"),
+      glUniform3fv(shader->uniform(Shader::UNIFORM_LIGHT_AMBIENT),
             1, value_ptr(light_ambient));
+   }
 
+   void Mesh::set_transform_uniforms()
+   {
+      set_transform_uniforms(*shader);
+   }
 
-      GLint aVertex = shader->attrib("aVertex");
-      GLint aNormal = shader->attrib("aNormal");
-      GLint aTex    = shader->attrib("aTex");
-
-      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+   void Mesh::set_transform_uniforms(const Shader& target)
+   {
+      glUniformMatrix4fv(target.uniform(Shader::UNIFORM_MODEL),
+            1, GL_FALSE, value_ptr(model));
+      glUniformMatrix4fv(target.uniform(Shader::UNIFORM_MVP),
+            1, GL_FALSE, value_ptr(mvp));
+   }
 
+   static void set_vertex_pointers(GLint aVertex, GLint aNormal, GLint aTex)
+   {
       if (aVertex >= 0)
       {
-         glEnableVertexAttribArray(aVertex);
+         State::enable_vertex_attrib(aVertex);
          glVertexAttribPointer(aVertex, 3, GL_FLOAT,
                GL_FALSE, sizeof(Vertex),
                reinterpret_cast<const GLvoid*>(offsetof(Vertex, vert)));
@@ -180,7 +338,7 @@ namespace GL
 
       if (aNormal >= 0)
       {
-         glEnableVertexAttribArray(aNormal);
+         State::enable_vertex_attrib(aNormal);
          glVertexAttribPointer(aNormal, 3, GL_FLOAT,
                GL_FALSE, sizeof(Vertex),
                reinterpret_cast<const GLvoid*>(offsetof(Vertex, normal)));
@@ -188,26 +346,161 @@ namespace GL
 
       if (aTex >= 0)
       {
-         glEnableVertexAttribArray(aTex);
+         State::enable_vertex_attrib(aTex);
          glVertexAttribPointer(aTex, 2, GL_FLOAT,
                GL_FALSE, sizeof(Vertex),
                reinterpret_cast<const GLvoid*>(offsetof(Vertex, tex)));
       }
+   }
 
-      glDrawArrays(vertex_type, 0, vertex->size());
+   void Mesh::bind_vertices()
+   {
+#ifdef HAVE_GL3
+      if (Caps::modern())
+      {
+         // Attribute locations are fixed by Shader, so the layout is
+         // recorded once per pool block and works for every mesh in it,
+         // whichever shader draws it.
+         GLuint vao = GeometryPool::vertex_array(range.block);
+         if (vao)
+         {
+            State::bind_vertex_array(vao);
+            return;
+         }
+
+         glGenVertexArrays(1, &vao);
+         GeometryPool::set_vertex_array(range.block, vao);
+         State::bind_vertex_array(vao);
+         State::bind_buffer(GL_ARRAY_BUFFER, GeometryPool::buffer(range.block));
+         set_vertex_pointers(Shader::ATTRIB_VERTEX,
+               Shader::ATTRIB_NORMAL, Shader::ATTRIB_TEX);
+         return;
+      }
+#endif
+
+      State::bind_buffer(GL_ARRAY_BUFFER, GeometryPool::buffer(range.block));
+      set_vertex_pointers(shader->attrib(Shader::ATTRIB_VERTEX),
+            shader->attrib(Shader::ATTRIB_NORMAL),
+            shader->attrib(Shader::ATTRIB_TEX));
+   }
+
+   void Mesh::unbind_vertices()
+   {
+      GLint aVertex = shader->attrib(Shader::ATTRIB_VERTEX);
+      GLint aNormal = shader->attrib(Shader::ATTRIB_NORMAL);
+      GLint aTex    = shader->attrib(Shader::ATTRIB_TEX);
+
+#ifdef HAVE_GL3
+      if (Caps::modern())
+      {
+         State::bind_vertex_array(0);
+         return;
+      }
+#endif
 
       if (aVertex >= 0)
-         glDisableVertexAttribArray(aVertex);
+         State::disable_vertex_attrib(aVertex);
       if (aNormal >= 0)
-         glDisableVertexAttribArray(aNormal);
+         State::disable_vertex_attrib(aNormal);
       if (aTex >= 0)
-         glDisableVertexAttribArray(aTex);
+         State::disable_vertex_attrib(aTex);
+
+      State::bind_buffer(GL_ARRAY_BUFFER, 0);
+   }
+
+   void Mesh::bind_positions(const Shader& target)
+   {
+      GLint aVertex = target.attrib(Shader::ATTRIB_VERTEX);
+
+#ifdef HAVE_GL3
+      if (Caps::modern() && position_vao)
+      {
+         State::bind_vertex_array(position_vao);
+         return;
+      }
+#endif
+
+      if (!position_vbo)
+      {
+         vector<vec3> positions(vertex->size());
+         for (unsigned i = 0; i < vertex->size(); i++)
+            positions[i] = (*vertex)[i].vert;
+
+         glGenBuffers(1, &position_vbo);
+         State::bind_buffer(GL_ARRAY_BUFFER, position_vbo);
+         glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3),
+               positions.empty() ? NULL : &positions[0], GL_STATIC_DRAW);
+      }
 
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
+#ifdef HAVE_GL3
+      if (Caps::modern())
+      {
+         glGenVertexArrays(1, &position_vao);
+         State::bind_vertex_array(position_vao);
+         aVertex = Shader::ATTRIB_VERTEX;
+      }
+#endif
+
+      State::bind_buffer(GL_ARRAY_BUFFER, position_vbo);
+      if (aVertex >= 0)
+      {
+         State::enable_vertex_attrib(aVertex);
+         glVertexAttribPointer(aVertex, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), 0);
+      }
+   }
+
+   void Mesh::unbind_positions(const Shader& target)
+   {
+      GLint aVertex = target.attrib(Shader::ATTRIB_VERTEX);
+
+#ifdef HAVE_GL3
+      if (Caps::modern())
+      {
+         State::bind_vertex_array(0);
+         return;
+      }
+#endif
+
+      if (aVertex >= 0)
+         State::disable_vertex_attrib(aVertex);
+      State::bind_buffer(GL_ARRAY_BUFFER, 0);
+   }
+
+   void Mesh::draw()
+   {
+      glDrawArrays(vertex_type, range.first, range.count);
+   }
+
+   void Mesh::draw_positions()
+   {
+      glDrawArrays(vertex_type, 0, vertex->size());
+   }
+
+   void Mesh::render()
+   {
+      if (!vertex || !range.count || !shader || !ready() || !shader->ready())
+         return;
+
+      if (get_texture(0))
+         get_texture(0)->bind(0);
+      if (get_texture(1))
+         get_texture(1)->bind(1);
+
+      shader->use();
+
+      glUniform1i(shader->uniform(Shader::UNIFORM_DIFFUSE_SAMPLER), 0);
+      glUniform1i(shader->uniform(Shader::UNIFORM_AMBIENT_SAMPLER), 1);
+
+      set_transform_uniforms();
+      set_material_uniforms();
+      set_lighting_uniforms();
+
+      bind_vertices();
+      draw();
+      unbind_vertices();
 
       Texture::unbind(0);
       Texture::unbind(1);
       Shader::unbind();
    }
 }
-
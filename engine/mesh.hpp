@@ -21,6 +21,10 @@
 #include "gl.hpp"
 #include "shader.hpp"
 #include "texture.hpp"
+#include "uniform_buffer.hpp"
+#include "upload_queue.hpp"
+#include "geometry_pool.hpp"
+#include "frustum.hpp"
 #include <vector>
 #include <cstddef>
 #include <memory>
@@ -57,7 +61,26 @@ namespace GL
       std1::shared_ptr<Texture> ambient_map;
    };
 
-   class Mesh
+   // std140 layouts of the Frame and Material uniform blocks.
+   struct FrameUniforms
+   {
+      glm::mat4 view_projection;
+      glm::vec4 eye_pos;
+      glm::vec4 light_pos;
+      glm::vec4 light_ambient;
+      // See LightClusters; zero without point lights.
+      glm::vec4 cluster_scale;
+      glm::vec4 cluster_depth;
+   };
+
+   struct MaterialUniforms
+   {
+      glm::vec4 ambient;  // w: alpha mod
+      glm::vec4 diffuse;
+      glm::vec4 specular; // w: specular power
+   };
+
+   class Mesh : public Upload
    {
       public:
          Mesh();
@@ -68,29 +91,80 @@ namespace GL
 
          void set_vertices(std::vector<Vertex> vertex);
          void set_vertices(const std1::shared_ptr<std::vector<Vertex> >& vertex);
+         size_t upload();
+         // Vertex buffer and textures are all on the GPU.
+         bool ready() const;
          void set_vertex_type(GLenum type);
+         GLenum get_vertex_type() const { return vertex_type; }
          void set_material(const Material& material);
          void set_blank(const std1::shared_ptr<Texture>& blank);
          void set_shader(const std1::shared_ptr<Shader>& shader);
 
          void set_ambient_lighting(float r, float g, float b);
          void set_model(const glm::mat4& model);
+         const glm::mat4& get_model() const { return model; }
          void set_view(const glm::mat4& view);
+         const glm::mat4& get_view() const { return view; }
          void set_projection(const glm::mat4& projection);
+         const glm::mat4& get_projection() const { return projection; }
          void set_eye(const glm::vec3& eye_pos);
 
          void set_light_pos(const glm::vec3& light_pos);
          void set_light_ambient(const glm::vec3& light_ambient);
          void set_lighting(float r, float g, float b);
 
+         // Standalone draw with plain uniforms. Shaders using the Frame
+         // block must go through RenderQueue, which owns that buffer.
          void render();
 
+         // The pieces render() is made of, for callers like RenderQueue
+         // which skip state that has not changed between meshes.
+         const std1::shared_ptr<Shader>& get_shader() const { return shader; }
+         Texture* get_texture(unsigned unit) const;
+         float get_view_depth() const;
+
+         // Object space bounds of the vertices, and the same around the
+         // model transform.
+         const AABB& get_bounds() const { return bounds; }
+         AABB get_world_bounds() const { return bounds.transformed(model); }
+
+         bool same_material(const Mesh& other) const;
+         bool same_lighting(const Mesh& other) const;
+         bool same_transform(const Mesh& other) const;
+         bool same_frame(const Mesh& other) const;
+         // Drawable from the same bound buffer with the same primitive.
+         bool same_geometry(const Mesh& other) const;
+         void get_frame_uniforms(FrameUniforms& frame) const;
+
+         void set_material_uniforms();
+         void set_lighting_uniforms();
+         void set_transform_uniforms();
+         void set_transform_uniforms(const Shader& target);
+         void bind_vertices();
+         void unbind_vertices();
+         void draw();
+         const GeometryRange& get_range() const { return range; }
+
+         // Tightly packed positions for depth-only passes, uploaded on
+         // first use. They have a buffer of their own, so draw them with
+         // draw_positions().
+         void bind_positions(const Shader& target);
+         void unbind_positions(const Shader& target);
+         void draw_positions();
+
       private:
-         GLuint vbo;
+         GeometryRange range;
+         GLuint position_vbo;
+         GLuint position_vao;
          GLenum vertex_type;
+         bool queued;
+         AABB bounds;
          std1::shared_ptr<std::vector<Vertex> > vertex;
          std1::shared_ptr<Shader> shader;
          std1::shared_ptr<Texture> blank;
+#ifdef HAVE_GL3
+         std1::shared_ptr<UniformBuffer> material_buffer;
+#endif
 
          Material material;
          glm::vec3 light_pos;
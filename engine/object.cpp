@@ -16,6 +16,7 @@
  */
 
 #include "object.hpp"
+#include "texture_cache.hpp"
 #include "util.hpp"
 #include <fstream>
 #include <string>
@@ -175,7 +176,7 @@ namespace OBJ
             if (!textures[data])
             {
                string diffuse_path = Path::join(Path::basedir(path), data);
-               textures[data] = std1::shared_ptr<Texture>(new Texture(diffuse_path));
+               textures[data] = TextureCache::load(diffuse_path);
             }
 
             current.diffuse_map = textures[data];
@@ -185,7 +186,7 @@ namespace OBJ
             if (!textures[data])
             {
                string ambient_path = Path::join(Path::basedir(path), data);
-               textures[data] = std1::shared_ptr<Texture>(new Texture(ambient_path));
+               textures[data] = TextureCache::load(ambient_path);
             }
 
             current.ambient_map = textures[data];
@@ -205,7 +206,7 @@ namespace OBJ
 
       vector<Vertex> vertices;
 
-      /* Texture cache. */
+      /* Per-file lookup by name, backed by the global TextureCache. */
       map<string, std1::shared_ptr<Texture> > textures;
       Material current_material;
       string line;
@@ -248,7 +249,7 @@ namespace OBJ
             if (!textures[data])
             {
                string texture_path = Path::join(Path::basedir(path), data + ".png");
-               textures[data] = std1::shared_ptr<Texture>(new Texture(texture_path));
+               textures[data] = TextureCache::load(texture_path);
             }
 
             current_material = Material();
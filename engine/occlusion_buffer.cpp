@@ -0,0 +1,305 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "occlusion_buffer.hpp"
+#include <algorithm>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace GL
+{
+   OcclusionBuffer::OcclusionBuffer(unsigned width, unsigned height) :
+      width(width), height(height),
+      tiles_x((width + TILE_WIDTH - 1) / TILE_WIDTH),
+      tiles_y((height + TILE_HEIGHT - 1) / TILE_HEIGHT),
+      front_cw(false),
+      depth(width * height, 1.0f),
+      tile_max(tiles_x * tiles_y, 1.0f)
+   {}
+
+   void OcclusionBuffer::begin(const glm::mat4& view_projection, GLenum front_face)
+   {
+      this->view_projection = view_projection;
+      front_cw = front_face == GL_CW;
+      fill(depth.begin(), depth.end(), 1.0f);
+      fill(tile_max.begin(), tile_max.end(), 1.0f);
+   }
+
+   void OcclusionBuffer::draw_occluder(const vector<Vertex>& vertices, const glm::mat4& model)
+   {
+      glm::mat4 mvp = view_projection * model;
+
+      for (size_t i = 0; i + 2 < vertices.size(); i += 3)
+      {
+         glm::vec4 clip[3];
+         for (unsigned j = 0; j < 3; j++)
+            clip[j] = mvp * glm::vec4(vertices[i + j].vert, 1.0f);
+         draw_clipped(clip);
+      }
+   }
+
+   // Clips against the near plane (z > -w); the other planes are handled
+   // by the scissor in draw_triangle().
+   void OcclusionBuffer::draw_clipped(const glm::vec4 clip[3])
+   {
+      glm::vec4 poly[4];
+      unsigned count = 0;
+
+      for (unsigned i = 0; i < 3; i++)
+      {
+         const glm::vec4& a = clip[i];
+         const glm::vec4& b = clip[(i + 1) % 3];
+         float da = a.z + a.w;
+         float db = b.z + b.w;
+
+         if (da >= 0.0f)
+            poly[count++] = a;
+         if ((da >= 0.0f) != (db >= 0.0f))
+            poly[count++] = a + (b - a) * (da / (da - db));
+      }
+
+      if (count < 3)
+         return;
+
+      glm::vec3 screen[4];
+      for (unsigned i = 0; i < count; i++)
+      {
+         float w = max(poly[i].w, 1e-6f);
+         screen[i] = glm::vec3(
+               (poly[i].x / w * 0.5f + 0.5f) * width,
+               (poly[i].y / w * 0.5f + 0.5f) * height,
+               poly[i].z / w * 0.5f + 0.5f);
+      }
+
+      draw_triangle(screen);
+      if (count == 4)
+      {
+         glm::vec3 second[3] = { screen[0], screen[2], screen[3] };
+         draw_triangle(second);
+      }
+   }
+
+   void OcclusionBuffer::draw_triangle(const glm::vec3 v[3])
+   {
+      float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) -
+         (v[2].x - v[0].x) * (v[1].y - v[0].y);
+
+      // Counter-clockwise is positive here, as in window coordinates.
+      if (area == 0.0f || (area < 0.0f) != front_cw)
+         return;
+
+      int min_x = max(0, (int)floor(min(v[0].x, min(v[1].x, v[2].x))));
+      int max_x = min((int)width - 1, (int)ceil(max(v[0].x, max(v[1].x, v[2].x))));
+      int min_y = max(0, (int)floor(min(v[0].y, min(v[1].y, v[2].y))));
+      int max_y = min((int)height - 1, (int)ceil(max(v[0].y, max(v[1].y, v[2].y))));
+      if (min_x > max_x || min_y > max_y)
+         return;
+
+      // Depth plane z = dzdx * x + dzdy * y + z0, pushed back to the
+      // farthest value it takes inside each pixel.
+      float inv = 1.0f / area;
+      float dzdx = ((v[1].z - v[0].z) * (v[2].y - v[0].y) -
+            (v[2].z - v[0].z) * (v[1].y - v[0].y)) * inv;
+      float dzdy = ((v[2].z - v[0].z) * (v[1].x - v[0].x) -
+            (v[1].z - v[0].z) * (v[2].x - v[0].x)) * inv;
+      float z0 = v[0].z - dzdx * v[0].x - dzdy * v[0].y +
+         0.5f * (fabsf(dzdx) + fabsf(dzdy));
+      float tri_near = min(v[0].z, min(v[1].z, v[2].z));
+      float sign = area > 0.0f ? 1.0f : -1.0f;
+
+      for (int ty = min_y / TILE_HEIGHT; ty <= max_y / TILE_HEIGHT; ty++)
+      {
+         for (int tx = min_x / TILE_WIDTH; tx <= max_x / TILE_WIDTH; tx++)
+         {
+            float& tile = tile_max[ty * tiles_x + tx];
+            if (tri_near >= tile)
+               continue;
+
+            int x0 = max(min_x, tx * TILE_WIDTH);
+            int x1 = min(max_x, tx * TILE_WIDTH + TILE_WIDTH - 1);
+            int y0 = max(min_y, ty * TILE_HEIGHT);
+            int y1 = min(max_y, ty * TILE_HEIGHT + TILE_HEIGHT - 1);
+
+            for (int y = y0; y <= y1; y++)
+            {
+               float py = y + 0.5f;
+               float* row = &depth[y * width];
+               int x = x0;
+
+#ifdef __SSE2__
+               // Same arithmetic as the scalar loop, four pixels at a time.
+               __m128 sign4 = _mm_set1_ps(sign);
+               __m128 zero  = _mm_setzero_ps();
+               __m128 row0  = _mm_set1_ps((v[1].x - v[0].x) * (py - v[0].y));
+               __m128 row1  = _mm_set1_ps((v[2].x - v[1].x) * (py - v[1].y));
+               __m128 row2  = _mm_set1_ps((v[0].x - v[2].x) * (py - v[2].y));
+               __m128 dy0   = _mm_set1_ps(v[1].y - v[0].y);
+               __m128 dy1   = _mm_set1_ps(v[2].y - v[1].y);
+               __m128 dy2   = _mm_set1_ps(v[0].y - v[2].y);
+               __m128 vx0   = _mm_set1_ps(v[0].x);
+               __m128 vx1   = _mm_set1_ps(v[1].x);
+               __m128 vx2   = _mm_set1_ps(v[2].x);
+               __m128 zx    = _mm_set1_ps(dzdx);
+               __m128 zy    = _mm_set1_ps(dzdy * py);
+               __m128 zc    = _mm_set1_ps(z0);
+               __m128 px    = _mm_setr_ps(x + 0.5f, x + 1.5f, x + 2.5f, x + 3.5f);
+
+               for (; x + 3 <= x1; x += 4, px = _mm_add_ps(px, _mm_set1_ps(4.0f)))
+               {
+                  __m128 e0 = _mm_mul_ps(_mm_sub_ps(row0, _mm_mul_ps(dy0, _mm_sub_ps(px, vx0))), sign4);
+                  __m128 e1 = _mm_mul_ps(_mm_sub_ps(row1, _mm_mul_ps(dy1, _mm_sub_ps(px, vx1))), sign4);
+                  __m128 e2 = _mm_mul_ps(_mm_sub_ps(row2, _mm_mul_ps(dy2, _mm_sub_ps(px, vx2))), sign4);
+                  __m128 inside = _mm_and_ps(_mm_cmpnlt_ps(e0, zero),
+                        _mm_and_ps(_mm_cmpnlt_ps(e1, zero), _mm_cmpnlt_ps(e2, zero)));
+                  if (!_mm_movemask_ps(inside))
+                     continue;
+
+                  __m128 z     = _mm_add_ps(_mm_add_ps(_mm_mul_ps(zx, px), zy), zc);
+                  __m128 old   = _mm_loadu_ps(row + x);
+                  __m128 write = _mm_and_ps(inside, _mm_cmplt_ps(z, old));
+                  _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(write, z), _mm_andnot_ps(write, old)));
+               }
+#endif
+
+               for (; x <= x1; x++)
+               {
+                  float px = x + 0.5f;
+                  float e0 = ((v[1].x - v[0].x) * (py - v[0].y) - (v[1].y - v[0].y) * (px - v[0].x)) * sign;
+                  float e1 = ((v[2].x - v[1].x) * (py - v[1].y) - (v[2].y - v[1].y) * (px - v[1].x)) * sign;
+                  float e2 = ((v[0].x - v[2].x) * (py - v[2].y) - (v[0].y - v[2].y) * (px - v[2].x)) * sign;
+                  if (e0 < 0.0f || e1 < 0.0f || e2 < 0.0f)
+                     continue;
+
+                  float z = dzdx * px + dzdy * py + z0;
+                  if (z < row[x])
+                     row[x] = z;
+               }
+            }
+
+            float farthest = 0.0f;
+            int tile_x1 = min<int>(width, (tx + 1) * TILE_WIDTH);
+            for (int y = ty * TILE_HEIGHT; y < min<int>(height, (ty + 1) * TILE_HEIGHT); y++)
+            {
+               const float* row = &depth[y * width];
+               int x = tx * TILE_WIDTH;
+#ifdef __SSE2__
+               __m128 far4 = _mm_set1_ps(farthest);
+               for (; x + 4 <= tile_x1; x += 4)
+                  far4 = _mm_max_ps(far4, _mm_loadu_ps(row + x));
+
+               float lanes[4];
+               _mm_storeu_ps(lanes, far4);
+               farthest = max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3]));
+#endif
+               for (; x < tile_x1; x++)
+                  farthest = max(farthest, row[x]);
+            }
+            tile = farthest;
+         }
+      }
+   }
+
+   bool OcclusionBuffer::project(const AABB& box, int rect[4], float& nearest) const
+   {
+      glm::vec2 lo(1e30f), hi(-1e30f);
+      nearest = 1.0f;
+
+      for (unsigned i = 0; i < 8; i++)
+      {
+         glm::vec4 corner(i & 1 ? box.hi.x : box.lo.x,
+               i & 2 ? box.hi.y : box.lo.y,
+               i & 4 ? box.hi.z : box.lo.z, 1.0f);
+         glm::vec4 clip = view_projection * corner;
+
+         if (clip.z < -clip.w || clip.w <= 0.0f)
+            return false;
+
+         glm::vec2 ndc = glm::vec2(clip) / clip.w;
+         lo = glm::min(lo, ndc);
+         hi = glm::max(hi, ndc);
+         nearest = min(nearest, clip.z / clip.w * 0.5f + 0.5f);
+      }
+
+      rect[0] = max(0, (int)floor((lo.x * 0.5f + 0.5f) * width) - 1);
+      rect[1] = max(0, (int)floor((lo.y * 0.5f + 0.5f) * height) - 1);
+      rect[2] = min((int)width - 1, (int)ceil((hi.x * 0.5f + 0.5f) * width) + 1);
+      rect[3] = min((int)height - 1, (int)ceil((hi.y * 0.5f + 0.5f) * height) + 1);
+      return true;
+   }
+
+   unsigned OcclusionBuffer::coverage(const AABB& box) const
+   {
+      int rect[4];
+      float nearest;
+
+      if (!project(box, rect, nearest) || rect[0] > rect[2] || rect[1] > rect[3])
+         return 0;
+
+      return (rect[2] - rect[0] + 1) * (rect[3] - rect[1] + 1);
+   }
+
+   bool OcclusionBuffer::visible(const AABB& box) const
+   {
+      int rect[4];
+      float nearest;
+
+      // Boxes reaching behind the eye cannot be placed on screen.
+      if (!project(box, rect, nearest))
+         return true;
+
+      for (int ty = rect[1] / TILE_HEIGHT; ty <= rect[3] / TILE_HEIGHT; ty++)
+      {
+         for (int tx = rect[0] / TILE_WIDTH; tx <= rect[2] / TILE_WIDTH; tx++)
+         {
+            if (nearest >= tile_max[ty * tiles_x + tx])
+               continue;
+
+            int x0 = max(rect[0], tx * TILE_WIDTH);
+            int x1 = min(rect[2], tx * TILE_WIDTH + TILE_WIDTH - 1);
+            int y0 = max(rect[1], ty * TILE_HEIGHT);
+            int y1 = min(rect[3], ty * TILE_HEIGHT + TILE_HEIGHT - 1);
+
+            if (x1 - x0 + 1 == TILE_WIDTH && y1 - y0 + 1 == TILE_HEIGHT)
+               return true;
+
+            for (int y = y0; y <= y1; y++)
+            {
+               const float* row = &depth[y * width];
+               int x = x0;
+#ifdef __SSE2__
+               __m128 near4 = _mm_set1_ps(nearest);
+               for (; x + 3 <= x1; x += 4)
+               {
+                  if (_mm_movemask_ps(_mm_cmplt_ps(near4, _mm_loadu_ps(row + x))))
+                     return true;
+               }
+#endif
+               for (; x <= x1; x++)
+                  if (nearest < row[x])
+                     return true;
+            }
+         }
+      }
+
+      return false;
+   }
+}
@@ -0,0 +1,75 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCCLUSION_BUFFER_HPP__
+#define OCCLUSION_BUFFER_HPP__
+
+#include "mesh.hpp"
+#include "frustum.hpp"
+#include <vector>
+
+namespace GL
+{
+   // Small CPU depth buffer for occlusion culling, so it works without
+   // occlusion queries. Large occluders are rasterized into it, then the
+   // bounding boxes of everything else are tested against it.
+   //
+   // Both sides err towards visible: occluder depth is the farthest point
+   // of the triangle within each pixel, and tested boxes are grown by a
+   // pixel. The buffer is split into tiles which keep their farthest
+   // depth, so hidden tiles are skipped when drawing and whole tiles are
+   // accepted when testing.
+   class OcclusionBuffer
+   {
+      public:
+         enum { TILE_WIDTH = 32, TILE_HEIGHT = 8 };
+
+         OcclusionBuffer(unsigned width = 256, unsigned height = 128);
+
+         // front_face as passed to glFrontFace; back faces are skipped like
+         // the GPU would.
+         void begin(const glm::mat4& view_projection, GLenum front_face);
+
+         // Triangle list in object space.
+         void draw_occluder(const std::vector<Vertex>& vertices, const glm::mat4& model);
+
+         bool visible(const AABB& box) const;
+
+         // Pixels of the buffer the box covers on screen, 0 when it
+         // crosses the near plane.
+         unsigned coverage(const AABB& box) const;
+
+         unsigned get_width() const { return width; }
+         unsigned get_height() const { return height; }
+
+      private:
+         unsigned width;
+         unsigned height;
+         unsigned tiles_x;
+         unsigned tiles_y;
+         bool front_cw;
+         glm::mat4 view_projection;
+         std::vector<float> depth;
+         std::vector<float> tile_max;
+
+         bool project(const AABB& box, int rect[4], float& nearest) const;
+         void draw_clipped(const glm::vec4 clip[3]);
+         void draw_triangle(const glm::vec3 screen[3]);
+   };
+}
+
+#endif
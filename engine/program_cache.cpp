@@ -0,0 +1,198 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "program_cache.hpp"
+#include "caps.hpp"
+#include <file/file_path.h>
+#include <zlib.h>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(HAVE_OPENGLES) && !defined(HAVE_OPENGLES3)
+// GLES2 only has the binary API through OES_get_program_binary.
+#define glGetProgramBinary glGetProgramBinaryOES
+#define glProgramBinary glProgramBinaryOES
+#define GL_PROGRAM_BINARY_LENGTH GL_PROGRAM_BINARY_LENGTH_OES
+#define GL_NUM_PROGRAM_BINARY_FORMATS GL_NUM_PROGRAM_BINARY_FORMATS_OES
+#endif
+
+#define PROGRAM_CACHE_MAGIC 0x31475250 // "PRG1"
+
+namespace GL
+{
+   namespace ProgramCache
+   {
+      static std::string directory;
+      static std::string driver;
+      static bool supported;
+
+      void set_directory(const std::string& dir)
+      {
+         directory = dir;
+      }
+
+      static std::string get_string(GLenum name)
+      {
+         const GLubyte* str = glGetString(name);
+         return str ? reinterpret_cast<const char*>(str) : "";
+      }
+
+      void init()
+      {
+         GLint formats = 0;
+         glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+         supported = formats > 0 && !directory.empty();
+
+         driver = get_string(GL_VENDOR) + "\n" + get_string(GL_RENDERER) + "\n" +
+            get_string(GL_VERSION) + "\n" + (Caps::modern() ? "modern\n" : "legacy\n");
+      }
+
+      // Entry points are resolved by the programs after init(), and may
+      // be missing even with formats reported.
+      static bool usable()
+      {
+#if defined(HAVE_OPENGLES3)
+         return supported;
+#else
+         return supported && glGetProgramBinary && glProgramBinary;
+#endif
+      }
+
+      static std::string make_key(const std::string& vertex, const std::string& fragment)
+      {
+         return driver + vertex + "\n//fragment\n" + fragment;
+      }
+
+      static std::string entry_path(const std::string& key)
+      {
+         const Bytef* data = reinterpret_cast<const Bytef*>(key.data());
+         uint32_t crc = crc32(0, data, key.size());
+         uint32_t fnv = 2166136261u;
+         char name[32];
+
+         for (size_t i = 0; i < key.size(); i++)
+         {
+            fnv ^= (uint8_t)key[i];
+            fnv *= 16777619u;
+         }
+
+         snprintf(name, sizeof(name), "%08x%08x.bin", (unsigned)crc, (unsigned)fnv);
+         return directory + "/" + name;
+      }
+
+      static void put_u32(std::vector<uint8_t>& out, uint32_t v)
+      {
+         for (unsigned i = 0; i < 4; i++)
+            out.push_back((v >> (8 * i)) & 0xff);
+      }
+
+      static uint32_t get_u32(const uint8_t* in)
+      {
+         return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+      }
+
+      // File layout: magic, binary format, key size, binary size, key,
+      // binary. The full key is kept so a hash collision cannot load the
+      // wrong program.
+      bool load(GLuint prog, const std::string& vertex, const std::string& fragment)
+      {
+         if (!usable())
+            return false;
+
+         std::string key = make_key(vertex, fragment);
+         FILE* file = fopen(entry_path(key).c_str(), "rb");
+         if (!file)
+            return false;
+
+         std::vector<uint8_t> in;
+         uint8_t buf[4096];
+         size_t read;
+         while ((read = fread(buf, 1, sizeof(buf), file)) > 0)
+            in.insert(in.end(), buf, buf + read);
+         fclose(file);
+
+         if (in.size() < 16 || get_u32(&in[0]) != PROGRAM_CACHE_MAGIC)
+            return false;
+
+         GLenum format = get_u32(&in[4]);
+         size_t key_size = get_u32(&in[8]);
+         size_t size = get_u32(&in[12]);
+         if (in.size() != 16 + key_size + size || !size ||
+               key.compare(0, key.size(), reinterpret_cast<const char*>(&in[16]), key_size) != 0)
+            return false;
+
+         GLint status = 0;
+         glProgramBinary(prog, format, &in[16 + key_size], size);
+         glGetProgramiv(prog, GL_LINK_STATUS, &status);
+
+         if (!status && log_cb)
+            log_cb(RETRO_LOG_INFO, "Cached program binary rejected, recompiling.\n");
+         return status;
+      }
+
+      void prepare(GLuint prog)
+      {
+#if defined(HAVE_OPENGLES3)
+         if (usable())
+            glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#elif !defined(HAVE_OPENGLES)
+         if (usable() && glProgramParameteri)
+            glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#else
+         (void)prog;
+#endif
+      }
+
+      void store(GLuint prog, const std::string& vertex, const std::string& fragment)
+      {
+         if (!usable())
+            return;
+
+         GLint size = 0;
+         glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &size);
+         if (size <= 0)
+            return;
+
+         std::string key = make_key(vertex, fragment);
+         std::vector<uint8_t> out;
+         std::vector<uint8_t> binary(size);
+         GLenum format = 0;
+         GLsizei length = 0;
+
+         glGetProgramBinary(prog, size, &length, &format, &binary[0]);
+         if (length <= 0)
+            return;
+
+         put_u32(out, PROGRAM_CACHE_MAGIC);
+         put_u32(out, format);
+         put_u32(out, key.size());
+         put_u32(out, length);
+         out.insert(out.end(), key.begin(), key.end());
+         out.insert(out.end(), binary.begin(), binary.begin() + length);
+
+         path_mkdir(directory.c_str());
+
+         FILE* file = fopen(entry_path(key).c_str(), "wb");
+         if (!file)
+            return;
+         fwrite(&out[0], 1, out.size(), file);
+         fclose(file);
+      }
+   }
+}
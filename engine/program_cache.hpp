@@ -0,0 +1,49 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRAM_CACHE_HPP__
+#define PROGRAM_CACHE_HPP__
+
+#include "gl.hpp"
+#include <string>
+
+namespace GL
+{
+   // Disk cache of linked program binaries, so a context reset does not
+   // compile every shader again. Entries are keyed by the shader sources
+   // and the driver's vendor, renderer and version strings; a binary the
+   // driver refuses just means a normal compile.
+   namespace ProgramCache
+   {
+      // Where cache files go; empty turns the cache off.
+      void set_directory(const std::string& dir);
+
+      // Reads the driver strings and binary support. Call on every
+      // context reset, after Caps::init().
+      void init();
+
+      // True if prog was linked from a cached binary. Otherwise prog is
+      // untouched and must be built from source.
+      bool load(GLuint prog, const std::string& vertex, const std::string& fragment);
+
+      // prepare() goes before glLinkProgram(), store() after a good link.
+      void prepare(GLuint prog);
+      void store(GLuint prog, const std::string& vertex, const std::string& fragment);
+   }
+}
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pvs.hpp"
+#include "bake_util.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+// Cells along the longest side of the level.
+#define PVS_GRID_SIZE 16
+// Rays cast from a cell towards a cluster before it counts as hidden.
+#define PVS_SAMPLES 32
+#define PVS_MAGIC 0x31535650 // "PVS1"
+
+namespace GL
+{
+   struct BakeTriangle
+   {
+      glm::vec3 v[3];
+      unsigned cluster;
+   };
+
+   struct PVS::Bake
+   {
+      PVS* pvs;
+      vector<BakeTriangle> triangles;
+      BVH bvh;
+      // Triangles of each cluster with their running area, so sample
+      // points spread evenly over its surface.
+      vector<vector<unsigned> > cluster_triangles;
+      vector<vector<float> > cluster_area;
+      vector<AABB> cluster_boxes;
+   };
+
+   static bool overlaps(const AABB& a, const AABB& b)
+   {
+      return a.lo.x <= b.hi.x && a.hi.x >= b.lo.x &&
+         a.lo.y <= b.hi.y && a.hi.y >= b.lo.y &&
+         a.lo.z <= b.hi.z && a.hi.z >= b.lo.z;
+   }
+
+   PVS::PVS() : cell_size(0.0f), clusters(0), row_size(0), signature(0)
+   {
+      dims[0] = dims[1] = dims[2] = 0;
+   }
+
+   void PVS::clear()
+   {
+      bits.clear();
+   }
+
+   void PVS::setup(const vector<std1::shared_ptr<Mesh> >& meshes)
+   {
+      clear();
+      clusters = meshes.size();
+      row_size = (clusters + 7) / 8;
+      dims[0] = dims[1] = dims[2] = 0;
+      signature = crc32(0, NULL, 0);
+
+      AABB bounds;
+      for (unsigned i = 0; i < meshes.size(); i++)
+      {
+         const vector<Vertex>& vertices = *meshes[i]->get_vertex();
+         if (!vertices.empty())
+            signature = crc32(signature, (const Bytef*)&vertices[0],
+                  vertices.size() * sizeof(Vertex));
+         signature = crc32(signature, (const Bytef*)&meshes[i]->get_model(),
+               sizeof(glm::mat4));
+
+         if (i == 0)
+            bounds = meshes[i]->get_world_bounds();
+         else
+            bounds.expand(meshes[i]->get_world_bounds());
+      }
+
+      glm::vec3 extent = bounds.hi - bounds.lo;
+      float longest = max(extent.x, max(extent.y, extent.z));
+      if (meshes.empty() || !(longest > 0.0f))
+         return;
+
+      origin = bounds.lo;
+      cell_size = longest / PVS_GRID_SIZE;
+      for (unsigned i = 0; i < 3; i++)
+         dims[i] = max(1, (int)ceil(extent[i] / cell_size));
+   }
+
+   AABB PVS::cell_box(unsigned cell) const
+   {
+      glm::vec3 lo = origin + cell_size * glm::vec3(
+            cell % dims[0], (cell / dims[0]) % dims[1], cell / (dims[0] * dims[1]));
+      return AABB(lo, lo + glm::vec3(cell_size));
+   }
+
+   void PVS::bake_cell(void* data, unsigned cell, vector<unsigned>& hits)
+   {
+      Bake& bake = *static_cast<Bake*>(data);
+      const PVS& pvs = *bake.pvs;
+      AABB box = pvs.cell_box(cell);
+      uint8_t* row = &bake.pvs->bits[cell * pvs.row_size];
+      uint32_t state = cell * 2654435761u + 1;
+
+      for (unsigned c = 0; c < pvs.clusters; c++)
+      {
+         const vector<unsigned>& tris = bake.cluster_triangles[c];
+         const vector<float>& area = bake.cluster_area[c];
+         if (tris.empty())
+            continue;
+
+         bool visible = overlaps(bake.cluster_boxes[c], box);
+
+         for (unsigned s = 0; s < PVS_SAMPLES && !visible; s++)
+         {
+            glm::vec3 from = box.lo + (box.hi - box.lo) * glm::vec3(BakeUtil::random_unit(state),
+                  BakeUtil::random_unit(state), BakeUtil::random_unit(state));
+
+            unsigned pick = upper_bound(area.begin(), area.end(),
+                  BakeUtil::random_unit(state) * area.back()) - area.begin();
+            const BakeTriangle& target = bake.triangles[tris[min<unsigned>(pick, tris.size() - 1)]];
+            float u = BakeUtil::random_unit(state);
+            float v = BakeUtil::random_unit(state);
+            if (u + v > 1.0f)
+            {
+               u = 1.0f - u;
+               v = 1.0f - v;
+            }
+            glm::vec3 to = target.v[0] + (target.v[1] - target.v[0]) * u +
+               (target.v[2] - target.v[0]) * v;
+            glm::vec3 dir = to - from;
+
+            // Whatever is hit first owns the ray; a miss means the target
+            // slipped between float cracks and counts as seen.
+            float nearest = 1.001f;
+            unsigned owner = c;
+
+            hits.clear();
+            bake.bvh.raycast(from, dir, hits);
+            for (unsigned i = 0; i < hits.size(); i++)
+            {
+               const BakeTriangle& tri = bake.triangles[hits[i]];
+               float t;
+               if (intersect_triangle(tri.v, from, dir, t) && t > 1e-5f && t < nearest)
+               {
+                  nearest = t;
+                  owner = tri.cluster;
+               }
+            }
+
+            visible = owner == c;
+         }
+
+         if (visible)
+            row[c >> 3] |= 1 << (c & 7);
+      }
+   }
+
+   // Grows every set by its face neighbours, so walking into a cell does
+   // not pop in what only its far side sampled.
+   void PVS::dilate()
+   {
+      vector<uint8_t> grown(bits);
+      int offsets[3] = { 1, (int)dims[0], (int)(dims[0] * dims[1]) };
+
+      for (unsigned cell = 0; cell < cell_count(); cell++)
+      {
+         unsigned coord[3] = { cell % dims[0], (cell / dims[0]) % dims[1], cell / (dims[0] * dims[1]) };
+
+         for (unsigned axis = 0; axis < 3; axis++)
+         {
+            for (int sign = -1; sign <= 1; sign += 2)
+            {
+               if ((sign < 0 && coord[axis] == 0) || (sign > 0 && coord[axis] + 1 == dims[axis]))
+                  continue;
+
+               const uint8_t* src = &bits[(cell + sign * offsets[axis]) * row_size];
+               uint8_t* dst = &grown[cell * row_size];
+               for (unsigned i = 0; i < row_size; i++)
+                  dst[i] |= src[i];
+            }
+         }
+      }
+
+      bits.swap(grown);
+   }
+
+   void PVS::bake(const vector<std1::shared_ptr<Mesh> >& meshes)
+   {
+      setup(meshes);
+      if (!cell_count())
+         return;
+
+      Bake bake;
+      bake.pvs = this;
+      bake.cluster_triangles.resize(clusters);
+      bake.cluster_area.resize(clusters);
+      bake.cluster_boxes.resize(clusters);
+
+      vector<AABB> boxes;
+      for (unsigned c = 0; c < clusters; c++)
+      {
+         const vector<Vertex>& vertices = *meshes[c]->get_vertex();
+         const glm::mat4& model = meshes[c]->get_model();
+         bake.cluster_boxes[c] = meshes[c]->get_world_bounds();
+
+         if (meshes[c]->get_vertex_type() != GL_TRIANGLES)
+            continue;
+
+         float total = 0.0f;
+         for (unsigned i = 0; i + 2 < vertices.size(); i += 3)
+         {
+            BakeTriangle tri;
+            for (unsigned j = 0; j < 3; j++)
+               tri.v[j] = glm::vec3(model * glm::vec4(vertices[i + j].vert, 1.0f));
+            tri.cluster = c;
+
+            float area = glm::length(glm::cross(tri.v[1] - tri.v[0], tri.v[2] - tri.v[0]));
+            if (!(area > 0.0f))
+               continue;
+
+            AABB box(tri.v[0], tri.v[0]);
+            box.expand(AABB(tri.v[1], tri.v[1]));
+            box.expand(AABB(tri.v[2], tri.v[2]));
+
+            total += area;
+            bake.cluster_triangles[c].push_back(bake.triangles.size());
+            bake.cluster_area[c].push_back(total);
+            bake.triangles.push_back(tri);
+            boxes.push_back(box);
+         }
+      }
+      bake.bvh.build(boxes);
+
+      bits.assign(cell_count() * row_size, 0);
+
+      BakeUtil::run(cell_count(), bake_cell, &bake);
+      dilate();
+
+      if (log_cb)
+         log_cb(RETRO_LOG_INFO, "Baked PVS: %ux%ux%u cells, %u clusters.\n",
+               dims[0], dims[1], dims[2], clusters);
+   }
+
+   void PVS::header(vector<uint32_t>& out) const
+   {
+      out.clear();
+      out.push_back(PVS_MAGIC);
+      out.push_back(signature);
+      for (unsigned i = 0; i < 3; i++)
+         out.push_back(dims[i]);
+      out.push_back(clusters);
+      out.push_back(cell_count() * row_size);
+   }
+
+   bool PVS::save(const string& path) const
+   {
+      vector<uint32_t> words;
+      header(words);
+      return BakeUtil::save(path, words, bits);
+   }
+
+   bool PVS::load(const string& path, const vector<std1::shared_ptr<Mesh> >& meshes)
+   {
+      setup(meshes);
+      if (!cell_count())
+         return false;
+
+      vector<uint32_t> words;
+      header(words);
+      bits.resize(cell_count() * row_size);
+      if (!BakeUtil::load(path, words, bits))
+      {
+         clear();
+         return false;
+      }
+
+      return true;
+   }
+
+   unsigned PVS::filter(const glm::vec3& pos, vector<unsigned>& visible) const
+   {
+      if (bits.empty())
+         return 0;
+
+      glm::vec3 rel = (pos - origin) / cell_size;
+      int coord[3];
+      for (unsigned i = 0; i < 3; i++)
+      {
+         coord[i] = (int)floor(rel[i]);
+         if (coord[i] < 0 || coord[i] >= (int)dims[i])
+            return 0;
+      }
+
+      const uint8_t* row = &bits[((coord[2] * dims[1] + coord[1]) * dims[0] + coord[0]) * row_size];
+      unsigned kept = 0;
+
+      for (unsigned i = 0; i < visible.size(); i++)
+      {
+         unsigned c = visible[i];
+         if (c >= clusters || (row[c >> 3] & (1 << (c & 7))))
+            visible[kept++] = c;
+      }
+
+      unsigned removed = visible.size() - kept;
+      visible.resize(kept);
+      return removed;
+   }
+}
@@ -0,0 +1,73 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PVS_HPP__
+#define PVS_HPP__
+
+#include "mesh.hpp"
+#include "bvh.hpp"
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+namespace GL
+{
+   // Potentially visible set for static levels. The level's bounding box
+   // is split into cells, and every cell stores a bit per cluster (mesh)
+   // which can be seen from somewhere inside it. Looking a position up is
+   // a single index computation.
+   class PVS
+   {
+      public:
+         PVS();
+
+         void bake(const std::vector<std1::shared_ptr<Mesh> >& meshes);
+
+         // Sidecar cache. load() fails if the file was baked for other
+         // geometry.
+         bool load(const std::string& path, const std::vector<std1::shared_ptr<Mesh> >& meshes);
+         bool save(const std::string& path) const;
+
+         void clear();
+         bool empty() const { return bits.empty(); }
+
+         // Removes the clusters which cannot be seen from pos and returns
+         // how many went. Positions outside the grid keep everything.
+         unsigned filter(const glm::vec3& pos, std::vector<unsigned>& visible) const;
+
+      private:
+         struct Bake;
+
+         glm::vec3 origin;
+         float cell_size;
+         unsigned dims[3];
+         unsigned clusters;
+         unsigned row_size;
+         uint32_t signature;
+         std::vector<uint8_t> bits;
+
+         void setup(const std::vector<std1::shared_ptr<Mesh> >& meshes);
+         unsigned cell_count() const { return dims[0] * dims[1] * dims[2]; }
+         AABB cell_box(unsigned cell) const;
+         void dilate();
+         void header(std::vector<uint32_t>& out) const;
+
+         static void bake_cell(void* data, unsigned cell, std::vector<unsigned>& hits);
+   };
+}
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "render_queue.hpp"
+#include "gl_state.hpp"
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+
+// Frame blocks are small, so this lasts many frames between wraps.
+#define FRAME_STREAM_SIZE (48 * 1024)
+
+// Light cluster textures take this unit and the two after it.
+#define LIGHT_CLUSTER_UNIT 2
+
+namespace GL
+{
+   uint16_t RenderQueue::depth_bits(float depth)
+   {
+      uint32_t bits;
+
+      if (!(depth > 0.0f))
+         return 0;
+
+      // Positive IEEE floats sort like their bit patterns.
+      memcpy(&bits, &depth, sizeof(bits));
+      return bits >> 16;
+   }
+
+   uint16_t RenderQueue::material_bits(const Material& material)
+   {
+      const float values[] = {
+         material.ambient.x, material.ambient.y, material.ambient.z,
+         material.diffuse.x, material.diffuse.y, material.diffuse.z,
+         material.specular.x, material.specular.y, material.specular.z,
+         material.specular_power, material.alpha_mod,
+      };
+      const uint8_t* data = reinterpret_cast<const uint8_t*>(values);
+      uint32_t hash = 2166136261u;
+
+      for (unsigned i = 0; i < sizeof(values); i++)
+      {
+         hash ^= data[i];
+         hash *= 16777619u;
+      }
+
+      return hash ^ (hash >> 16);
+   }
+
+   RenderQueue::Pass RenderQueue::classify(const Mesh& mesh, bool prefer_alpha_test)
+   {
+      Texture* tex = mesh.get_texture(0);
+      Pass pass = PASS_OPAQUE;
+
+      if (tex && tex->has_alpha())
+         pass = tex->has_partial_alpha() && !prefer_alpha_test ? PASS_BLEND : PASS_ALPHA_TEST;
+      if (mesh.get_material().alpha_mod < 1.0f)
+         pass = PASS_BLEND;
+
+      return pass;
+   }
+
+   void RenderQueue::set_pass_state(unsigned pass, bool prepassed)
+   {
+      if (pass == PASS_BLEND)
+      {
+         State::enable(GL_BLEND);
+         State::blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      }
+      else
+         State::disable(GL_BLEND);
+
+      if (pass == PASS_OPAQUE && prepassed)
+      {
+         State::depth_func(GL_LEQUAL);
+         State::depth_mask(GL_FALSE);
+      }
+      else
+      {
+         State::depth_func(GL_LESS);
+         State::depth_mask(pass != PASS_BLEND);
+      }
+   }
+
+#ifdef HAVE_GL3
+   // The Frame block is written once, and again only if a mesh disagrees
+   // with the one it was written for.
+   void RenderQueue::set_frame(Shader& shader, Mesh& mesh, Mesh*& frame)
+   {
+      if (!shader.has_block(Shader::BLOCK_FRAME) ||
+            (frame && mesh.same_frame(*frame)))
+         return;
+
+      FrameUniforms data;
+      mesh.get_frame_uniforms(data);
+      if (light_clusters)
+         light_clusters->get_frame_uniforms(data);
+
+      if (!frame_stream)
+      {
+         GLint alignment = 0;
+         glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+         frame_alignment = alignment > 0 ? alignment : 256;
+         frame_stream = std1::shared_ptr<StreamBuffer>(
+               new StreamBuffer(GL_UNIFORM_BUFFER, FRAME_STREAM_SIZE));
+      }
+
+      size_t offset = frame_stream->write(&data, sizeof(data), frame_alignment);
+      State::bind_buffer_range(GL_UNIFORM_BUFFER, Shader::BLOCK_FRAME,
+            frame_stream->get_buffer(), offset, sizeof(data));
+      frame = &mesh;
+   }
+#endif
+
+   // Items are sorted, so the opaque ones come first.
+   void RenderQueue::depth_prepass()
+   {
+      Mesh* last = NULL;
+#ifdef HAVE_GL3
+      Mesh* frame = NULL;
+#endif
+
+      State::disable(GL_BLEND);
+      State::depth_func(GL_LESS);
+      State::depth_mask(GL_TRUE);
+      State::color_mask(GL_FALSE);
+      depth_shader->use();
+
+      for (unsigned i = 0; i < items.size() && items[i].key >> 60 == PASS_OPAQUE; i++)
+      {
+         Mesh* mesh = items[i].mesh;
+
+#ifdef HAVE_GL3
+         set_frame(*depth_shader, *mesh, frame);
+#endif
+         if (!last || !mesh->same_transform(*last))
+            mesh->set_transform_uniforms(*depth_shader);
+
+         mesh->bind_positions(*depth_shader);
+         mesh->draw_positions();
+         last = mesh;
+      }
+
+      if (last)
+         last->unbind_positions(*depth_shader);
+      State::color_mask(GL_TRUE);
+   }
+
+   void RenderQueue::push(const std1::shared_ptr<Mesh>& mesh, Pass pass)
+   {
+      Mesh* m = const_cast<Mesh*>(mesh.get());
+      // Meshes still uploading or compiling are left out rather than
+      // waited for.
+      if (!m->get_vertex() || !m->get_range().count || !m->ready() ||
+            !m->get_shader().get() || !m->get_shader()->ready())
+         return;
+
+      pair<Texture*, Texture*> textures(m->get_texture(0), m->get_texture(1));
+      map<pair<Texture*, Texture*>, unsigned>::iterator itr = texture_sets.find(textures);
+      unsigned texture_set = texture_sets.size();
+
+      if (itr == texture_sets.end())
+         texture_sets[textures] = texture_set;
+      else
+         texture_set = itr->second;
+
+      uint64_t depth = depth_bits(m->get_view_depth());
+      uint64_t state = (uint64_t(m->get_shader()->get_program() & 0xfff) << 32) |
+         (uint64_t(texture_set & 0xffff) << 16) |
+         material_bits(m->get_material());
+
+      Item item;
+      item.mesh = m;
+
+      // Blended geometry goes back to front, everything else front to back.
+      if (pass == PASS_BLEND)
+         item.key = (uint64_t(pass) << 60) | (uint64_t(uint16_t(~depth)) << 44) | state;
+      else
+         item.key = (uint64_t(pass) << 60) | (state << 16) | depth;
+
+      items.push_back(item);
+   }
+
+   void RenderQueue::submit()
+   {
+      Mesh* last       = NULL;
+      unsigned pass    = ~0u;
+      Shader* shader   = NULL;
+      Texture* tex0    = NULL;
+      Texture* tex1    = NULL;
+#ifdef HAVE_GL3
+      Mesh* frame      = NULL;
+#endif
+
+      sort(items.begin(), items.end());
+
+      bool prepassed = depth_shader && !items.empty() && items[0].key >> 60 == PASS_OPAQUE;
+      if (prepassed)
+         depth_prepass();
+
+#ifdef HAVE_GL3
+      if (light_clusters && !items.empty())
+         light_clusters->bind(LIGHT_CLUSTER_UNIT);
+#endif
+
+      for (unsigned i = 0; i < items.size(); i++)
+      {
+         Mesh* mesh = items[i].mesh;
+         bool shader_changed = mesh->get_shader().get() != shader;
+
+         // Nothing to change since the last mesh, so it can go out in the
+         // same multi-draw.
+         if (!shader_changed && items[i].key >> 60 == pass &&
+               mesh->get_texture(0) == tex0 && mesh->get_texture(1) == tex1 &&
+               mesh->same_geometry(*last) && mesh->same_material(*last) &&
+               mesh->same_transform(*last) && mesh->same_frame(*last))
+         {
+            add_draw(*mesh);
+            last = mesh;
+            continue;
+         }
+
+         if (last)
+            flush_draws(last->get_vertex_type());
+
+         if (items[i].key >> 60 != pass)
+         {
+            pass = items[i].key >> 60;
+            set_pass_state(pass, prepassed);
+         }
+
+         if (shader_changed)
+         {
+            if (last)
+               last->unbind_vertices();
+
+            shader = const_cast<Shader*>(mesh->get_shader().get());
+            shader->use();
+
+            glUniform1i(shader->uniform(Shader::UNIFORM_DIFFUSE_SAMPLER), 0);
+            glUniform1i(shader->uniform(Shader::UNIFORM_AMBIENT_SAMPLER), 1);
+#ifdef HAVE_GL3
+            if (light_clusters)
+            {
+               glUniform1i(shader->uniform(Shader::UNIFORM_LIGHTS_SAMPLER), LIGHT_CLUSTER_UNIT);
+               glUniform1i(shader->uniform(Shader::UNIFORM_CLUSTERS_SAMPLER), LIGHT_CLUSTER_UNIT + 1);
+               glUniform1i(shader->uniform(Shader::UNIFORM_LIGHT_INDEX_SAMPLER), LIGHT_CLUSTER_UNIT + 2);
+            }
+#endif
+         }
+
+         if (mesh->get_texture(0) != tex0)
+         {
+            tex0 = mesh->get_texture(0);
+            if (tex0)
+               tex0->bind(0);
+         }
+
+         if (mesh->get_texture(1) != tex1)
+         {
+            tex1 = mesh->get_texture(1);
+            if (tex1)
+               tex1->bind(1);
+         }
+
+#ifdef HAVE_GL3
+         set_frame(*shader, *mesh, frame);
+#endif
+
+         if (shader_changed || !mesh->same_material(*last))
+            mesh->set_material_uniforms();
+         if (shader_changed || !mesh->same_lighting(*last))
+            mesh->set_lighting_uniforms();
+         if (shader_changed || !mesh->same_transform(*last))
+            mesh->set_transform_uniforms();
+
+         if (shader_changed || !mesh->same_geometry(*last))
+            mesh->bind_vertices();
+         add_draw(*mesh);
+
+         last = mesh;
+      }
+
+      if (last)
+      {
+         flush_draws(last->get_vertex_type());
+         last->unbind_vertices();
+
+         // Depth writes have to be back on for the next clear.
+         if (pass != PASS_OPAQUE || prepassed)
+            set_pass_state(PASS_OPAQUE, false);
+
+         Texture::unbind(0);
+         Texture::unbind(1);
+#ifdef HAVE_GL3
+         if (light_clusters)
+            LightClusters::unbind(LIGHT_CLUSTER_UNIT);
+#endif
+         Shader::unbind();
+      }
+
+      clear();
+   }
+
+   void RenderQueue::add_draw(const Mesh& mesh)
+   {
+      const GeometryRange& range = mesh.get_range();
+      GLenum mode = mesh.get_vertex_type();
+
+      // Lists of separate primitives can be joined when they touch.
+      if (!draw_first.empty() &&
+            draw_first.back() + draw_count.back() == range.first &&
+            (mode == GL_TRIANGLES || mode == GL_LINES || mode == GL_POINTS))
+      {
+         draw_count.back() += range.count;
+         return;
+      }
+
+      draw_first.push_back(range.first);
+      draw_count.push_back(range.count);
+   }
+
+   void RenderQueue::flush_draws(GLenum mode)
+   {
+      if (draw_first.empty())
+         return;
+
+#ifndef HAVE_OPENGLES
+      if (draw_first.size() > 1)
+         glMultiDrawArrays(mode, &draw_first[0], &draw_count[0], draw_first.size());
+      else
+#endif
+      {
+         for (unsigned i = 0; i < draw_first.size(); i++)
+            glDrawArrays(mode, draw_first[i], draw_count[i]);
+      }
+
+      draw_first.clear();
+      draw_count.clear();
+   }
+
+   void RenderQueue::clear()
+   {
+      items.clear();
+      texture_sets.clear();
+   }
+
+   void RenderQueue::reset()
+   {
+      clear();
+      depth_shader.reset();
+#ifdef HAVE_GL3
+      frame_stream.reset();
+      light_clusters.reset();
+#endif
+   }
+}
@@ -0,0 +1,115 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RENDER_QUEUE_HPP__
+#define RENDER_QUEUE_HPP__
+
+#include "mesh.hpp"
+#include "stream_buffer.hpp"
+#include "light_clusters.hpp"
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+namespace GL
+{
+   // Collects the meshes of a frame, sorts them by a 64-bit state key and
+   // submits them while only touching the GL state which differs between
+   // consecutive draws.
+   //
+   // Key layout, most significant first:
+   //   pass (4) | shader (12) | texture set (16) | material (16) | depth (16)
+   // except for the blend pass, which needs strict back to front order:
+   //   pass (4) | depth (16) | shader (12) | texture set (16) | material (16)
+   //
+   // Passes run in enum order. Opaque and alpha tested meshes draw with
+   // blending off; blended ones with depth writes off.
+   //
+   // Consecutive meshes which need no state change in between, and sit in
+   // the same GeometryPool block, are drawn with one glMultiDrawArrays
+   // (a loop of glDrawArrays on GLES).
+   //
+   // With a depth shader set, opaque meshes first lay down depth alone
+   // from their position stream, and are then shaded with GL_LEQUAL and
+   // depth writes off, so every pixel is lit once. The depth shader must
+   // compute gl_Position like the lit shaders: it should share their
+   // vertex code and declare gl_Position invariant.
+   //
+   // Light clusters, when set, are bound for the whole submit and their
+   // grid parameters written into the Frame block.
+   class RenderQueue
+   {
+      public:
+         enum Pass
+         {
+            PASS_OPAQUE = 0,
+            PASS_ALPHA_TEST,
+            PASS_BLEND
+         };
+
+         // From alpha_mod and the alpha of the diffuse texture. Textures
+         // with soft edges blend unless prefer_alpha_test is set.
+         static Pass classify(const Mesh& mesh, bool prefer_alpha_test = false);
+
+         void push(const std1::shared_ptr<Mesh>& mesh, Pass pass = PASS_OPAQUE);
+
+         // NULL turns the depth pre-pass off.
+         void set_depth_prepass(const std1::shared_ptr<Shader>& shader) { depth_shader = shader; }
+         bool has_depth_prepass() const { return depth_shader.get(); }
+#ifdef HAVE_GL3
+         // NULL turns point lights off.
+         void set_light_clusters(const std1::shared_ptr<LightClusters>& clusters) { light_clusters = clusters; }
+#endif
+         void submit();
+         void clear();
+
+         // Drops GL objects owned by the queue; for context teardown.
+         void reset();
+
+      private:
+         struct Item
+         {
+            uint64_t key;
+            Mesh* mesh;
+
+            bool operator<(const Item& other) const { return key < other.key; }
+         };
+
+         std::vector<Item> items;
+         std::map<std::pair<Texture*, Texture*>, unsigned> texture_sets;
+         std1::shared_ptr<Shader> depth_shader;
+         std::vector<GLint> draw_first;
+         std::vector<GLsizei> draw_count;
+#ifdef HAVE_GL3
+         std1::shared_ptr<StreamBuffer> frame_stream;
+         size_t frame_alignment;
+         std1::shared_ptr<LightClusters> light_clusters;
+#endif
+
+         static uint16_t depth_bits(float depth);
+         void add_draw(const Mesh& mesh);
+         void flush_draws(GLenum mode);
+         static uint16_t material_bits(const Material& material);
+         static void set_pass_state(unsigned pass, bool prepassed);
+         void depth_prepass();
+#ifdef HAVE_GL3
+         void set_frame(Shader& shader, Mesh& mesh, Mesh*& frame);
+#endif
+   };
+}
+
+#endif
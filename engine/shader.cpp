@@ -16,30 +16,183 @@
  */
 
 #include "shader.hpp"
+#include "gl_state.hpp"
+#include "caps.hpp"
+#include "program_cache.hpp"
 #include <vector>
 
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
 namespace GL
 {
-   Shader::Shader(const std::string& vertex_src, const std::string& fragment_src)
+   static const char* uniform_names[Shader::UNIFORM_COUNT] = {
+      "uModel",
+      "uMVP",
+      "uEyePos",
+      "uLightPos",
+      "uLightAmbient",
+      "uMTLAmbient",
+      "uMTLDiffuse",
+      "uMTLSpecular",
+      "uMTLSpecularPower",
+      "uMTLAlphaMod",
+      "sDiffuse",
+      "sAmbient",
+      "sLights",
+      "sClusters",
+      "sLightIndex",
+   };
+
+   static const char* attrib_names[Shader::ATTRIB_COUNT] = {
+      "aVertex",
+      "aNormal",
+      "aTex",
+   };
+
+#ifdef HAVE_GL3
+   static const char* block_names[Shader::BLOCK_COUNT] = {
+      "Frame",
+      "Material",
+   };
+#endif
+
+   // Sources are written in GLSL 1.x. On the GL3/GLES3 path they get a
+   // header which maps them onto GLSL 3.30 / ESSL 3.00 and defines UBO so
+   // they can switch to uniform blocks.
+   static std::string translate(GLenum type, const std::string& source)
+   {
+      std::string header;
+      std::string body;
+      size_t pos = 0;
+
+      if (!Caps::modern())
+         return source;
+
+      header = Caps::gles() ? "#version 300 es\n" : "#version 330 core\n";
+
+      // #extension has to come before anything which is not a directive.
+      while (source.compare(pos, 10, "#extension") == 0)
+      {
+         size_t end = source.find('\n', pos);
+         if (end == std::string::npos)
+            end = source.size() - 1;
+         header += source.substr(pos, end + 1 - pos);
+         pos = end + 1;
+      }
+      body = source.substr(pos);
+
+      header += "#define UBO\n"
+         "#define texture2D texture\n";
+
+      if (type == GL_VERTEX_SHADER)
+         header += "#define attribute in\n"
+            "#define varying out\n";
+      else
+      {
+         if (Caps::gles())
+            header += "precision mediump float;\n";
+         header += "#define varying in\n"
+            "out vec4 FragColor;\n";
+
+         for (pos = body.find("gl_FragColor"); pos != std::string::npos;
+               pos = body.find("gl_FragColor", pos))
+            body.replace(pos, 12, "FragColor");
+      }
+
+      return header + body;
+   }
+
+   Shader::Shader(const std::string& vertex_src, const std::string& fragment_src,
+         bool deferred) : pending(false), linked(true)
    {
-      prog          = glCreateProgram();
+      prog = glCreateProgram();
+
+      if (ProgramCache::load(prog, vertex_src, fragment_src))
+         resolve();
+      else
+      {
+         submit(vertex_src, fragment_src);
+         pending_vertex   = vertex_src;
+         pending_fragment = fragment_src;
+         pending          = true;
 
-      GLint status  = 0;
-      GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_src);
-      GLuint frag   = compile_shader(GL_FRAGMENT_SHADER, fragment_src);
+         if (!deferred)
+            wait();
+      }
+   }
 
-      if (vertex)
-         glAttachShader(prog, vertex);
-      if (frag)
-         glAttachShader(prog, frag);
+   void Shader::resolve()
+   {
+      // Querying an unlinked program only raises errors.
+      if (!linked)
+      {
+         for (unsigned i = 0; i < UNIFORM_COUNT; i++)
+            uniforms[i] = -1;
+         for (unsigned i = 0; i < ATTRIB_COUNT; i++)
+            attribs[i] = -1;
+         for (unsigned i = 0; i < BLOCK_COUNT; i++)
+            blocks[i] = false;
+         return;
+      }
 
+      for (unsigned i = 0; i < UNIFORM_COUNT; i++)
+         uniforms[i] = glGetUniformLocation(prog, uniform_names[i]);
+      for (unsigned i = 0; i < ATTRIB_COUNT; i++)
+         attribs[i] = glGetAttribLocation(prog, attrib_names[i]);
+
+      for (unsigned i = 0; i < BLOCK_COUNT; i++)
+      {
+         blocks[i] = false;
+#ifdef HAVE_GL3
+         if (Caps::modern())
+         {
+            GLuint index = glGetUniformBlockIndex(prog, block_names[i]);
+            if (index != GL_INVALID_INDEX)
+            {
+               glUniformBlockBinding(prog, index, i);
+               blocks[i] = true;
+            }
+         }
+#endif
+      }
+   }
+
+   // Queues the compile and link without asking for any status, so the
+   // driver is free to finish the work in the background.
+   void Shader::submit(const std::string& vertex_src, const std::string& fragment_src)
+   {
+      glAttachShader(prog, compile_shader(GL_VERTEX_SHADER, vertex_src));
+      glAttachShader(prog, compile_shader(GL_FRAGMENT_SHADER, fragment_src));
+
+      // Fixed locations let a VAO be shared by every shader.
+      for (unsigned i = 0; i < ATTRIB_COUNT; i++)
+         glBindAttribLocation(prog, i, attrib_names[i]);
+
+      ProgramCache::prepare(prog);
       glLinkProgram(prog);
+   }
+
+   void Shader::finish()
+   {
+      GLint status = 0;
       glGetProgramiv(prog, GL_LINK_STATUS, &status);
-      if (!status)
+
+      linked = status != 0;
+      if (linked)
+         ProgramCache::store(prog, pending_vertex, pending_fragment);
+      else
       {
+         GLsizei count;
+         GLuint shaders[2];
          GLint len = 0;
-         glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &len);
 
+         glGetAttachedShaders(prog, 2, &count, shaders);
+         for (GLsizei i = 0; i < count; i++)
+            check_shader(shaders[i]);
+
+         glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &len);
          if (len > 0)
          {
             std::vector<char> buf(len + 1);
@@ -50,39 +203,66 @@ namespace GL
                log_cb(RETRO_LOG_ERROR, "Link error: %s\n", &buf[0]);
          }
       }
+
+      resolve();
+      pending = false;
+      pending_vertex.clear();
+      pending_fragment.clear();
+   }
+
+   bool Shader::ready()
+   {
+      if (!pending)
+         return true;
+      if (!Caps::parallel_compile())
+         return false;
+
+      GLint done = 0;
+      glGetProgramiv(prog, GL_COMPLETION_STATUS_KHR, &done);
+      if (!done)
+         return false;
+
+      finish();
+      return true;
+   }
+
+   void Shader::wait()
+   {
+      if (pending)
+         finish();
    }
 
    GLuint Shader::compile_shader(GLenum type, const std::string& source)
    {
-      GLint status    = 0;
       GLuint shader   = glCreateShader(type);
-      const char* src = source.c_str();
+      std::string translated = translate(type, source);
+      const char* src = translated.c_str();
 
       glShaderSource(shader, 1, &src, NULL);
       glCompileShader(shader);
+      return shader;
+   }
 
+   void Shader::check_shader(GLuint shader)
+   {
+      GLint status = 0;
       glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-      if (!status)
-      {
-         GLint len = 0;
-         glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
+      if (status)
+         return;
 
-         if (len > 0)
-         {
-            GLsizei out_len;
-            std::vector<char> buf(len + 1);
+      GLint len = 0;
+      glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
 
-            glGetShaderInfoLog(shader, len, &out_len, &buf[0]);
+      if (len > 0)
+      {
+         GLsizei out_len;
+         std::vector<char> buf(len + 1);
 
-            if (log_cb)
-               log_cb(RETRO_LOG_ERROR, "Shader error: %s\n", &buf[0]);
-         }
+         glGetShaderInfoLog(shader, len, &out_len, &buf[0]);
 
-         glDeleteShader(shader);
-         return 0;
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "Shader error: %s\n", &buf[0]);
       }
-
-      return shader;
    }
 
    Shader::~Shader()
@@ -102,27 +282,27 @@ namespace GL
          glDeleteShader(shaders[i]);
       }
 
-      glDeleteProgram(prog);
+      State::delete_program(prog);
    }
 
    void Shader::use()
    {
-      glUseProgram(prog);
+      State::use_program(prog);
    }
 
    void Shader::unbind()
    {
-      glUseProgram(0);
+      State::use_program(0);
    }
 
    GLint Shader::uniform(const char* sym)
    {
-      std::map<std::string, GLint>::iterator itr = map.find(sym);
+      std::map<std::string, GLint>::iterator itr = uniform_map.find(sym);
 
-      if (itr == map.end())
+      if (itr == uniform_map.end())
       {
          GLint ret = glGetUniformLocation(prog, sym);
-         map[sym]  = ret;
+         uniform_map[sym] = ret;
          return ret;
       }
 
@@ -131,12 +311,12 @@ namespace GL
 
    GLint Shader::attrib(const char* sym)
    {
-      std::map<std::string, GLint>::iterator itr = map.find(sym);
+      std::map<std::string, GLint>::iterator itr = attrib_map.find(sym);
 
-      if (itr == map.end())
+      if (itr == attrib_map.end())
       {
          GLint ret = glGetAttribLocation(prog, sym);
-         map[sym]  = ret;
+         attrib_map[sym] = ret;
          return ret;
       }
 
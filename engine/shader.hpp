@@ -26,20 +26,87 @@ namespace GL
    class Shader
    {
       public:
-         Shader(const std::string& vertex, const std::string& fragment);
+         // Semantic slots resolved once at link time, so the hot path only
+         // does an array read. Anything else goes through the string lookups.
+         enum Uniform
+         {
+            UNIFORM_MODEL = 0,
+            UNIFORM_MVP,
+            UNIFORM_EYE_POS,
+            UNIFORM_LIGHT_POS,
+            UNIFORM_LIGHT_AMBIENT,
+            UNIFORM_MTL_AMBIENT,
+            UNIFORM_MTL_DIFFUSE,
+            UNIFORM_MTL_SPECULAR,
+            UNIFORM_MTL_SPECULAR_POWER,
+            UNIFORM_MTL_ALPHA_MOD,
+            UNIFORM_DIFFUSE_SAMPLER,
+            UNIFORM_AMBIENT_SAMPLER,
+            UNIFORM_LIGHTS_SAMPLER,
+            UNIFORM_CLUSTERS_SAMPLER,
+            UNIFORM_LIGHT_INDEX_SAMPLER,
+            UNIFORM_COUNT
+         };
+
+         enum Attrib
+         {
+            ATTRIB_VERTEX = 0,
+            ATTRIB_NORMAL,
+            ATTRIB_TEX,
+            ATTRIB_COUNT
+         };
+
+         // Uniform blocks on the GL3/GLES3 path, bound to fixed binding
+         // points equal to their enum value.
+         enum Block
+         {
+            BLOCK_FRAME = 0,
+            BLOCK_MATERIAL,
+            BLOCK_COUNT
+         };
+
+         // A deferred shader only submits its sources; it cannot be used
+         // before ready() says so, or wait() has returned.
+         Shader(const std::string& vertex, const std::string& fragment, bool deferred = false);
          ~Shader();
          void use();
 
+         // Never blocks. Without parallel compile support the driver
+         // cannot be asked, so only wait() completes a deferred shader.
+         bool ready();
+         void wait();
+
+         // Finished, but the link failed; the error has been logged.
+         bool failed() const { return !pending && !linked; }
+
          static void unbind();
 
+         GLuint get_program() const { return prog; }
+
+         GLint uniform(Uniform slot) const { return uniforms[slot]; }
+         GLint attrib(Attrib slot) const { return attribs[slot]; }
+         bool has_block(Block block) const { return blocks[block]; }
+
          GLint uniform(const char* sym);
          GLint attrib(const char* sym);
 
       private:
          GLuint prog;
-         std::map<std::string, GLint> map;
+         bool pending;
+         bool linked;
+         std::string pending_vertex;
+         std::string pending_fragment;
+         GLint uniforms[UNIFORM_COUNT];
+         GLint attribs[ATTRIB_COUNT];
+         bool blocks[BLOCK_COUNT];
+         std::map<std::string, GLint> uniform_map;
+         std::map<std::string, GLint> attrib_map;
 
+         void submit(const std::string& vertex_src, const std::string& fragment_src);
+         void finish();
+         void resolve();
          GLuint compile_shader(GLenum type, const std::string& source);
+         static void check_shader(GLuint shader);
    };
 }
 
@@ -0,0 +1,79 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shader_variants.hpp"
+#include "caps.hpp"
+
+namespace GL
+{
+   ShaderVariants::ShaderVariants(const std::string& vertex, const std::string& fragment,
+         const char* const* defines, unsigned define_count) :
+      vertex(vertex), fragment(fragment), defines(defines, defines + define_count)
+   {}
+
+   const std1::shared_ptr<Shader>& ShaderVariants::get(unsigned features)
+   {
+      std::map<unsigned, std1::shared_ptr<Shader> >::iterator itr = variants.find(features);
+      if (itr != variants.end())
+         return itr->second->failed() && features ? get(0) : itr->second;
+
+      std::string header;
+      for (unsigned i = 0; i < defines.size(); i++)
+         if (features & (1u << i))
+            header += "#define " + defines[i] + "\n";
+
+      std1::shared_ptr<Shader>& shader = variants[features];
+      shader = std1::shared_ptr<Shader>(new Shader(header + vertex, header + fragment,
+               Caps::parallel_compile()));
+
+      if (!shader->ready())
+      {
+         pending.insert(features);
+         return shader;
+      }
+      if (!shader->failed())
+         return shader;
+
+      if (log_cb)
+         log_cb(RETRO_LOG_ERROR, "Shader variant 0x%x failed to link.\n", features);
+      return features ? get(0) : shader;
+   }
+
+   bool ShaderVariants::poll()
+   {
+      bool failed = false;
+      std::set<unsigned>::iterator itr = pending.begin();
+      while (itr != pending.end())
+      {
+         const std1::shared_ptr<Shader>& shader = variants[*itr];
+         if (!shader->ready())
+         {
+            ++itr;
+            continue;
+         }
+
+         if (shader->failed())
+         {
+            if (log_cb)
+               log_cb(RETRO_LOG_ERROR, "Shader variant 0x%x failed to link.\n", *itr);
+            failed = true;
+         }
+         pending.erase(itr++);
+      }
+      return failed;
+   }
+}
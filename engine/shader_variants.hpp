@@ -0,0 +1,63 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHADER_VARIANTS_HPP__
+#define SHADER_VARIANTS_HPP__
+
+#include "shader.hpp"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace GL
+{
+   // Programs specialised from one pair of sources by feature bits. Bit i
+   // defines the i-th name before the source, and each combination is
+   // compiled the first time it is asked for.
+   //
+   // With parallel compile, variants come back deferred and may not be
+   // ready() yet; poll() once a frame to finish them. Without it there is
+   // no way to ask the driver, so each variant is compiled and linked as
+   // soon as it is first asked for, which in practice means at load.
+   //
+   // A variant which fails to link is never handed out again; get()
+   // returns the base variant (no features) in its place.
+   class ShaderVariants
+   {
+      public:
+         ShaderVariants(const std::string& vertex, const std::string& fragment,
+               const char* const* defines, unsigned define_count);
+
+         const std1::shared_ptr<Shader>& get(unsigned features);
+
+         // Returns true when a variant turned out to have failed, and
+         // whatever get() returned for it should be fetched again.
+         bool poll();
+
+         size_t size() const { return variants.size(); }
+
+      private:
+         std::string vertex;
+         std::string fragment;
+         std::vector<std::string> defines;
+         std::map<unsigned, std1::shared_ptr<Shader> > variants;
+         std::set<unsigned> pending;
+   };
+}
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream_buffer.hpp"
+#include "gl_state.hpp"
+#include "caps.hpp"
+#include <string.h>
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT   0x0080
+#endif
+
+namespace GL
+{
+   StreamBuffer::StreamBuffer(GLenum target, size_t size) :
+      target(target), buffer(0), capacity(0), offset(0), mapped(NULL)
+   {
+      allocate(size);
+   }
+
+   StreamBuffer::~StreamBuffer()
+   {
+      if (!renderer_dead_state)
+         release();
+   }
+
+   void StreamBuffer::allocate(size_t size)
+   {
+      capacity = size;
+      offset   = 0;
+      mapped   = NULL;
+
+      glGenBuffers(1, &buffer);
+      State::bind_buffer(target, buffer);
+
+#ifdef HAVE_GL3
+      section = 0;
+      for (unsigned i = 0; i < SECTIONS; i++)
+         fences[i] = NULL;
+
+#ifndef HAVE_OPENGLES
+      if (Caps::buffer_storage() && glBufferStorage)
+      {
+         GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+         glBufferStorage(target, capacity, NULL, flags);
+         mapped = static_cast<uint8_t*>(glMapBufferRange(target, 0, capacity, flags));
+         if (mapped)
+            return;
+
+         // Storage is immutable now; start over with a plain buffer.
+         State::delete_buffer(buffer);
+         glGenBuffers(1, &buffer);
+         State::bind_buffer(target, buffer);
+      }
+#endif
+#endif
+
+      glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+   }
+
+   void StreamBuffer::release()
+   {
+#ifdef HAVE_GL3
+      for (unsigned i = 0; i < SECTIONS; i++)
+      {
+         if (fences[i])
+            glDeleteSync(fences[i]);
+         fences[i] = NULL;
+      }
+
+      if (mapped)
+      {
+         State::bind_buffer(target, buffer);
+         glUnmapBuffer(target);
+         mapped = NULL;
+      }
+#endif
+
+      State::delete_buffer(buffer);
+      buffer = 0;
+   }
+
+#ifdef HAVE_GL3
+   size_t StreamBuffer::write_persistent(const void* data, size_t size, size_t start)
+   {
+      size_t section_size = capacity / SECTIONS;
+      unsigned next       = start / section_size;
+
+      if (start + size > (next + 1) * section_size)
+         next++;
+      if (next >= SECTIONS)
+         next = 0;
+
+      if (next != section)
+      {
+         fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+         if (fences[next])
+         {
+            glClientWaitSync(fences[next], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(fences[next]);
+            fences[next] = NULL;
+         }
+
+         section = next;
+         start   = next * section_size;
+      }
+
+      memcpy(mapped + start, data, size);
+      offset = start + size;
+      return start;
+   }
+#endif
+
+   size_t StreamBuffer::write(const void* data, size_t size, size_t alignment)
+   {
+      size_t start = (offset + alignment - 1) & ~(alignment - 1);
+
+#ifdef HAVE_GL3
+      if (mapped)
+      {
+         if (size > capacity / SECTIONS)
+         {
+            // Draws already issued keep the old storage alive.
+            size_t grown = capacity * 2;
+            while (size > grown / SECTIONS)
+               grown *= 2;
+            release();
+            allocate(grown);
+            if (mapped)
+               return write_persistent(data, size, 0);
+         }
+         else
+            return write_persistent(data, size, start);
+      }
+#endif
+
+      State::bind_buffer(target, buffer);
+
+      if (start + size > capacity)
+      {
+         while (size > capacity)
+            capacity *= 2;
+
+         // Orphan: in-flight draws keep the old storage.
+         glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+         start = 0;
+      }
+
+#ifdef HAVE_GL3
+      if (Caps::modern())
+      {
+         void* ptr = glMapBufferRange(target, start, size, GL_MAP_WRITE_BIT |
+               GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+         if (ptr)
+         {
+            memcpy(ptr, data, size);
+            glUnmapBuffer(target);
+            offset = start + size;
+            return start;
+         }
+      }
+#endif
+
+      glBufferSubData(target, start, size, data);
+      offset = start + size;
+      return start;
+   }
+}
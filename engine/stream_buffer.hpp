@@ -0,0 +1,69 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_BUFFER_HPP__
+#define STREAM_BUFFER_HPP__
+
+#include "gl.hpp"
+#include <stdint.h>
+
+namespace GL
+{
+   // Ring buffer for data rewritten every frame. Each write() lands after
+   // the previous one, so nothing the GPU may still read is overwritten,
+   // and the driver never has to wait for it:
+   //
+   //  - With ARB_buffer_storage the buffer is mapped once, persistently,
+   //    and split in three sections. Leaving a section fences it, and
+   //    entering one waits on its fence, which has long signalled.
+   //  - Other GL3/GLES3 contexts write through unsynchronized
+   //    glMapBufferRange and orphan the storage when the ring wraps.
+   //  - GL2/GLES2 do the same with glBufferSubData.
+   //
+   // A write bigger than the ring grows it.
+   class StreamBuffer
+   {
+      public:
+         StreamBuffer(GLenum target, size_t size);
+         ~StreamBuffer();
+
+         // Returns the offset the data went to, a multiple of alignment,
+         // which must be a power of two.
+         size_t write(const void* data, size_t size, size_t alignment = 1);
+         GLuint get_buffer() const { return buffer; }
+
+      private:
+         enum { SECTIONS = 3 };
+
+         GLenum target;
+         GLuint buffer;
+         size_t capacity;
+         size_t offset;
+         uint8_t* mapped;
+#ifdef HAVE_GL3
+         unsigned section;
+         GLsync fences[SECTIONS];
+
+         size_t write_persistent(const void* data, size_t size, size_t start);
+#endif
+
+         void allocate(size_t size);
+         void release();
+   };
+}
+
+#endif
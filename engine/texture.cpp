@@ -16,6 +16,7 @@
  */
 
 #include "texture.hpp"
+#include "gl_state.hpp"
 #include "rpng.h"
 #include "util.hpp"
 #include <stdint.h>
@@ -36,7 +37,8 @@ using namespace std1;
 
 namespace GL
 {
-   Texture::Texture() : tex(0)
+   Texture::Texture() : tex(0), width(0), height(0), alpha(true), partial_alpha(true),
+      queued(false), queued_mipmap(false)
    {}
 
    void Texture::upload_data(const void* data, unsigned width, unsigned height,
@@ -45,6 +47,52 @@ namespace GL
       if (!tex)
          glGenTextures(1, &tex);
 
+      this->width  = width;
+      this->height = height;
+
+      alpha = partial_alpha = !data;
+      for (unsigned i = 0; data && i < width * height && !partial_alpha; i++)
+      {
+         uint8_t a = ((const uint8_t*)data)[i * 4 + 3];
+         if (a != 0xff)
+            alpha = true;
+         if (a != 0xff && a != 0)
+            partial_alpha = true;
+      }
+
+      if (data && UploadQueue::deferred())
+      {
+         const uint8_t* bytes = static_cast<const uint8_t*>(data);
+         queued_data.assign(bytes, bytes + width * height * 4);
+         queued_mipmap = generate_mipmap;
+         if (!queued)
+            UploadQueue::push(this);
+         queued = true;
+         return;
+      }
+
+      if (queued)
+      {
+         UploadQueue::remove(this);
+         queued = false;
+         vector<uint8_t>().swap(queued_data);
+      }
+
+      upload_now(data, generate_mipmap);
+   }
+
+   size_t Texture::upload()
+   {
+      size_t size = queued_data.size();
+
+      upload_now(&queued_data[0], queued_mipmap);
+      queued = false;
+      vector<uint8_t>().swap(queued_data);
+      return size;
+   }
+
+   void Texture::upload_now(const void* data, bool generate_mipmap)
+   {
       bind();
 
       glTexImage2D(GL_TEXTURE_2D,
@@ -84,10 +132,13 @@ namespace GL
       unsigned levels = 0;
       if (!tex)
          glGenTextures(1, &tex);
+      alpha = partial_alpha = true;
 
       if (log_cb)
          log_cb(RETRO_LOG_INFO, "Loading DDS: %s.\n", path.c_str());
       tex = gli::createTexture2D(path, &levels);
+      // gli binds the new texture itself on whatever unit is active.
+      State::reset();
 
       bind();
 
@@ -111,58 +162,74 @@ namespace GL
    }
 #endif
 
-   Texture::Texture(const std::string& path) : tex(0)
+   bool Texture::decode(const std::string& path, std::vector<uint8_t>& out,
+         unsigned& width, unsigned& height)
    {
-      string ext = Path::ext(path);
+      string ext    = Path::ext(path);
+      bool ret      = false;
+      uint8_t* data = NULL;
 
+      width  = 0;
+      height = 0;
+
+      if (ext == "png")
+      {
+         ret = rpng_load_image_rgba(path.c_str(),
+               &data, &width, &height);
+      }
+      else if (ext == "tga")
+      {
+         ret = texture_image_load_tga(path.c_str(),
+               data, width, height);
+      }
+      else if (log_cb)
+         log_cb(RETRO_LOG_ERROR, "Unrecognized extension: \"%s\"\n", ext.c_str());
+
+      if (!ret)
+      {
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "Failed to load image: %s\n", path.c_str());
+         return false;
+      }
+
+      out.assign(data, data + width * height * 4);
+      free(data);
+      return true;
+   }
+
+   Texture::Texture(const std::string& path) : tex(0), width(0), height(0), alpha(true), partial_alpha(true),
+      queued(false), queued_mipmap(false)
+   {
 #ifndef HAVE_OPENGLES
-      if (ext == "dds")
+      if (Path::ext(path) == "dds")
          load_dds(path);
       else
 #endif
       {
          unsigned width  = 0;
          unsigned height = 0;
-         bool ret        = false;
-         uint8_t* data   = NULL;
-
-         if (ext == "png")
-         {
-            ret = rpng_load_image_rgba(path.c_str(),
-                  &data, &width, &height);
-         }
-         else if (ext == "tga")
-         {
-            ret = texture_image_load_tga(path.c_str(),
-                  data, width, height);
-         }
-         else if (log_cb)
-            log_cb(RETRO_LOG_ERROR, "Unrecognized extension: \"%s\"\n", ext.c_str());
-
-         if (ret)
-         {
-            upload_data(data, width, height, true);
-            free(data);
-         }
-         else if (log_cb)
-            log_cb(RETRO_LOG_ERROR, "Failed to load image: %s\n", path.c_str());
+         std::vector<uint8_t> data;
+
+         if (decode(path, data, width, height))
+            upload_data(&data[0], width, height, true);
       }
    }
 
    Texture::~Texture()
    {
+      if (queued)
+         UploadQueue::remove(this);
+
       if (renderer_dead_state)
          return;
 
       if (tex)
-         glDeleteTextures(1, &tex);
+         State::delete_texture(tex);
    }
 
    void Texture::bind(unsigned unit)
    {
-      glActiveTexture(GL_TEXTURE0 + unit);
-      glBindTexture(GL_TEXTURE_2D, tex);
-      glActiveTexture(GL_TEXTURE0);
+      State::bind_texture(unit, GL_TEXTURE_2D, tex);
    }
 
    std1::shared_ptr<Texture> Texture::blank()
@@ -175,9 +242,7 @@ namespace GL
 
    void Texture::unbind(unsigned unit)
    {
-      glActiveTexture(GL_TEXTURE0 + unit);
-      glBindTexture(GL_TEXTURE_2D, 0);
-      glActiveTexture(GL_TEXTURE0);
+      State::bind_texture(unit, GL_TEXTURE_2D, 0);
    }
 }
 
@@ -19,10 +19,13 @@
 #define TEXTURE_HPP__
 
 #include "gl.hpp"
+#include "upload_queue.hpp"
+#include <stdint.h>
+#include <vector>
 
 namespace GL
 {
-   class Texture
+   class Texture : public Upload
    {
       public:
          Texture(const std::string& path);
@@ -35,11 +38,38 @@ namespace GL
          void load_dds(const std::string& path);
 
          static std1::shared_ptr<Texture> blank();
+         // With UploadQueue deferring, RGBA8 data is copied and handed to
+         // GL later; size and alpha are known straight away.
          void upload_data(const void* data, unsigned width, unsigned height,
                bool generate_mipmap);
+         size_t upload();
+         bool ready() const { return !queued; }
+
+         // Decodes a PNG or TGA image to tightly packed RGBA8.
+         static bool decode(const std::string& path, std::vector<uint8_t>& data,
+               unsigned& width, unsigned& height);
+
+         unsigned get_width() const { return width; }
+         unsigned get_height() const { return height; }
+
+         // Whether any texel is not fully opaque. Textures which were not
+         // uploaded from RGBA8 data count as having alpha.
+         bool has_alpha() const { return alpha; }
+         // Whether any texel is neither fully opaque nor fully clear, so
+         // an alpha test would cut visible edges.
+         bool has_partial_alpha() const { return partial_alpha; }
 
       private:
          GLuint tex;
+         unsigned width;
+         unsigned height;
+         bool alpha;
+         bool partial_alpha;
+         bool queued;
+         bool queued_mipmap;
+         std::vector<uint8_t> queued_data;
+
+         void upload_now(const void* data, bool generate_mipmap);
    };
 }
 
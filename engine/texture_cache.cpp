@@ -0,0 +1,205 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "texture_cache.hpp"
+#include "util.hpp"
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <utility>
+
+using namespace std;
+
+namespace GL
+{
+   namespace TextureCache
+   {
+      typedef pair<uint64_t, size_t> Key;
+
+      struct Entry
+      {
+         Entry() : width(0), height(0) {}
+
+         std1::shared_ptr<Texture> texture;
+         vector<uint8_t> pixels;
+         unsigned width;
+         unsigned height;
+      };
+
+      static map<Key, Entry> entries;
+      /* Paths seen before, so they are not decoded again to find their key. */
+      static map<string, Key> paths;
+      /* Live textures back to their entry, for get_pixels(). */
+      static map<const Texture*, Key> owners;
+      static bool keep_cpu_copy;
+
+      /* 64-bit FNV-1a. */
+      static uint64_t hash(const uint8_t* data, size_t size, uint64_t h = 0xcbf29ce484222325ull)
+      {
+         for (size_t i = 0; i < size; i++)
+         {
+            h ^= data[i];
+            h *= 0x100000001b3ull;
+         }
+         return h;
+      }
+
+      static std1::shared_ptr<Texture> upload(const Key& key)
+      {
+         Entry& entry = entries[key];
+         entry.texture = std1::shared_ptr<Texture>(new Texture);
+         entry.texture->upload_data(&entry.pixels[0], entry.width, entry.height, true);
+         owners[entry.texture.get()] = key;
+         return entry.texture;
+      }
+
+#ifndef HAVE_OPENGLES
+      /* DDS files are not decoded here; their key is the file contents. */
+      static std1::shared_ptr<Texture> load_dds(const string& path)
+      {
+         ifstream file(path.c_str(), ios::in | ios::binary);
+         if (!file.is_open())
+         {
+            if (log_cb)
+               log_cb(RETRO_LOG_ERROR, "Failed to open image: %s\n", path.c_str());
+            return std1::shared_ptr<Texture>(new Texture);
+         }
+
+         vector<char> contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+         Key key(hash(reinterpret_cast<const uint8_t*>(contents.empty() ? NULL : &contents[0]),
+                  contents.size()), contents.size());
+         paths[path] = key;
+
+         Entry& entry = entries[key];
+         if (!entry.texture)
+            entry.texture = std1::shared_ptr<Texture>(new Texture(path));
+         return entry.texture;
+      }
+#endif
+
+      std1::shared_ptr<Texture> load(const string& path)
+      {
+         map<string, Key>::iterator known = paths.find(path);
+         if (known != paths.end())
+         {
+            Entry& entry = entries[known->second];
+            if (entry.texture)
+               return entry.texture;
+            if (entry.pixels.size())
+               return upload(known->second);
+         }
+
+#ifndef HAVE_OPENGLES
+         if (Path::ext(path) == "dds")
+            return load_dds(path);
+#endif
+
+         vector<uint8_t> pixels;
+         unsigned width  = 0;
+         unsigned height = 0;
+
+         if (!Texture::decode(path, pixels, width, height))
+            return std1::shared_ptr<Texture>(new Texture);
+
+         /* The width goes into the hash so that equal bytes in another
+          * shape do not collide. */
+         Key key(hash(&pixels[0], pixels.size(), hash(reinterpret_cast<const uint8_t*>(&width),
+                     sizeof(width))), pixels.size());
+         paths[path] = key;
+
+         Entry& entry = entries[key];
+         if (entry.texture)
+            return entry.texture;
+
+         entry.pixels.swap(pixels);
+         entry.width  = width;
+         entry.height = height;
+         return upload(key);
+      }
+
+      const vector<uint8_t>* get_pixels(const Texture* texture)
+      {
+         map<const Texture*, Key>::const_iterator owner = owners.find(texture);
+         if (owner == owners.end())
+            return NULL;
+
+         const Entry& entry = entries[owner->second];
+         return entry.pixels.size() ? &entry.pixels : NULL;
+      }
+
+      void trim()
+      {
+         if (keep_cpu_copy)
+            return;
+
+         for (map<Key, Entry>::iterator itr = entries.begin(); itr != entries.end(); ++itr)
+         {
+            vector<uint8_t>().swap(itr->second.pixels);
+            itr->second.width  = 0;
+            itr->second.height = 0;
+         }
+      }
+
+      void set_keep_cpu_copy(bool enable)
+      {
+         keep_cpu_copy = enable;
+         trim();
+      }
+
+      void release_unused()
+      {
+         map<Key, Entry>::iterator itr = entries.begin();
+         while (itr != entries.end())
+         {
+            Entry& entry = itr->second;
+            if (entry.texture && entry.texture.use_count() == 1)
+            {
+               owners.erase(entry.texture.get());
+               entry.texture.reset();
+            }
+
+            if (entry.texture || (keep_cpu_copy && entry.pixels.size()))
+               ++itr;
+            else
+               entries.erase(itr++);
+         }
+      }
+
+      void release_textures()
+      {
+         owners.clear();
+
+         map<Key, Entry>::iterator itr = entries.begin();
+         while (itr != entries.end())
+         {
+            itr->second.texture.reset();
+
+            if (itr->second.pixels.size())
+               ++itr;
+            else
+               entries.erase(itr++);
+         }
+      }
+
+      void clear()
+      {
+         entries.clear();
+         paths.clear();
+         owners.clear();
+      }
+   }
+}
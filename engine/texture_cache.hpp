@@ -0,0 +1,57 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEXTURE_CACHE_HPP__
+#define TEXTURE_CACHE_HPP__
+
+#include "texture.hpp"
+#include <string>
+
+namespace GL
+{
+   /* Process-wide texture cache keyed by a hash of the decoded pixels, so
+    * an image referenced through different paths, materials or files is
+    * uploaded once. Each path is decoded only the first time it is seen.
+    * GL textures are dropped on context teardown; with the CPU copy
+    * enabled the decoded pixels survive and are re-uploaded on the next
+    * load without running the decoder again.
+    *
+    * Decoded pixels are always available between load() and trim(), so
+    * load-time passes like the atlas builder can inspect them. */
+   namespace TextureCache
+   {
+      std1::shared_ptr<Texture> load(const std::string& path);
+
+      const std::vector<uint8_t>* get_pixels(const Texture* texture);
+
+      /* Drops CPU copies unless they are meant to be kept. */
+      void trim();
+
+      void set_keep_cpu_copy(bool enable);
+
+      /* Drops GL textures which nothing outside the cache holds. Their
+       * pixels are kept along with the CPU copy. */
+      void release_unused();
+
+      /* Drops all GL textures. With renderer_dead_state set they are only
+       * forgotten, as on context teardown. */
+      void release_textures();
+      void clear();
+   }
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uniform_buffer.hpp"
+#include "gl_state.hpp"
+
+#ifdef HAVE_GL3
+namespace GL
+{
+   UniformBuffer::UniformBuffer()
+   {
+      glGenBuffers(1, &ubo);
+   }
+
+   UniformBuffer::~UniformBuffer()
+   {
+      if (renderer_dead_state)
+         return;
+
+      State::delete_buffer(ubo);
+   }
+
+   void UniformBuffer::set_data(const void* data, size_t size)
+   {
+      State::bind_buffer(GL_UNIFORM_BUFFER, ubo);
+      glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+   }
+
+   void UniformBuffer::bind(unsigned binding)
+   {
+      State::bind_buffer_base(GL_UNIFORM_BUFFER, binding, ubo);
+   }
+}
+#endif
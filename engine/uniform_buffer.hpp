@@ -0,0 +1,44 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNIFORM_BUFFER_HPP__
+#define UNIFORM_BUFFER_HPP__
+
+#include "gl.hpp"
+#include <cstddef>
+
+#ifdef HAVE_GL3
+namespace GL
+{
+   class UniformBuffer
+   {
+      public:
+         UniformBuffer();
+         ~UniformBuffer();
+
+         // Replaces the whole buffer; the old storage is orphaned so a
+         // block still in flight on the GPU is never waited on.
+         void set_data(const void* data, size_t size);
+         void bind(unsigned binding);
+
+      private:
+         GLuint ubo;
+   };
+}
+#endif
+
+#endif
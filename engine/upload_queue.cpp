@@ -0,0 +1,77 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "upload_queue.hpp"
+#include <algorithm>
+#include <deque>
+
+namespace GL
+{
+   namespace UploadQueue
+   {
+      static std::deque<Upload*> queue;
+      static size_t budget;
+
+      void set_budget(size_t bytes)
+      {
+         budget = bytes;
+         if (!budget)
+            flush();
+      }
+
+      bool deferred()
+      {
+         return budget != 0;
+      }
+
+      void push(Upload* upload)
+      {
+         queue.push_back(upload);
+      }
+
+      void remove(Upload* upload)
+      {
+         queue.erase(std::remove(queue.begin(), queue.end(), upload), queue.end());
+      }
+
+      void run()
+      {
+         size_t bytes = 0;
+         while (!queue.empty() && bytes < budget)
+         {
+            Upload* upload = queue.front();
+            queue.pop_front();
+            bytes += upload->upload();
+         }
+      }
+
+      void flush()
+      {
+         while (!queue.empty())
+         {
+            Upload* upload = queue.front();
+            queue.pop_front();
+            upload->upload();
+         }
+      }
+
+      size_t pending()
+      {
+         return queue.size();
+      }
+   }
+}
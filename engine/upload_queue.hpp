@@ -0,0 +1,55 @@
+/*
+ *  Libretro 3DEngine
+ *  Copyright (C) 2013-2014 - Hans-Kristian Arntzen
+ *  Copyright (C) 2013-2014 - Daniel De Matteis
+ *
+ *  Libretro 3DEngine is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  Libretro 3DEngine is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with Libretro 3DEngine.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPLOAD_QUEUE_HPP__
+#define UPLOAD_QUEUE_HPP__
+
+#include "gl.hpp"
+
+namespace GL
+{
+   // Something with GL data still to hand over: mesh buffers and textures.
+   class Upload
+   {
+      public:
+         virtual ~Upload() {}
+
+         // Does the GL upload; returns its size in bytes.
+         virtual size_t upload() = 0;
+   };
+
+   // Uploads spread over frames, so loading a big level in context_reset
+   // does not make one long stall. Objects queue themselves and must
+   // remove() themselves if destroyed while still queued.
+   namespace UploadQueue
+   {
+      // Bytes handed to GL per frame. 0 uploads immediately instead.
+      void set_budget(size_t bytes);
+      bool deferred();
+
+      void push(Upload* upload);
+      void remove(Upload* upload);
+
+      // Uploads in queue order until the budget is spent, but always at
+      // least one item, however large. Call once a frame.
+      void run();
+      void flush();
+      size_t pending();
+   }
+}
+
+#endif
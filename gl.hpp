@@ -29,6 +29,12 @@
 #include <glsym/rglgen_headers.h>
 #include "shared.hpp"
 
+// Desktop GL and GLES3 builds can take the VAO/UBO path; GLES2 builds
+// only ever run the legacy one.
+#if !defined(HAVE_OPENGLES) || defined(HAVE_OPENGLES3)
+#define HAVE_GL3
+#endif
+
 extern bool renderer_dead_state;
 
 #endif
@@ -3,11 +3,12 @@ LOCAL_PATH := $(call my-dir)
 CORE_DIR := $(LOCAL_PATH)/..
 
 GLES     := 1
+HAVE_THREADS := 1
 INCFLAGS :=
 
 include $(CORE_DIR)/Makefile.common
 
-COREFLAGS := -DHAVE_OPENGLES -DHAVE_OPENGLES2 -DANDROID -DHAVE_RJPEG -DHAVE_RTGA -DHAVE_RBMP -DHAVE_RPNG -DINLINE="inline" $(INCFLAGS)
+COREFLAGS := -DHAVE_OPENGLES -DHAVE_OPENGLES2 -DHAVE_THREADS -DANDROID -DHAVE_RJPEG -DHAVE_RTGA -DHAVE_RBMP -DHAVE_RPNG -DINLINE="inline" $(INCFLAGS)
 
 GIT_VERSION := " $(shell git rev-parse --short HEAD || echo unknown)"
 ifneq ($(GIT_VERSION)," unknown")
@@ -30,11 +30,18 @@
 
 #include "gl.hpp"
 #include "program.h"
+#include "engine/texture_cache.hpp"
+#include "engine/gl_state.hpp"
+#include "engine/caps.hpp"
+#include "engine/program_cache.hpp"
+#include "engine/upload_queue.hpp"
+#include "engine/dynamic_resolution.hpp"
 
 #define FPS 60.0
 
 retro_position_t previous_location;
 retro_position_t current_location;
+engine_cull_stats_t cull_stats;
 
 bool renderer_dead_state = true;
 bool sensor_initialized = false;
@@ -56,6 +63,7 @@ static const engine_program_t *engine_program_cb;
 struct retro_sensor_interface sensor_cb;
 
 static bool display_position;
+static bool display_gl_stats;
 
 #define BASE_WIDTH 320
 #define BASE_HEIGHT 240
@@ -109,7 +117,7 @@ void retro_get_system_info(struct retro_system_info *info)
 #endif
    info->library_version  = "v1" GIT_VERSION;
    info->need_fullpath    = false;
-   info->valid_extensions = "png|jpg|mtl|obj";
+   info->valid_extensions = "png|jpg|mtl|obj|vox";
 }
 
 void retro_get_system_av_info(struct retro_system_av_info *info)
@@ -136,11 +144,17 @@ void retro_set_environment(retro_environment_t cb)
       },
                         {
          "3dengine-cube-size",
-         "Cube size; 0|1|2|4|8|16|32|64|128" },
+         "Cube size; 0|1|2|4|8|16|32|64|128|256|512" },
                         {
          "3dengine-cube-stride",
          "Cube stride; 2.0|3.0|4.0|5.0|6.0|7.0|8.0" },
                         {
+         "3dengine-cube-mode",
+         "Cube grid; chunked|instanced" },
+                        {
+         "3dengine-cube-greedy",
+         "Merge cube faces (greedy meshing); disabled|enabled" },
+                        {
          "3dengine-camera-enable",
          "Camera enable; disabled|enabled" },
                         {
@@ -160,6 +174,27 @@ void retro_set_environment(retro_environment_t cb)
                         },
                   { "3dengine-modelviewer-discard-hack", "Discard hack enable; disabled|enabled" },
                   { "3dengine-location-display-position", "Location position OSD; disabled|enabled" },
+                  { "3dengine-texture-cache-keep-cpu", "Keep decoded textures in RAM; disabled|enabled" },
+                  { "3dengine-texture-atlas", "Pack small textures into atlases; disabled|enabled" },
+                  { "3dengine-upload-budget", "GPU upload budget per frame (MB); 8|2|4|16|32|unlimited" },
+                  { "3dengine-occlusion-culling", "Software occlusion culling; disabled|enabled" },
+                  { "3dengine-depth-prepass", "Depth pre-pass; auto|disabled|enabled" },
+                  { "3dengine-scenewalker-pvs", "Scenewalker visibility bake (.pvs); disabled|enabled" },
+                  { "3dengine-scenewalker-baked-lighting", "Scenewalker lighting bake (.light); disabled|enabled" },
+                  { "3dengine-point-lights", "Clustered point lights (GL3/GLES3 renderer); disabled|16|64|256|1024" },
+                  { "3dengine-lighting", "Lighting quality; per-pixel|per-vertex" },
+                  { "3dengine-dynamic-resolution", "Dynamic resolution, frame budget (ms); disabled|16.6|33.3|11.1|8.3" },
+                  { "3dengine-dynamic-resolution-range", "Dynamic resolution scale range (%); 50-100|25-100|75-100|50-150" },
+                  { "3dengine-dynamic-resolution-filter", "Dynamic resolution upscale filter; bilinear|sharpen" },
+                  { "3dengine-temporal-upsampling", "Temporal upsampling from half resolution; disabled|enabled" },
+                  { "3dengine-gl-stats", "GL state call statistics OSD; disabled|enabled" },
+#ifdef HAVE_GL3
+#ifdef HAVE_OPENGLES
+                  { "3dengine-modern-gl", "GLES3 renderer (restart); disabled|enabled" },
+#else
+                  { "3dengine-modern-gl", "GL 3.3 core renderer (restart); disabled|enabled" },
+#endif
+#endif
       { NULL, NULL },
    };
 
@@ -237,10 +272,110 @@ static void update_variables(void)
          location_camera_control_enable = true;
    }
 
+   var.key = "3dengine-texture-cache-keep-cpu";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (!strcmp(var.value, "disabled"))
+         GL::TextureCache::set_keep_cpu_copy(false);
+      else if (!strcmp(var.value, "enabled"))
+         GL::TextureCache::set_keep_cpu_copy(true);
+   }
+
+   var.key = "3dengine-upload-budget";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (!strcmp(var.value, "unlimited"))
+         GL::UploadQueue::set_budget(0);
+      else
+         GL::UploadQueue::set_budget(atoi(var.value) << 20);
+   }
+
+   var.key = "3dengine-dynamic-resolution";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (!strcmp(var.value, "disabled"))
+         GL::DynamicResolution::set_target(0.0f);
+      else
+         GL::DynamicResolution::set_target(atof(var.value));
+   }
+
+   var.key = "3dengine-dynamic-resolution-range";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      const char *max = strchr(var.value, '-');
+      if (max)
+         GL::DynamicResolution::set_range(atoi(var.value) / 100.0f, atoi(max + 1) / 100.0f);
+   }
+
+   var.key = "3dengine-dynamic-resolution-filter";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      GL::DynamicResolution::set_sharpen(!strcmp(var.value, "sharpen"));
+
+   var.key = "3dengine-temporal-upsampling";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      GL::DynamicResolution::set_temporal(!strcmp(var.value, "enabled"));
+
+   var.key = "3dengine-gl-stats";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (!strcmp(var.value, "disabled"))
+         display_gl_stats = false;
+      else if (!strcmp(var.value, "enabled") && !display_gl_stats)
+      {
+         display_gl_stats = true;
+         GL::State::reset_stats();
+      }
+   }
+
    if (engine_program_cb && engine_program_cb->update_variables)
       engine_program_cb->update_variables(environ_cb);
 }
 
+static void show_gl_stats(void)
+{
+   static unsigned frames;
+   struct retro_message msg;
+   char msg_local[128];
+   const GL::State::Stats& stats = GL::State::get_stats();
+
+   if (++frames < FPS)
+      return;
+
+   size_t len = snprintf(msg_local, sizeof(msg_local), "GL state calls per frame: %u issued, %u elided",
+         (unsigned)(stats.issued / FPS), (unsigned)(stats.elided / FPS));
+   if ((cull_stats.visible || cull_stats.culled) && len < sizeof(msg_local))
+      snprintf(msg_local + len, sizeof(msg_local) - len, "; %u visible, %u culled",
+            cull_stats.visible, cull_stats.culled);
+   len = strlen(msg_local);
+   if (cull_stats.occluded && len < sizeof(msg_local))
+      snprintf(msg_local + len, sizeof(msg_local) - len, ", %u occluded",
+            cull_stats.occluded);
+   len = strlen(msg_local);
+   if (GL::DynamicResolution::enabled() && len < sizeof(msg_local))
+      snprintf(msg_local + len, sizeof(msg_local) - len, "; %u%% scale",
+            (unsigned)(GL::DynamicResolution::get_scale() * 100.0f + 0.5f));
+   msg.msg    = msg_local;
+   msg.frames = FPS;
+   environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, (void*)&msg);
+
+   frames = 0;
+   GL::State::reset_stats();
+}
+
 void retro_run(void)
 {
    bool updated = false;
@@ -272,8 +407,15 @@ void retro_run(void)
       }
    }
 
+   // The frontend may have touched any GL state since the last frame.
+   GL::State::reset();
+   GL::UploadQueue::run();
+
    if (engine_program_cb && engine_program_cb->run)
       engine_program_cb->run();
+
+   if (display_gl_stats)
+      show_gl_stats();
 }
 
 static void camera_gl_callback(unsigned texture_id, unsigned texture_target, const float *affine)
@@ -330,7 +472,7 @@ static void camera_raw_fb_callback(const uint32_t *buffer, unsigned width, unsig
    if (!tex)
    {
       glGenTextures(1, &tex);
-      glBindTexture(GL_TEXTURE_2D, tex);
+      GL::State::bind_texture(0, GL_TEXTURE_2D, tex);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -340,7 +482,7 @@ static void camera_raw_fb_callback(const uint32_t *buffer, unsigned width, unsig
          convert_buffer = new uint8_t[width * height * 4];
    }
    else
-      glBindTexture(GL_TEXTURE_2D, tex);
+      GL::State::bind_texture(0, GL_TEXTURE_2D, tex);
 
    if (support_unpack_row_length)
    {
@@ -377,7 +519,7 @@ static void camera_raw_fb_callback(const uint32_t *buffer, unsigned width, unsig
       }
    }
 
-   glBindTexture(GL_TEXTURE_2D, 0);
+   GL::State::bind_texture(0, GL_TEXTURE_2D, 0);
 }
 
 static void camera_initialized(void)
@@ -388,6 +530,14 @@ static void camera_initialized(void)
 
 static void context_reset(void)
 {
+   GL::Caps::init(hw_render.context_type, hw_render.get_proc_address);
+   GL::ProgramCache::init();
+   GL::State::reset();
+
+   // Whatever the previous context held went away with it.
+   renderer_dead_state = true;
+   GL::DynamicResolution::reset();
+
    if (engine_program_cb && engine_program_cb->context_reset)
       engine_program_cb->context_reset();
 }
@@ -406,6 +556,42 @@ static void location_deinitialized(void)
       location_cb.stop();
 }
 
+static bool set_hw_render(void)
+{
+#ifdef HAVE_GL3
+   struct retro_variable var;
+
+   var.key = "3dengine-modern-gl";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value &&
+         !strcmp(var.value, "enabled"))
+   {
+#ifdef HAVE_OPENGLES
+      hw_render.context_type  = RETRO_HW_CONTEXT_OPENGLES3;
+#else
+      hw_render.context_type  = RETRO_HW_CONTEXT_OPENGL_CORE;
+      hw_render.version_major = 3;
+      hw_render.version_minor = 3;
+#endif
+      if (environ_cb(RETRO_ENVIRONMENT_SET_HW_RENDER, &hw_render))
+         return true;
+
+      if (log_cb)
+         log_cb(RETRO_LOG_WARN, "Modern GL context unavailable, falling back.\n");
+      hw_render.version_major = 0;
+      hw_render.version_minor = 0;
+   }
+#endif
+
+#ifdef HAVE_OPENGLES
+   hw_render.context_type = RETRO_HW_CONTEXT_OPENGLES2;
+#else
+   hw_render.context_type = RETRO_HW_CONTEXT_OPENGL;
+#endif
+   return environ_cb(RETRO_ENVIRONMENT_SET_HW_RENDER, &hw_render);
+}
+
 bool retro_load_game(const struct retro_game_info *info)
 {
    retro_variable var;
@@ -414,6 +600,13 @@ bool retro_load_game(const struct retro_game_info *info)
       return false;
 
    strcpy(retro_path_info, info->path);
+
+   const char* save_dir = NULL;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &save_dir) && save_dir && *save_dir)
+      GL::ProgramCache::set_directory(std::string(save_dir) + "/3dengine_shaders");
+   else
+      GL::ProgramCache::set_directory("");
+
    if (strstr(info->path, ".obj") || strstr(info->path, ".mtl"))
       engine_program_cb = &engine_program_modelviewer;
    else
@@ -515,16 +708,11 @@ bool retro_load_game(const struct retro_game_info *info)
       }
    }
 
-#ifdef HAVE_OPENGLES
-   hw_render.context_type = RETRO_HW_CONTEXT_OPENGLES2;
-#else
-   hw_render.context_type = RETRO_HW_CONTEXT_OPENGL;
-#endif
    hw_render.context_reset = context_reset;
    hw_render.depth = true;
    if (!camera_enable)
       hw_render.bottom_left_origin = true;
-   if (!environ_cb(RETRO_ENVIRONMENT_SET_HW_RENDER, &hw_render))
+   if (!set_hw_render())
       return false;
 
 #ifdef HAVE_OPENGLES
@@ -552,6 +740,7 @@ bool retro_load_game(const struct retro_game_info *info)
 void retro_unload_game(void)
 {
    renderer_dead_state = true;
+   GL::TextureCache::clear();
 
    if (convert_buffer)
       delete[] convert_buffer;
@@ -47,6 +47,16 @@ typedef struct
 extern retro_position_t previous_location;
 extern retro_position_t current_location;
 
+// Filled by the programs which cull, for the statistics OSD.
+typedef struct
+{
+   unsigned visible;
+   unsigned culled;
+   unsigned occluded;
+} engine_cull_stats_t;
+
+extern engine_cull_stats_t cull_stats;
+
 typedef struct engine_program
 {
    void (*load_game)(const struct retro_game_info *info);
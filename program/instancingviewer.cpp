@@ -22,6 +22,12 @@
 #include "rpng.h"
 #include "rtga.h"
 #include "picojpeg.h"
+#include "../engine/gl_state.hpp"
+#include "../engine/shader.hpp"
+#include "../engine/caps.hpp"
+#include "../engine/dynamic_resolution.hpp"
+#include "../engine/chunk_grid.hpp"
+#include "../engine/brick_map.hpp"
 
 #include <glsym/glsym.h>
 #include <retro_miscellaneous.h>
@@ -33,7 +39,20 @@
 
 #define CUBE_VERTS 36
 
-static bool first_init = true;
+// Cubes per draw call when the context has no instancing. The cube is
+// stored BATCH_SIZE times and each copy picks its offset from a uniform
+// array, so the vertex data no longer grows with the grid.
+#define BATCH_SIZE 64
+// One draw per BATCH_SIZE cubes adds up fast: grids past this size are
+// cut down to it on that path, 4096 draws at most.
+#define BATCHED_MAX_SIZE 64
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+// Without face culling every cube keeps all of its faces, so the chunked
+// path hands larger grids of separated cubes to the instanced one.
+#define CHUNKED_LOOSE_MAX 64
+
 static std::string texpath;
 extern bool camera_enable;
 
@@ -44,20 +63,26 @@ struct Vertex
    GLfloat tex[2];
 };
 
-struct Cube
-{
-   struct Vertex vertices[CUBE_VERTS];
-};
-
 using namespace glm;
 
-static bool update;
-static GLuint prog;
-static GLuint background_prog;
+static std1::shared_ptr<GL::Shader> shader;
+static std1::shared_ptr<GL::Shader> background_shader;
+static std1::shared_ptr<GL::Shader> chunk_shader;
+static GL::ChunkGrid chunk_grid;
+// Loaded from .vox content; replaces the cube_size³ box.
+static std1::shared_ptr<GL::BrickMap> voxel_map;
+static bool vox_content;
+static vec3 voxel_center;
 static GLuint vbo;
+static GLuint instance_vbo;
 static GLuint background_vbo;
+static GLuint vao;
 static float cube_stride = 4.0f;
 static unsigned cube_size = 1;
+static bool cube_chunked = true;
+static bool cube_greedy;
+static bool chunks_dirty = true;
+static bool vertex_lighting;
 
 static float light_r;
 static float light_g;
@@ -75,18 +100,70 @@ static float camera_rot_y;
 static const char *vertex_shader[] = {
    "uniform mat4 uVP;",
    "uniform mat4 uM;",
+   "uniform vec4 uGrid;", // x: cubes per side, y: stride, z: cubes to the centre
    "attribute vec4 aVertex;",
    "attribute vec4 aNormal;",
    "attribute vec2 aTexCoord;",
    "varying vec3 normal;",
    "varying vec4 model_pos;",
    "varying vec2 tex_coord;",
+   "\n#ifdef VERTEX_LIGHTING\n",
+   "uniform vec3 light_pos;",
+   "uniform vec4 ambient_light;",
+   "varying vec4 light;",
+   "\n#endif\n",
+   "\n#if __VERSION__ >= 300\n",
+   "vec3 instance_offset() {",
+   "  int n = int(uGrid.x);",
+   "  ivec3 cell = ivec3(gl_InstanceID % n, (gl_InstanceID / n) % n, gl_InstanceID / (n * n));",
+   "  return uGrid.y * (vec3(cell) - uGrid.z) + vec3(0.0, 0.0, -100.0);",
+   "}",
+   "\n#else\n",
+   "uniform vec4 uBase;",
+   "uniform vec4 uOffsets[" TO_STRING(BATCH_SIZE) "];",
+   "attribute float aInstance;",
+   "vec3 instance_offset() {",
+   "  return uBase.xyz + uOffsets[int(aInstance)].xyz;",
+   "}",
+   "\n#endif\n",
    "void main() {",
-   "  model_pos = uM * aVertex;",
+   "  model_pos = uM * (aVertex + vec4(instance_offset(), 0.0));",
    "  gl_Position = uVP * model_pos;",
    "  vec4 trans_normal = uM * aNormal;",
    "  normal = trans_normal.xyz;",
    "  tex_coord = vec2(1.0 - aTexCoord.x, aTexCoord.y);",
+   "\n#ifdef VERTEX_LIGHTING\n",
+   "  vec3 diff = light_pos - model_pos.xyz;",
+   "  float dist_mod = 100.0 * inversesqrt(dot(diff, diff));",
+   "  light = ambient_light + dist_mod * smoothstep(0.0, 1.0, dot(normalize(diff), normal));",
+   "\n#endif\n",
+   "}",
+};
+
+static const char *chunk_vertex_shader[] = {
+   "uniform mat4 uVP;",
+   "uniform vec4 uChunk;", // xyz: position of the chunk's first cell, w: stride
+   "uniform vec3 uNormal;",
+   "attribute vec4 aCell;",
+   "attribute vec4 aCorner;",
+   "varying vec3 normal;",
+   "varying vec4 model_pos;",
+   "varying vec2 tex_coord;",
+   "\n#ifdef VERTEX_LIGHTING\n",
+   "uniform vec3 light_pos;",
+   "uniform vec4 ambient_light;",
+   "varying vec4 light;",
+   "\n#endif\n",
+   "void main() {",
+   "  model_pos = vec4(uChunk.xyz + uChunk.w * aCell.xyz + aCorner.xyz, 1.0);",
+   "  gl_Position = uVP * model_pos;",
+   "  normal = uNormal;",
+   "  tex_coord = vec2(1.0 - aCell.w, aCorner.w);",
+   "\n#ifdef VERTEX_LIGHTING\n",
+   "  vec3 diff = light_pos - model_pos.xyz;",
+   "  float dist_mod = 100.0 * inversesqrt(dot(diff, diff));",
+   "  light = ambient_light + dist_mod * smoothstep(0.0, 1.0, dot(normalize(diff), normal));",
+   "\n#endif\n",
    "}",
 };
 
@@ -97,21 +174,37 @@ static const char *fragment_shader[] = {
    "#ifdef GL_ES\n",
    "precision mediump float; \n",
    "#endif\n",
+   "\n#ifdef VERTEX_LIGHTING\n",
+   "varying vec4 light;",
+   "\n#else\n",
    "varying vec3 normal;",
    "varying vec4 model_pos;",
-   "varying vec2 tex_coord;",
    "uniform vec3 light_pos;",
    "uniform vec4 ambient_light;",
+   "\n#endif\n",
+   "varying vec2 tex_coord;",
 #ifdef ANDROID
    "uniform samplerExternalOES uTexture;",
 #else
    "uniform sampler2D uTexture;",
 #endif
+   // Merged chunk faces span several cells and repeat the texture once
+   // per cell. The texture cannot do that itself on GLES2 when it is
+   // NPOT, nor as an external camera image.
+   "\n#ifdef WRAP_TEX_COORD\n",
+   "#define TEX_COORD fract(tex_coord)",
+   "\n#else\n",
+   "#define TEX_COORD tex_coord",
+   "\n#endif\n",
 
    "void main() {",
+   "\n#ifdef VERTEX_LIGHTING\n",
+   "  gl_FragColor = texture2D(uTexture, TEX_COORD) * light;",
+   "\n#else\n",
    "  vec3 diff = light_pos - model_pos.xyz;",
    "  float dist_mod = 100.0 * inversesqrt(dot(diff, diff));",
-   "  gl_FragColor = texture2D(uTexture, tex_coord) * (ambient_light + dist_mod * smoothstep(0.0, 1.0, dot(normalize(diff), normal)));",
+   "  gl_FragColor = texture2D(uTexture, TEX_COORD) * (ambient_light + dist_mod * smoothstep(0.0, 1.0, dot(normalize(diff), normal)));",
+   "\n#endif\n",
    "}",
 };
 
@@ -206,60 +299,163 @@ static const GLubyte indices[] = {
    23, 22, 21,
 };
 
-static void display_cubes_array(void)
+static void upload_cubes(void)
 {
-   glBindBuffer(GL_ARRAY_BUFFER, vbo);
-   int vloc = glGetAttribLocation(prog, "aVertex");
-   glVertexAttribPointer(vloc, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, vert)));
-   glEnableVertexAttribArray(vloc);
-   int nloc = glGetAttribLocation(prog, "aNormal");
-   glVertexAttribPointer(nloc, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, normal)));
-   glEnableVertexAttribArray(nloc);
-   int tcloc = glGetAttribLocation(prog, "aTexCoord");
-   glVertexAttribPointer(tcloc, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, tex)));
-   glEnableVertexAttribArray(tcloc);
+   unsigned copies = BATCH_SIZE;
+   std::vector<Vertex> vertices;
+   std::vector<GLfloat> instances;
+
+#ifdef HAVE_GL3
+   if (GL::Caps::modern())
+      copies = 1;
+#endif
 
-   if (update)
+   vertices.resize(copies * CUBE_VERTS);
+   instances.resize(copies * CUBE_VERTS);
+
+   for (unsigned i = 0; i < copies; i++)
    {
-      unsigned x, y, z;
+      for (unsigned v = 0; v < CUBE_VERTS; v++)
+      {
+         vertices[i * CUBE_VERTS + v]  = vertex_data[indices[v]];
+         instances[i * CUBE_VERTS + v] = i;
+      }
+   }
 
-      update = false;
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, vbo);
+   glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
+         &vertices[0], GL_STATIC_DRAW);
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, instance_vbo);
+   glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(GLfloat),
+         &instances[0], GL_STATIC_DRAW);
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, 0);
+}
 
-      std::vector<Cube> cubes;
-      cubes.resize(cube_size * cube_size * cube_size);
+static void display_cubes_batched(void)
+{
+   static bool warned;
+   unsigned size = std::min<unsigned>(cube_size, BATCHED_MAX_SIZE);
+   float half = size / 2;
+   GLfloat offsets[BATCH_SIZE * 4] = {0};
+   int iloc = shader->attrib("aInstance");
+   int baseloc = shader->uniform("uBase");
+
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, instance_vbo);
+   glVertexAttribPointer(iloc, 1, GL_FLOAT, GL_FALSE, sizeof(GLfloat), (void*)0);
+   GL::State::enable_vertex_attrib(iloc);
+
+   for (unsigned i = 0; i < BATCH_SIZE; i++)
+      offsets[i * 4] = cube_stride * i;
+   glUniform4fv(shader->uniform("uOffsets"), BATCH_SIZE, offsets);
+
+   if (size < cube_size && !warned)
+   {
+      if (log_cb)
+         log_cb(RETRO_LOG_WARN, "Cube size %u needs instancing, drawing %u instead.\n",
+               cube_size, size);
+      warned = true;
+   }
 
-      for (x = 0; x < cube_size; x++)
+   for (unsigned z = 0; z < size; z++)
+   {
+      for (unsigned y = 0; y < size; y++)
       {
-         for (y = 0; y < cube_size; y++)
+         for (unsigned x = 0; x < size; x += BATCH_SIZE)
          {
-            for (z = 0; z < cube_size; z++)
-            {
-               Cube &cube = cubes[((cube_size * cube_size * z) + (cube_size * y) + x)];
-
-               float off_x = cube_stride * ((float)x - cube_size / 2);
-               float off_y = cube_stride * ((float)y - cube_size / 2);
-               float off_z = -100.0f + cube_stride * ((float)z - cube_size / 2);
-
-               for (unsigned v = 0; v < CUBE_VERTS; v++)
-               {
-                  cube.vertices[v] = vertex_data[indices[v]];
-                  cube.vertices[v].vert[0] += off_x;
-                  cube.vertices[v].vert[1] += off_y;
-                  cube.vertices[v].vert[2] += off_z;
-               }
-            }
+            unsigned count = std::min<unsigned>(BATCH_SIZE, size - x);
+
+            glUniform4f(baseloc,
+                  cube_stride * ((float)x - half),
+                  cube_stride * ((float)y - half),
+                  -100.0f + cube_stride * ((float)z - half), 0.0f);
+            glDrawArrays(GL_TRIANGLES, 0, CUBE_VERTS * count);
          }
       }
-      glBufferData(GL_ARRAY_BUFFER, cube_size * cube_size * cube_size * sizeof(Cube),
-            &cubes[0], GL_STATIC_DRAW);
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
    }
 
-   glDrawArrays(GL_TRIANGLES, 0, CUBE_VERTS * cube_size * cube_size * cube_size);
-   glBindBuffer(GL_ARRAY_BUFFER, 0);
-   glDisableVertexAttribArray(vloc);
-   glDisableVertexAttribArray(nloc);
-   glDisableVertexAttribArray(tcloc);
+   GL::State::disable_vertex_attrib(iloc);
+}
+
+static void display_cubes_array(void)
+{
+   float half = cube_size / 2;
+
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, vbo);
+   int vloc = shader->attrib("aVertex");
+   glVertexAttribPointer(vloc, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, vert)));
+   GL::State::enable_vertex_attrib(vloc);
+   int nloc = shader->attrib("aNormal");
+   glVertexAttribPointer(nloc, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, normal)));
+   GL::State::enable_vertex_attrib(nloc);
+   int tcloc = shader->attrib("aTexCoord");
+   glVertexAttribPointer(tcloc, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, tex)));
+   GL::State::enable_vertex_attrib(tcloc);
+
+   glUniform4f(shader->uniform("uGrid"), cube_size, cube_stride, half, 0.0f);
+
+#ifdef HAVE_GL3
+   if (GL::Caps::modern())
+   {
+      if (cube_size)
+         glDrawArraysInstanced(GL_TRIANGLES, 0, CUBE_VERTS,
+               cube_size * cube_size * cube_size);
+   }
+   else
+#endif
+      display_cubes_batched();
+
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, 0);
+   GL::State::disable_vertex_attrib(vloc);
+   GL::State::disable_vertex_attrib(nloc);
+   GL::State::disable_vertex_attrib(tcloc);
+}
+
+static bool cubes_touch(void)
+{
+   return cube_stride <= 2.0f;
+}
+
+static bool use_chunks(void)
+{
+   if (voxel_map.get())
+      return true;
+   return cube_chunked && (cubes_touch() || cube_size <= CHUNKED_LOOSE_MAX);
+}
+
+static void update_chunks(void)
+{
+   GL::VoxelBox box(cube_size);
+   const GL::VoxelSource *source = &box;
+   if (voxel_map.get())
+      source = voxel_map.get();
+
+   unsigned rebuilt = chunk_grid.update(*source, cubes_touch(), cube_greedy);
+
+   if (log_cb && rebuilt)
+      log_cb(RETRO_LOG_INFO, "Meshed %u of %u cube chunks.\n",
+            rebuilt, chunk_grid.get_stats().chunks);
+   chunks_dirty = false;
+}
+
+static void display_cubes_chunked(const mat4& vp, const vec3& eye)
+{
+   GL::ChunkGrid::View view;
+   float half = cube_size / 2;
+   vec3 center = vec3(half);
+
+   if (voxel_map.get())
+      center = voxel_center;
+
+   view.view_projection = vp;
+   view.eye = eye;
+   view.origin = vec3(0.0f, 0.0f, -100.0f) - cube_stride * center;
+   view.stride = cube_stride;
+
+   chunk_grid.render(*chunk_shader, view);
+
+   const GL::ChunkGrid::Stats& stats = chunk_grid.get_stats();
+   cull_stats.visible = stats.drawn;
+   cull_stats.culled  = stats.chunks - stats.drawn;
 }
 
 #if 0
@@ -446,17 +642,28 @@ static vec3 instancingviewer_check_input(void)
    return look_dir;
 }
 
-static void print_shader_log(GLuint shader)
+static std::string join_lines(const char **lines, size_t count)
 {
-   GLsizei len = 0;
-   glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
-   if (!len)
-      return;
-
-   char *buffer = new char[len];
-   glGetShaderInfoLog(shader, len, &len, buffer);
-   log_cb(RETRO_LOG_INFO, ":%s\n", buffer);
-   delete[] buffer;
+   std::string source;
+
+   for (size_t i = 0; i < count; i++)
+      source += lines[i];
+
+   return source;
+}
+
+static GLuint white_texture(void)
+{
+   static const uint8_t white[4] = { 0xff, 0xff, 0xff, 0xff };
+   GLuint tex;
+
+   glGenTextures(1, &tex);
+   GL::State::bind_texture(0, GL_TEXTURE_2D, tex);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1,
+         0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   return tex;
 }
 
 static GLuint load_texture(const char *path)
@@ -494,7 +701,7 @@ static GLuint load_texture(const char *path)
 
    GLuint tex;
    glGenTextures(1, &tex);
-   glBindTexture(GL_TEXTURE_2D, tex);
+   GL::State::bind_texture(0, GL_TEXTURE_2D, tex);
 
    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
          0, GL_RGBA, GL_UNSIGNED_BYTE, data);
@@ -502,91 +709,82 @@ static GLuint load_texture(const char *path)
 
    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   // Repeating is done in the shader; GLES2 cannot repeat NPOT textures.
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
    return tex;
 }
 
-static void instancingviewer_compile_shaders(void)
+// Puts a #define in front of the source, after any #extension lines
+// since those have to come first.
+static std::string add_define(const char *name, const std::string& source)
 {
-   prog = glCreateProgram();
-   GLuint vert = glCreateShader(GL_VERTEX_SHADER);
-   GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
-
-   glShaderSource(vert, ARRAY_SIZE(vertex_shader), vertex_shader, 0);
-   glShaderSource(frag, ARRAY_SIZE(fragment_shader), fragment_shader, 0);
-   glCompileShader(vert);
-   glCompileShader(frag);
-
-   int status = 0;
-   glGetShaderiv(vert, GL_COMPILE_STATUS, &status);
-   if (!status && log_cb)
-   {
-      log_cb(RETRO_LOG_ERROR, "Vertex shader failed to compile!\n");
-      print_shader_log(vert);
-   }
-   glGetShaderiv(frag, GL_COMPILE_STATUS, &status);
-   if (!status && log_cb)
+   size_t pos = 0;
+
+   while (source.compare(pos, 10, "#extension") == 0)
    {
-      log_cb(RETRO_LOG_ERROR, "Fragment shader failed to compile!\n");
-      print_shader_log(frag);
+      pos = source.find('\n', pos);
+      if (pos == std::string::npos)
+         return source;
+      pos++;
    }
 
-   glAttachShader(prog, vert);
-   glAttachShader(prog, frag);
-   glLinkProgram(prog);
-
-   glGetProgramiv(prog, GL_LINK_STATUS, &status);
-   if (!status && log_cb)
-      log_cb(RETRO_LOG_ERROR, "Program failed to link!\n");
-
-
-   background_prog        = glCreateProgram();
-   GLuint background_vert = glCreateShader(GL_VERTEX_SHADER);
-   GLuint background_frag = glCreateShader(GL_FRAGMENT_SHADER);
+   return source.substr(0, pos) + "#define " + name + "\n" + source.substr(pos);
+}
 
-   glShaderSource(background_vert, ARRAY_SIZE(background_vertex_shader), background_vertex_shader, 0);
-   glShaderSource(background_frag, ARRAY_SIZE(background_fragment_shader), background_fragment_shader, 0);
-   glCompileShader(background_vert);
-   glCompileShader(background_frag);
+// With per-vertex lighting the fragment shader is a single texture fetch
+// times the interpolated light, for fill rate bound GPUs.
+static void compile_cube_shaders(void)
+{
+   std::string vertex = join_lines(vertex_shader, ARRAY_SIZE(vertex_shader));
+   std::string chunk_vertex = join_lines(chunk_vertex_shader, ARRAY_SIZE(chunk_vertex_shader));
+   std::string fragment = join_lines(fragment_shader, ARRAY_SIZE(fragment_shader));
 
-   glGetShaderiv(background_vert, GL_COMPILE_STATUS, &status);
-   if (!status && log_cb)
+   if (vertex_lighting)
    {
-      log_cb(RETRO_LOG_ERROR, "Background vertex shader failed to compile!\n");
-      print_shader_log(background_vert);
-   }
-   glGetShaderiv(background_frag, GL_COMPILE_STATUS, &status);
-   if (!status && log_cb)
-   {
-      log_cb(RETRO_LOG_ERROR, "Background fragment shader failed to compile!\n");
-      print_shader_log(background_frag);
+      vertex = add_define("VERTEX_LIGHTING", vertex);
+      chunk_vertex = add_define("VERTEX_LIGHTING", chunk_vertex);
+      fragment = add_define("VERTEX_LIGHTING", fragment);
    }
 
-   glAttachShader(background_prog, background_vert);
-   glAttachShader(background_prog, background_frag);
-   glLinkProgram(background_prog);
+   // Release the old programs before building their replacements.
+   shader.reset();
+   chunk_shader.reset();
+   shader = std1::shared_ptr<GL::Shader>(new GL::Shader(vertex, fragment));
+   chunk_shader = std1::shared_ptr<GL::Shader>(new GL::Shader(chunk_vertex,
+            add_define("WRAP_TEX_COORD", fragment)));
+}
 
-   glGetProgramiv(background_prog, GL_LINK_STATUS, &status);
-   if (!status && log_cb)
-      log_cb(RETRO_LOG_ERROR, "Background program failed to link!\n");
+static void instancingviewer_compile_shaders(void)
+{
+   compile_cube_shaders();
+   background_shader = std1::shared_ptr<GL::Shader>(new GL::Shader(
+            join_lines(background_vertex_shader, ARRAY_SIZE(background_vertex_shader)),
+            join_lines(background_fragment_shader, ARRAY_SIZE(background_fragment_shader))));
 
-   glBindBuffer(GL_ARRAY_BUFFER, background_vbo);
-   int vloc = glGetAttribLocation(background_prog, "VertexCoord");
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, background_vbo);
+   int vloc = background_shader->attrib("VertexCoord");
    glVertexAttribPointer(vloc, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 4, (void*)(0));
-   glEnableVertexAttribArray(vloc);
-   int tcloc = glGetAttribLocation(background_prog, "TexCoord");
+   GL::State::enable_vertex_attrib(vloc);
+   int tcloc = background_shader->attrib("TexCoord");
    glVertexAttribPointer(tcloc, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 4, (void*)(sizeof(GLfloat) * 2));
-   glEnableVertexAttribArray(tcloc);
+   GL::State::enable_vertex_attrib(tcloc);
 
    glBufferData(GL_ARRAY_BUFFER, 4 * sizeof(GLfloat) * 4,
          &background_data[0], GL_STATIC_DRAW);
-   glBindBuffer(GL_ARRAY_BUFFER, 0);
-   glDisableVertexAttribArray(tcloc);
-   glDisableVertexAttribArray(vloc);
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, 0);
+   GL::State::disable_vertex_attrib(tcloc);
+   GL::State::disable_vertex_attrib(vloc);
 
    tex = 0;
 
    if (!camera_enable)
+   {
       tex = load_texture(texpath.c_str());
+      // .vox content may come without a texture of its own.
+      if (!tex && vox_content)
+         tex = white_texture();
+   }
 }
 
 static void instancingviewer_context_reset(void)
@@ -596,10 +794,34 @@ static void instancingviewer_context_reset(void)
 
    rglgen_resolve_symbols(hw_render.get_proc_address);
 
+   // Anything built for the previous context went away with it. Drop it
+   // while renderer_dead_state holds; from here on objects delete their
+   // GL names again, so rebuilt shaders do not leak the old programs.
+   shader.reset();
+   chunk_shader.reset();
+   background_shader.reset();
+   chunk_grid.reset();
+   renderer_dead_state = false;
+
    glGenBuffers(1, &vbo);
+   glGenBuffers(1, &instance_vbo);
    glGenBuffers(1, &background_vbo);
+
+   // Core contexts cannot draw without a VAO; one is enough here since
+   // both passes respecify their attributes every frame anyway.
+   vao = 0;
+#ifdef HAVE_GL3
+   if (GL::Caps::modern())
+   {
+      glGenVertexArrays(1, &vao);
+      GL::State::bind_vertex_array(vao);
+   }
+#endif
+
    instancingviewer_compile_shaders();
-   update = true;
+   upload_cubes();
+
+   chunks_dirty = true;
 }
 
 static void instancingviewer_update_variables(retro_environment_t environ_cb)
@@ -612,10 +834,7 @@ static void instancingviewer_update_variables(retro_environment_t environ_cb)
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
    {
       cube_size = atoi(var.value);
-      update = true;
-
-      if (!first_init)
-         instancingviewer_context_reset();
+      chunks_dirty = true;
    }
 
    var.key = "3dengine-cube-stride";
@@ -624,10 +843,39 @@ static void instancingviewer_update_variables(retro_environment_t environ_cb)
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
    {
       cube_stride = atof(var.value);
-      update = true;
+      chunks_dirty = true;
+   }
+
+   var.key = "3dengine-cube-mode";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      cube_chunked = !strcmp(var.value, "chunked");
+
+   var.key = "3dengine-cube-greedy";
+   var.value = NULL;
 
-      if (!first_init)
-         instancingviewer_context_reset();
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      cube_greedy = !strcmp(var.value, "enabled");
+      chunks_dirty = true;
+   }
+
+   var.key = "3dengine-lighting";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      bool enable = !strcmp(var.value, "per-vertex");
+
+      if (enable != vertex_lighting)
+      {
+         vertex_lighting = enable;
+
+         // Before the first context reset there is nothing to rebuild.
+         if (shader)
+            compile_cube_shaders();
+      }
    }
 }
 
@@ -635,45 +883,53 @@ static void instancingviewer_run(void)
 {
    vec3 look_dir = instancingviewer_check_input();
 
-   glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
+   GL::DynamicResolution::begin(hw_render.get_current_framebuffer(), engine_width, engine_height);
    glClearColor(0.1, 0.1, 0.1, 1.0);
-   glViewport(0, 0, engine_width, engine_height);
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-   glUseProgram(background_prog);
+#ifdef HAVE_GL3
+   if (vao)
+      GL::State::bind_vertex_array(vao);
+#endif
+
+   background_shader->use();
 
-   glDisable(GL_DEPTH_TEST);
-   glEnable(GL_CULL_FACE);
+   GL::State::disable(GL_DEPTH_TEST);
+   GL::State::enable(GL_CULL_FACE);
 
-   int texloc = glGetUniformLocation(background_prog, "Texture");
+   int texloc = background_shader->uniform("Texture");
    glUniform1i(texloc, 0);
-   glActiveTexture(GL_TEXTURE0);
-   glBindBuffer(GL_ARRAY_BUFFER, background_vbo);
-   int vloc = glGetAttribLocation(background_prog, "VertexCoord");
+   GL::State::bind_buffer(GL_ARRAY_BUFFER, background_vbo);
+   int vloc = background_shader->attrib("VertexCoord");
    glVertexAttribPointer(vloc, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 4, (void*)(0));
-   glEnableVertexAttribArray(vloc);
-   int tcloc = glGetAttribLocation(background_prog, "TexCoord");
+   GL::State::enable_vertex_attrib(vloc);
+   int tcloc = background_shader->attrib("TexCoord");
    glVertexAttribPointer(tcloc, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 4, (void*)(sizeof(GLfloat) * 2));
-   glEnableVertexAttribArray(tcloc);
+   GL::State::enable_vertex_attrib(tcloc);
 
-   glBindTexture(g_texture_target, tex);
+   GL::State::bind_texture(0, g_texture_target, tex);
 
    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-   glDisableVertexAttribArray(tcloc);
-   glDisableVertexAttribArray(vloc);
+   GL::State::disable_vertex_attrib(tcloc);
+   GL::State::disable_vertex_attrib(vloc);
 
-   glUseProgram(prog);
+   bool chunked = use_chunks();
+   GL::Shader *cube_shader = chunked ? chunk_shader.get() : shader.get();
 
-   glEnable(GL_DEPTH_TEST);
-   glEnable(GL_CULL_FACE);
+   if (chunked && chunks_dirty)
+      update_chunks();
 
-   int tloc = glGetUniformLocation(prog, "uTexture");
+   cube_shader->use();
+
+   GL::State::enable(GL_DEPTH_TEST);
+   GL::State::enable(GL_CULL_FACE);
+
+   int tloc = cube_shader->uniform("uTexture");
    glUniform1i(tloc, 0);
-   glActiveTexture(GL_TEXTURE0);
 
-   glBindTexture(g_texture_target, tex);
+   GL::State::bind_texture(0, g_texture_target, tex);
 
-   int lloc = glGetUniformLocation(prog, "light_pos");
+   int lloc = cube_shader->uniform("light_pos");
 
    vec3_t light_pos;
 
@@ -684,24 +940,34 @@ static void instancingviewer_run(void)
    glUniform3fv(lloc, 1, &light_pos[0]);
 
    vec4 ambient_light(ambient_light_r, ambient_light_g, ambient_light_b, ambient_light_a);
-   lloc = glGetUniformLocation(prog, "ambient_light");
+   lloc = cube_shader->uniform("ambient_light");
    glUniform4fv(lloc, 1, &ambient_light[0]);
 
-   int vploc = glGetUniformLocation(prog, "uVP");
+   int vploc = cube_shader->uniform("uVP");
    mat4 view = lookAt(player_pos, player_pos + look_dir, vec3(0, 1, 0));
    mat4 proj = scale(mat4(1.0), vec3(1, -1, 1)) * perspective(45.0f, 640.0f / 480.0f, 5.0f, 500.0f);
-   mat4 vp = proj * view;
+   mat4 vp = GL::DynamicResolution::jitter(proj, view) * view;
    glUniformMatrix4fv(vploc, 1, GL_FALSE, &vp[0][0]);
 
-   int modelloc = glGetUniformLocation(prog, "uM");
-   mat4 model = mat4(1.0);
-   glUniformMatrix4fv(modelloc, 1, GL_FALSE, &model[0][0]);
+   if (chunked)
+      display_cubes_chunked(vp, player_pos);
+   else
+   {
+      int modelloc = shader->uniform("uM");
+      mat4 model = mat4(1.0);
+      glUniformMatrix4fv(modelloc, 1, GL_FALSE, &model[0][0]);
 
-   display_cubes_array();
+      display_cubes_array();
+   }
 
-   glUseProgram(0);
-   glBindTexture(g_texture_target, 0);
+   GL::Shader::unbind();
+   GL::State::bind_texture(0, g_texture_target, 0);
+#ifdef HAVE_GL3
+   if (vao)
+      GL::State::bind_vertex_array(0);
+#endif
 
+   GL::DynamicResolution::end();
    video_cb(RETRO_HW_FRAME_BUFFER_VALID, engine_width, engine_height, 0);
 }
 
@@ -709,7 +975,29 @@ static void instancingviewer_load_game(const struct retro_game_info *info)
 {
    player_pos      = vec3(0, 0, 0);
    texpath         = info->path;
-   first_init      = false;
+
+   voxel_map.reset();
+   vox_content = strstr(info->path, ".vox") != NULL;
+   if (vox_content)
+   {
+      int lo[3], hi[3];
+
+      voxel_map = std1::shared_ptr<GL::BrickMap>(new GL::BrickMap);
+      if (!voxel_map->load_vox(info->path))
+      {
+         // load_vox() has said why; show the cube grid instead.
+         if (log_cb)
+            log_cb(RETRO_LOG_ERROR, "No voxels loaded from %s, drawing the cube grid.\n",
+                  info->path);
+         voxel_map.reset();
+      }
+      else if (voxel_map->bounds(lo, hi))
+         voxel_center = vec3(lo[0] + hi[0], lo[1] + hi[1], lo[2] + hi[2]) * 0.5f;
+
+      // Texture for the cubes sits next to the model, same name.
+      texpath = texpath.substr(0, texpath.rfind('.')) + ".png";
+   }
+   chunks_dirty = true;
 
    light_r         = 0;
    light_g         = 150;
@@ -20,12 +20,28 @@
 #include "../engine/mesh.hpp"
 #include "../engine/texture.hpp"
 #include "../engine/object.hpp"
+#include "../engine/texture_cache.hpp"
+#include "../engine/geometry_pool.hpp"
+#include "../engine/atlas.hpp"
+#include "../engine/render_queue.hpp"
+#include "../engine/shader_variants.hpp"
+#include "../engine/gl_state.hpp"
+#include "../engine/bvh.hpp"
+#include "../engine/occlusion_buffer.hpp"
+#include "../engine/pvs.hpp"
+#include "../engine/light_bake.hpp"
+#include "../engine/light_clusters.hpp"
+#include "../engine/caps.hpp"
+#include "../engine/dynamic_resolution.hpp"
 #include "collision_detection.hpp"
 #include "location_math.h"
 
 #include <glsym/glsym.h>
 
 #include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 using namespace glm;
@@ -33,9 +49,81 @@ using namespace glm;
 static bool first_init = true;
 static std::string mesh_path;
 static bool discard_hack_enable = false;
+static bool texture_atlas_enable = false;
+static bool occlusion_enable = false;
+static bool pvs_enable = false;
+static bool vertex_lighting = false;
+static bool baked_lighting_enable = false;
+
+enum
+{
+   PREPASS_AUTO = 0,
+   PREPASS_DISABLED,
+   PREPASS_ENABLED
+};
+
+static unsigned prepass_mode = PREPASS_AUTO;
+static unsigned prepass_countdown;
+static std1::shared_ptr<GL::Shader> depth_shader;
+
+// Fragment shader features, one #define each.
+enum
+{
+   FEATURE_DIFFUSE_MAP = 1 << 0,
+   FEATURE_AMBIENT_MAP = 1 << 1,
+   FEATURE_SPECULAR    = 1 << 2,
+   FEATURE_ALPHA_TEST  = 1 << 3,
+   FEATURE_POINT_LIGHTS = 1 << 4,
+   FEATURE_VERTEX_LIGHTING = 1 << 5,
+   FEATURE_BAKED_LIGHTING = 1 << 6
+};
+
+static const char* const feature_defines[] = {
+   "DIFFUSE_MAP",
+   "AMBIENT_MAP",
+   "SPECULAR",
+   "ALPHA_TEST",
+   "POINT_LIGHTS",
+   "VERTEX_LIGHTING",
+   "BAKED_LIGHTING",
+};
+
+static std1::shared_ptr<GL::ShaderVariants> shader_variants;
+
+// The automatic depth pre-pass turns on above the first overdraw
+// estimate and off again below the second, re-measured this often.
+#define PREPASS_OVERDRAW_ON 2.5f
+#define PREPASS_OVERDRAW_OFF 2.0f
+#define PREPASS_MEASURE_FRAMES 60
 
 static std::vector<std1::shared_ptr<GL::Mesh> > meshes;
 static std1::shared_ptr<GL::Texture> blank;
+static GL::RenderQueue render_queue;
+static GL::BVH bvh;
+static bool bvh_dirty;
+static std::vector<unsigned> visible_meshes;
+static std::vector<GL::RenderQueue::Pass> mesh_passes;
+static GL::OcclusionBuffer occlusion;
+static GL::PVS pvs;
+static GL::LightBake light_bake;
+// Set up in init_mesh; the meshes get it jittered every frame when the
+// frame is upsampled temporally.
+static mat4 camera_projection;
+
+// Point light benchmark: this many lights, spread over the model in
+// object space and moved along with it.
+static unsigned point_light_count;
+#ifdef HAVE_GL3
+static float point_light_radius;
+static std::vector<vec3> point_light_origins;
+static std::vector<GL::PointLight> point_lights;
+static std1::shared_ptr<GL::LightClusters> light_clusters;
+#endif
+
+// Meshes drawn into the occlusion buffer must cover this share of it
+// and stay small enough to rasterize cheaply.
+#define OCCLUDER_MIN_COVERAGE 32
+#define OCCLUDER_MAX_TRIANGLES 1024
 
 //forward decls
 static void scenewalker_reset_mesh_path(void);
@@ -50,6 +138,7 @@ static float ambient_light_b;
 static bool update;
 
 static vec3 player_size(0.4f, 0.8f, 0.4f);
+static vec3 player_pos(0, 2, 0);
 
 enum
 {
@@ -63,8 +152,6 @@ static vec3 scenewalker_check_input(void)
 {
    static float player_view_deg_x;
    static float player_view_deg_y;
-   static vec3 player_pos(0, 2, 0);
-
    input_poll_cb();
 
    int analog_x = input_state_cb(0, RETRO_DEVICE_ANALOG,
@@ -201,8 +288,12 @@ static vec3 scenewalker_check_input(void)
 
    mat4 view = lookAt(player_pos, player_pos + look_dir, vec3(0, 1, 0));
 
+   // Start turns the colour buttons into moving the light. A baked light
+   // is fixed, so there they do nothing while Start is held.
    bool start_pressed = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_START);
-   if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L2))
+   bool light_fixed = start_pressed && !light_bake.empty();
+
+   if (!light_fixed && input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L2))
    {
       if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_SELECT))
       {
@@ -220,7 +311,7 @@ static vec3 scenewalker_check_input(void)
       }
    }
 
-   if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R2))
+   if (!light_fixed && input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R2))
    {
       if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_SELECT))
       {
@@ -238,7 +329,7 @@ static vec3 scenewalker_check_input(void)
       }
    }
 
-   if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R3))
+   if (!light_fixed && input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R3))
    {
       if (input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_SELECT))
       {
@@ -383,19 +474,254 @@ static vec3 modelviewer_check_input(void)
       meshes[i]->set_ambient_lighting(ambient_light_r, ambient_light_g, ambient_light_b);
       meshes[i]->set_lighting(light_r, light_g, light_b);
    }
+   bvh_dirty = true;
    //check_collision_cube();
 
    return player_size;
 }
 
+static unsigned material_features(unsigned index)
+{
+   const GL::Material& material = meshes[index]->get_material();
+   unsigned features = 0;
+
+   if (material.diffuse_map)
+      features |= FEATURE_DIFFUSE_MAP;
+   if (mesh_passes[index] == GL::RenderQueue::PASS_ALPHA_TEST)
+      features |= FEATURE_ALPHA_TEST;
+
+   // Baked meshes have no normals left for specular or point lights.
+   if (!light_bake.empty())
+      return features | FEATURE_BAKED_LIGHTING;
+
+   // Per-vertex lighting keeps to one texture fetch per pixel, and takes
+   // the ambient colour from the diffuse map.
+   if (vertex_lighting)
+      features |= FEATURE_VERTEX_LIGHTING;
+   else if (material.ambient_map)
+      features |= FEATURE_AMBIENT_MAP;
+   if (material.specular != vec3(0.0f))
+      features |= FEATURE_SPECULAR;
+#ifdef HAVE_GL3
+   if (light_clusters)
+      features |= FEATURE_POINT_LIGHTS;
+#endif
+
+   return features;
+}
+
+#ifdef HAVE_GL3
+// Fixed seed, so benchmark runs see the same lights.
+static float point_light_random(uint32_t& seed)
+{
+   seed = seed * 1664525u + 1013904223u;
+   return (seed >> 8) / 16777216.0f;
+}
+#endif
+
+static void init_point_lights(void)
+{
+#ifdef HAVE_GL3
+   point_light_origins.clear();
+   point_lights.clear();
+   light_clusters.reset();
+#endif
+
+   if (!point_light_count || meshes.empty())
+      return;
+
+#ifdef HAVE_GL3
+   if (GL::Caps::modern())
+   {
+      GL::AABB bounds = meshes[0]->get_bounds();
+      for (unsigned i = 1; i < meshes.size(); i++)
+         bounds.expand(meshes[i]->get_bounds());
+
+      // Smaller lights as there are more, for about the same overlap.
+      vec3 size = bounds.hi - bounds.lo;
+      uint32_t seed = 1;
+      point_light_radius = length(size) * 0.25f / powf(point_light_count / 16.0f, 1.0f / 3.0f);
+
+      point_light_origins.resize(point_light_count);
+      point_lights.resize(point_light_count);
+      for (unsigned i = 0; i < point_light_count; i++)
+      {
+         float x = point_light_random(seed);
+         float y = point_light_random(seed);
+         float z = point_light_random(seed);
+         point_light_origins[i] = bounds.lo + size * vec3(x, y, z);
+
+         float r = point_light_random(seed);
+         float g = point_light_random(seed);
+         float b = point_light_random(seed);
+         point_lights[i].color = vec3(r, g, b) / std::max(r, std::max(g, b));
+      }
+
+      light_clusters = std1::shared_ptr<GL::LightClusters>(new GL::LightClusters);
+      if (log_cb)
+         log_cb(RETRO_LOG_INFO, "%u point lights in %u clusters.\n",
+               point_light_count, (unsigned)GL::LightClusters::CLUSTERS);
+      return;
+   }
+#endif
+
+   if (log_cb)
+      log_cb(RETRO_LOG_WARN, "Point lights need the GL3/GLES3 renderer.\n");
+}
+
+#ifdef HAVE_GL3
+// Lights circle around their origins; bin them for this frame's camera.
+static void update_point_lights(void)
+{
+   static unsigned frame;
+   const mat4& model = meshes[0]->get_model();
+   float radius = point_light_radius * length(vec3(model[0]));
+
+   frame++;
+   for (unsigned i = 0; i < point_lights.size(); i++)
+   {
+      float phase = frame * 0.02f + i;
+      vec3 offset = vec3(sinf(phase), 0.0f, cosf(phase)) * (point_light_radius * 0.5f);
+
+      point_lights[i].position = vec3(model * vec4(point_light_origins[i] + offset, 1.0f));
+      point_lights[i].radius = radius;
+   }
+
+   // Unjittered, so the froxel bounds are not rebuilt every frame under
+   // temporal upsampling. The jitter is below a pixel.
+   light_clusters->build(point_lights, meshes[0]->get_view(),
+         camera_projection, GL::DynamicResolution::width(),
+         GL::DynamicResolution::height());
+}
+#endif
+
 static void init_mesh(const std::string& path)
 {
    if (log_cb)
       log_cb(RETRO_LOG_INFO, "Loading Mesh ...\n");
 
+   // On the GL3/GLES3 path GL::Shader defines UBO, and per-frame and
+   // per-material data come from uniform blocks instead.
+   static const std::string frame_block =
+      "layout(std140) uniform Frame {\n"
+      "  highp mat4 uViewProj;\n"
+      "  highp vec4 uFrameEyePos;\n"
+      "  highp vec4 uFrameLightPos;\n"
+      "  highp vec4 uFrameLightAmbient;\n"
+      "  highp vec4 uClusterScale;\n"
+      "  highp vec4 uClusterDepth;\n"
+      "};\n";
+
+   // Explicit precision, as the block is declared in both stages with
+   // per-vertex lighting.
+   static const std::string material_block =
+      "layout(std140) uniform Material {\n"
+      "  mediump vec4 uMaterialAmbient;\n"
+      "  mediump vec4 uMaterialDiffuse;\n"
+      "  mediump vec4 uMaterialSpecular;\n"
+      "};\n";
+
+   static const std::string fragment_uniforms =
+      "#ifdef UBO\n"
+      + frame_block + material_block +
+      "#define uEyePos uFrameEyePos.xyz\n"
+      "#define uLightPos uFrameLightPos.xyz\n"
+      "#define uLightAmbient uFrameLightAmbient.xyz\n"
+      "#define uMTLAmbient uMaterialAmbient.xyz\n"
+      "#define uMTLAlphaMod uMaterialAmbient.w\n"
+      "#define uMTLDiffuse uMaterialDiffuse.xyz\n"
+      "#define uMTLSpecular uMaterialSpecular.xyz\n"
+      "#define uMTLSpecularPower uMaterialSpecular.w\n"
+      "#else\n"
+      "#ifndef VERTEX_LIGHTING\n"
+      "uniform vec3 uLightPos;\n"
+      "uniform vec3 uEyePos;\n"
+      "uniform vec3 uMTLSpecular;\n"
+      "uniform float uMTLSpecularPower;\n"
+      "#endif\n"
+      "uniform vec3 uLightAmbient;\n"
+      "uniform vec3 uMTLAmbient;\n"
+      "uniform float uMTLAlphaMod;\n"
+      "uniform vec3 uMTLDiffuse;\n"
+      "#endif\n"
+      "#ifdef VERTEX_LIGHTING\n"
+      "varying float vDiffuseLight;\n"
+      "varying vec3 vSpecularLight;\n"
+      "#endif\n"
+      "#ifdef BAKED_LIGHTING\n"
+      "varying vec2 vBakedLight;\n"
+      "#endif\n";
+
+   // Diffuse light from the point lights in this fragment's froxel, see
+   // GL::LightClusters, which also supplies the grid size.
+#ifdef HAVE_GL3
+   static const std::string cluster_defines = GL::LightClusters::get_shader_defines();
+#else
+   static const std::string cluster_defines;
+#endif
+   static const std::string fragment_point_lights =
+      "#ifdef POINT_LIGHTS\n"
+      + cluster_defines +
+      "#ifdef GL_ES\n"
+      "precision highp int;\n"
+      "#endif\n"
+      "uniform highp sampler2D sLights;\n"
+      "uniform highp sampler2D sClusters;\n"
+      "uniform highp sampler2D sLightIndex;\n"
+      "highp vec4 lightTexel(highp sampler2D s, int i) {\n"
+      "  return texelFetch(s, ivec2(i % CLUSTER_TEXTURE_WIDTH, i / CLUSTER_TEXTURE_WIDTH), 0);\n"
+      "}\n"
+      "vec3 pointLights(highp vec3 pos, vec3 normal) {\n"
+      "  highp float depth = uClusterDepth.x / (uClusterDepth.y - gl_FragCoord.z * uClusterDepth.z);\n"
+      "  ivec2 tile = ivec2(gl_FragCoord.xy * uClusterScale.xy);\n"
+      "  int slice = int(clamp(log(depth) * uClusterScale.z + uClusterScale.w, 0.0, float(CLUSTER_SLICES - 1)));\n"
+      "  highp vec2 range = lightTexel(sClusters, (slice * CLUSTER_TILES_Y + tile.y) * CLUSTER_TILES_X + tile.x).xy;\n"
+      "  vec3 result = vec3(0.0);\n"
+      "  for (int i = 0; i < int(range.y); i++) {\n"
+      "    int light = int(lightTexel(sLightIndex, int(range.x) + i).x);\n"
+      "    highp vec4 posRadius = lightTexel(sLights, 2 * light);\n"
+      "    highp vec3 toLight = posRadius.xyz - pos;\n"
+      "    highp float dist = length(toLight);\n"
+      "    float falloff = clamp(1.0 - dist / posRadius.w, 0.0, 1.0);\n"
+      "    float directivity = clamp(dot(toLight, normal) / dist, 0.0, 1.0);\n"
+      "    result += lightTexel(sLights, 2 * light + 1).rgb * (falloff * falloff * directivity);\n"
+      "  }\n"
+      "  return result;\n"
+      "}\n"
+      "#endif\n";
+
+   // The depth pre-pass and the lit variants are separate programs;
+   // invariance makes them agree on depth where GLSL has it.
    static const std::string vertex_shader =
+      "#if defined(GL_ES) || __VERSION__ >= 120\n"
+      "invariant gl_Position;\n"
+      "#endif\n"
       "uniform mat4 uModel;\n"
+      "#ifdef UBO\n"
+      + frame_block +
+      "#define uMVP (uViewProj * uModel)\n"
+      "#else\n"
       "uniform mat4 uMVP;\n"
+      "#endif\n"
+      "#ifdef VERTEX_LIGHTING\n"
+      "#ifdef UBO\n"
+      + material_block +
+      "#define uEyePos uFrameEyePos.xyz\n"
+      "#define uLightPos uFrameLightPos.xyz\n"
+      "#define uMTLSpecular uMaterialSpecular.xyz\n"
+      "#define uMTLSpecularPower uMaterialSpecular.w\n"
+      "#else\n"
+      "uniform vec3 uLightPos;\n"
+      "uniform vec3 uEyePos;\n"
+      "uniform vec3 uMTLSpecular;\n"
+      "uniform float uMTLSpecularPower;\n"
+      "#endif\n"
+      "varying float vDiffuseLight;\n"
+      "varying vec3 vSpecularLight;\n"
+      "#endif\n"
+      "#ifdef BAKED_LIGHTING\n"
+      "varying vec2 vBakedLight;\n"
+      "#endif\n"
       "attribute vec4 aVertex;\n"
       "attribute vec3 aNormal;\n"
       "attribute vec2 aTex;\n"
@@ -407,49 +733,68 @@ static void init_mesh(const std::string& path)
       "  vTex = aTex;\n"
       "  vPos = uModel * aVertex;\n"
       "  vNormal = uModel * vec4(aNormal, 0.0);\n"
-      "}";
-
-   static const std::string fragment_shader_avoid_discard_hack =
-      "#ifdef GL_ES\n"
-      "precision mediump float;\n"
+      "#ifdef VERTEX_LIGHTING\n"
+      "  vec3 normal = normalize(vNormal.xyz);\n"
+      "#ifdef POSITIONAL_LIGHT\n"
+      "  vec3 lightDir = normalize(vPos.xyz - uLightPos);\n"
+      "  vec3 modelToFace = normalize(uEyePos - vPos.xyz);\n"
+      "#else\n"
+      "  vec3 lightDir = uLightPos;\n"
+      "  vec3 modelToFace = normalize(-vPos.xyz);\n"
       "#endif\n"
-      "varying vec2 vTex;\n"
-      "varying vec4 vNormal;\n"
-      "varying vec4 vPos;\n"
-
-      "uniform sampler2D sDiffuse;\n"
-      "uniform sampler2D sAmbient;\n"
-
-      "uniform vec3 uLightPos;\n"
-      "uniform vec3 uLightAmbient;\n"
-      "uniform vec3 uMTLAmbient;\n"
-      "uniform float uMTLAlphaMod;\n"
-      "uniform vec3 uMTLDiffuse;\n"
-      "uniform vec3 uMTLSpecular;\n"
-      "uniform float uMTLSpecularPower;\n"
+      "  vDiffuseLight = clamp(dot(lightDir, -normal), 0.0, 1.0);\n"
+      "#ifdef SPECULAR\n"
+      "  vSpecularLight = uMTLSpecular * pow(clamp(dot(modelToFace, reflect(lightDir, normal)), 0.0, 1.0), uMTLSpecularPower);\n"
+      "#else\n"
+      "  vSpecularLight = vec3(0.0);\n"
+      "#endif\n"
+      "#endif\n"
+      "#ifdef BAKED_LIGHTING\n"
+      "  vBakedLight = aNormal.xy;\n"
+      "#endif\n"
+      "}";
 
-      "void main() {\n"
+   // Material colours for the variant's features. Without a diffuse map
+   // the mesh samples the white blank texture, which hides the material
+   // colour; the ambient map falls back to the diffuse one the same way.
+   static const std::string fragment_material =
+      "#ifdef DIFFUSE_MAP\n"
       "  vec4 colorDiffuseFull = texture2D(sDiffuse, vTex);\n"
-      "  vec4 colorAmbientFull = texture2D(sAmbient, vTex);\n"
-
+      "#ifdef ALPHA_TEST\n"
       "  if (colorDiffuseFull.a < 0.5)\n"
       "     discard;\n"
-
+      "#endif\n"
       "  vec3 colorDiffuse = mix(uMTLDiffuse, colorDiffuseFull.rgb, vec3(colorDiffuseFull.a));\n"
+      "  float alpha = uMTLAlphaMod * colorDiffuseFull.a;\n"
+      "#else\n"
+      "  vec3 colorDiffuse = vec3(1.0);\n"
+      "  float alpha = uMTLAlphaMod;\n"
+      "#endif\n"
+      "#if defined(AMBIENT_MAP)\n"
+      "  vec4 colorAmbientFull = texture2D(sAmbient, vTex);\n"
       "  vec3 colorAmbient = mix(uMTLAmbient, colorAmbientFull.rgb, vec3(colorAmbientFull.a));\n"
-
-      "  vec3 normal = normalize(vNormal.xyz);\n"
-      "  float directivity = dot(uLightPos, -normal);\n"
-
-      "  vec3 diffuse = colorDiffuse * clamp(directivity, 0.0, 1.0);\n"
+      "#elif defined(DIFFUSE_MAP)\n"
+      "  vec3 colorAmbient = mix(uMTLAmbient, colorDiffuseFull.rgb, vec3(colorDiffuseFull.a));\n"
+      "#else\n"
+      "  vec3 colorAmbient = vec3(1.0);\n"
+      "#endif\n";
+
+   // Opens the per-pixel lighting code of the fragment shaders, which
+   // has to be closed with #endif. Baked meshes carry (irradiance,
+   // ambient occlusion) in place of their normals, see GL::LightBake.
+   static const std::string fragment_vertex_lighting =
+      "#if defined(BAKED_LIGHTING)\n"
+      "  vec3 diffuse = colorDiffuse * vBakedLight.x;\n"
+      "  vec3 ambient = colorAmbient * uLightAmbient * vBakedLight.y;\n"
+      "  vec3 specular = vec3(0.0);\n"
+      "#elif defined(VERTEX_LIGHTING)\n"
+      "  vec3 diffuse = colorDiffuse * vDiffuseLight;\n"
       "  vec3 ambient = colorAmbient * uLightAmbient;\n"
-
-      "  vec3 modelToFace = normalize(-vPos.xyz);\n"
-      "  float specularity = pow(clamp(dot(modelToFace, reflect(uLightPos, normal)), 0.0, 1.0), uMTLSpecularPower);\n"
-      "  vec3 specular = uMTLSpecular * specularity;\n"
-
-      "  gl_FragColor = vec4(diffuse + ambient + specular, uMTLAlphaMod);\n"
-      "}";
+      "  vec3 specular = vSpecularLight;\n"
+      "#ifdef POINT_LIGHTS\n"
+      "  vec3 normal = normalize(vNormal.xyz);\n"
+      "#endif\n"
+      "#else\n";
 
    static const std::string fragment_shader =
       "#ifdef GL_ES\n"
@@ -462,20 +807,10 @@ static void init_mesh(const std::string& path)
       "uniform sampler2D sDiffuse;\n"
       "uniform sampler2D sAmbient;\n"
 
-      "uniform vec3 uLightPos;\n"
-      "uniform vec3 uLightAmbient;\n"
-      "uniform vec3 uMTLAmbient;\n"
-      "uniform float uMTLAlphaMod;\n"
-      "uniform vec3 uMTLDiffuse;\n"
-      "uniform vec3 uMTLSpecular;\n"
-      "uniform float uMTLSpecularPower;\n"
+      + fragment_uniforms + fragment_point_lights +
 
       "void main() {\n"
-      "  vec4 colorDiffuseFull = texture2D(sDiffuse, vTex);\n"
-      "  vec4 colorAmbientFull = texture2D(sAmbient, vTex);\n"
-
-      "  vec3 colorDiffuse = mix(uMTLDiffuse, colorDiffuseFull.rgb, vec3(colorDiffuseFull.a));\n"
-      "  vec3 colorAmbient = mix(uMTLAmbient, colorAmbientFull.rgb, vec3(colorAmbientFull.a));\n"
+      + fragment_material + fragment_vertex_lighting +
 
       "  vec3 normal = normalize(vNormal.xyz);\n"
       "  float directivity = dot(uLightPos, -normal);\n"
@@ -483,11 +818,20 @@ static void init_mesh(const std::string& path)
       "  vec3 diffuse = colorDiffuse * clamp(directivity, 0.0, 1.0);\n"
       "  vec3 ambient = colorAmbient * uLightAmbient;\n"
 
+      "#ifdef SPECULAR\n"
       "  vec3 modelToFace = normalize(-vPos.xyz);\n"
       "  float specularity = pow(clamp(dot(modelToFace, reflect(uLightPos, normal)), 0.0, 1.0), uMTLSpecularPower);\n"
       "  vec3 specular = uMTLSpecular * specularity;\n"
+      "#else\n"
+      "  vec3 specular = vec3(0.0);\n"
+      "#endif\n"
+      "#endif\n"
 
-      "  gl_FragColor = vec4(diffuse + ambient + specular, uMTLAlphaMod * colorDiffuseFull.a);\n"
+      "#ifdef POINT_LIGHTS\n"
+      "  diffuse += colorDiffuse * pointLights(vPos.xyz, normal);\n"
+      "#endif\n"
+
+      "  gl_FragColor = vec4(diffuse + ambient + specular, alpha);\n"
       "}";
 
    static const std::string fragment_shader_scene =
@@ -501,54 +845,113 @@ static void init_mesh(const std::string& path)
       "uniform sampler2D sDiffuse;\n"
       "uniform sampler2D sAmbient;\n"
 
-      "uniform vec3 uLightPos;\n"
-      "uniform vec3 uLightAmbient;\n"
-      "uniform vec3 uEyePos;\n"
-      "uniform vec3 uMTLAmbient;\n"
-      "uniform float uMTLAlphaMod;\n"
-      "uniform vec3 uMTLDiffuse;\n"
-      "uniform vec3 uMTLSpecular;\n"
-      "uniform float uMTLSpecularPower;\n"
+      + fragment_uniforms + fragment_point_lights +
 
       "void main() {\n"
-      "  vec4 colorDiffuseFull = texture2D(sDiffuse, vTex);\n"
-      "  vec4 colorAmbientFull = texture2D(sAmbient, vTex);\n"
+      + fragment_material + fragment_vertex_lighting +
 
       "  vec3 lightDir = normalize(vPos.xyz - uLightPos);\n"
 
-      "  vec3 colorDiffuse = mix(uMTLDiffuse, colorDiffuseFull.rgb, vec3(colorDiffuseFull.a));\n"
-      "  vec3 colorAmbient = mix(uMTLAmbient, colorAmbientFull.rgb, vec3(colorAmbientFull.a));\n"
-
       "  vec3 normal = normalize(vNormal.xyz);\n"
       "  float directivity = dot(lightDir, -normal);\n"
 
       "  vec3 diffuse = colorDiffuse * clamp(directivity, 0.0, 1.0);\n"
       "  vec3 ambient = colorAmbient * uLightAmbient;\n"
 
+      "#ifdef SPECULAR\n"
       "  vec3 modelToFace = normalize(uEyePos - vPos.xyz);\n"
       "  float specularity = pow(clamp(dot(modelToFace, reflect(lightDir, normal)), 0.0, 1.0), uMTLSpecularPower);\n"
       "  vec3 specular = uMTLSpecular * specularity;\n"
+      "#else\n"
+      "  vec3 specular = vec3(0.0);\n"
+      "#endif\n"
+      "#endif\n"
+
+      "#ifdef POINT_LIGHTS\n"
+      "  diffuse += colorDiffuse * pointLights(vPos.xyz, normal);\n"
+      "#endif\n"
 
-      "  gl_FragColor = vec4(diffuse + ambient + specular, uMTLAlphaMod * colorDiffuseFull.a);\n"
+      "  gl_FragColor = vec4(diffuse + ambient + specular, alpha);\n"
       "}";
    
-   std1::shared_ptr<GL::Shader> shader(new GL::Shader(vertex_shader, (mode_engine == MODE_SCENEWALKER) 
-               ? fragment_shader_scene : ((discard_hack_enable) 
-               ? fragment_shader_avoid_discard_hack : fragment_shader)));
+   // The scene is lit by a point, the model by a direction.
+   std::string vertex = mode_engine == MODE_SCENEWALKER ?
+      "#define POSITIONAL_LIGHT\n" + vertex_shader : vertex_shader;
+
+   shader_variants = std1::shared_ptr<GL::ShaderVariants>(new GL::ShaderVariants(vertex,
+            mode_engine == MODE_SCENEWALKER ? fragment_shader_scene : fragment_shader,
+            feature_defines, sizeof(feature_defines) / sizeof(feature_defines[0])));
+
+   // Same vertex code as the lit shaders, with gl_Position invariant.
+   depth_shader = std1::shared_ptr<GL::Shader>(new GL::Shader(vertex,
+            "#ifdef GL_ES\n"
+            "precision mediump float;\n"
+            "#endif\n"
+            "void main() {\n"
+            "  gl_FragColor = vec4(1.0);\n"
+            "}"));
+   render_queue.set_depth_prepass(prepass_mode == PREPASS_ENABLED ?
+         depth_shader : std1::shared_ptr<GL::Shader>());
+   prepass_countdown = 0;
    meshes = OBJ::load_from_file(path);
 
-   mat4 projection;
+   if (texture_atlas_enable)
+      GL::Atlas::build(meshes);
+   GL::TextureCache::trim();
+
+   init_point_lights();
+#ifdef HAVE_GL3
+   render_queue.set_light_clusters(light_clusters);
+#endif
+
+   if (mode_engine == MODE_SCENEWALKER)
+   {
+      light_r = normalize(0);
+      light_g = normalize(10);
+      light_b = normalize(0);
+   }
+   else
+   {
+      light_r = normalize(-1);
+      light_g = normalize(-1);
+      light_b = normalize(-1);
+   }
+   ambient_light_r = 0.25f;
+   ambient_light_g = 0.25f;
+   ambient_light_b = 0.25f;
+
+   // Handed to the meshes only after the PVS, which is keyed on their
+   // original vertices.
+   light_bake.clear();
+   if (mode_engine == MODE_SCENEWALKER && baked_lighting_enable)
+   {
+      std::string bake_path = path.substr(0, path.rfind('.')) + ".light";
+      vec3 light_pos(light_r, light_g, light_b);
+
+      if (!light_bake.load(bake_path, meshes, light_pos))
+      {
+         light_bake.bake(meshes, light_pos);
+         if (!light_bake.save(bake_path) && log_cb)
+            log_cb(RETRO_LOG_WARN, "Could not write %s.\n", bake_path.c_str());
+      }
+   }
+
    if (mode_engine == MODE_SCENEWALKER)
-      projection = scale(mat4(1.0), vec3(1, -1, 1)) * perspective(45.0f, 640.0f / 480.0f, 1.0f, 100.0f);
+      camera_projection = scale(mat4(1.0), vec3(1, -1, 1)) * perspective(45.0f, 640.0f / 480.0f, 1.0f, 100.0f);
    else
-      projection = scale(mat4(1.0), vec3(1, -1, 1)) * perspective(45.0f, 4.0f / 3.0f, 0.2f, 100.0f);
+      camera_projection = scale(mat4(1.0), vec3(1, -1, 1)) * perspective(45.0f, 4.0f / 3.0f, 0.2f, 100.0f);
 
+   mesh_passes.resize(meshes.size());
    for (unsigned i = 0; i < meshes.size(); i++)
    {
-      meshes[i]->set_projection(projection);
-      meshes[i]->set_shader(shader);
+      meshes[i]->set_projection(camera_projection);
       meshes[i]->set_blank(blank);
 
+      // With the discard hack, soft edged textures are cut out rather
+      // than sorted and blended.
+      mesh_passes[i] = GL::RenderQueue::classify(*meshes[i], discard_hack_enable);
+      meshes[i]->set_shader(shader_variants->get(material_features(i)));
+
       if (mode_engine == MODE_SCENEWALKER)
       {
          meshes[i]->set_lighting(0, 10, 0);
@@ -559,32 +962,59 @@ static void init_mesh(const std::string& path)
       }
    }
 
-   if (mode_engine == MODE_SCENEWALKER)
+   if (log_cb)
+      log_cb(RETRO_LOG_INFO, "%u shader variants for %u meshes.\n",
+            (unsigned)shader_variants->size(), (unsigned)meshes.size());
+
+   std::vector<GL::AABB> bounds;
+   for (unsigned i = 0; i < meshes.size(); i++)
+      bounds.push_back(meshes[i]->get_world_bounds());
+   bvh.build(bounds);
+   bvh_dirty = false;
+
+   pvs.clear();
+   if (mode_engine == MODE_SCENEWALKER && pvs_enable)
    {
-      light_r = normalize(0);
-      light_g = normalize(10);
-      light_b = normalize(0);
+      std::string pvs_path = path.substr(0, path.rfind('.')) + ".pvs";
+
+      if (!pvs.load(pvs_path, meshes))
+      {
+         pvs.bake(meshes);
+         if (!pvs.save(pvs_path) && log_cb)
+            log_cb(RETRO_LOG_WARN, "Could not write %s.\n", pvs_path.c_str());
+      }
    }
-   else
+
+   // Last, as the baked light takes the place of the normals. Should the
+   // meshes not be the ones baked for, they keep the run time lighting.
+   if (!light_bake.empty() && !light_bake.apply(meshes))
    {
-      light_r = normalize(-1);
-      light_g = normalize(-1);
-      light_b = normalize(-1);
+      light_bake.clear();
+      for (unsigned i = 0; i < meshes.size(); i++)
+         meshes[i]->set_shader(shader_variants->get(material_features(i)));
    }
-   ambient_light_r = 0.25f;
-   ambient_light_g = 0.25f;
-   ambient_light_b = 0.25f;
 }
 
 extern char retro_path_info[1024];
 
-static void modelviewer_context_reset(void)
+// Drops everything built for the scene. GL objects are deleted unless
+// renderer_dead_state is set, in which case they are only forgotten.
+static void release_scene(void)
 {
-   renderer_dead_state = true;
    meshes.clear();
    blank.reset();
-   renderer_dead_state = false;
+   depth_shader.reset();
+   shader_variants.reset();
+   render_queue.reset();
+   GL::TextureCache::release_textures();
+   GL::GeometryPool::release();
+#ifdef HAVE_GL3
+   light_clusters.reset();
+#endif
+}
 
+static void build_scene(void)
+{
    if (strstr(retro_path_info, ".mtl") || mode_engine == MODE_SCENEWALKER)
    {
       coll_triangles_clear();
@@ -592,14 +1022,31 @@ static void modelviewer_context_reset(void)
       mode_engine = MODE_SCENEWALKER;
    }
 
-   rglgen_resolve_symbols(hw_render.get_proc_address);
-
    blank = GL::Texture::blank();
    init_mesh(mesh_path);
 
    update = true;
 }
 
+static void modelviewer_context_reset(void)
+{
+   // Whatever was built went away with the previous context.
+   renderer_dead_state = true;
+   release_scene();
+   renderer_dead_state = false;
+
+   rglgen_resolve_symbols(hw_render.get_proc_address);
+   build_scene();
+}
+
+// Options which change how the scene is built rebuild it on the live
+// context, deleting the old GL objects.
+static void modelviewer_rebuild(void)
+{
+   release_scene();
+   build_scene();
+}
+
 static void modelviewer_update_variables(retro_environment_t environ_cb)
 {
    struct retro_variable var;
@@ -615,10 +1062,233 @@ static void modelviewer_update_variables(retro_environment_t environ_cb)
          discard_hack_enable = true;
 
       if (!first_init)
-         modelviewer_context_reset();
+         modelviewer_rebuild();
+   }
+
+   var.key = "3dengine-texture-atlas";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      bool enable = !strcmp(var.value, "enabled");
+
+      if (enable != texture_atlas_enable)
+      {
+         texture_atlas_enable = enable;
+
+         if (!first_init)
+            modelviewer_rebuild();
+      }
+   }
+
+   var.key = "3dengine-occlusion-culling";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      occlusion_enable = !strcmp(var.value, "enabled");
+
+   var.key = "3dengine-depth-prepass";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      unsigned mode = PREPASS_AUTO;
+      if (!strcmp(var.value, "disabled"))
+         mode = PREPASS_DISABLED;
+      else if (!strcmp(var.value, "enabled"))
+         mode = PREPASS_ENABLED;
+
+      if (mode != prepass_mode)
+      {
+         prepass_mode = mode;
+         prepass_countdown = 0;
+         render_queue.set_depth_prepass(mode == PREPASS_ENABLED ?
+               depth_shader : std1::shared_ptr<GL::Shader>());
+      }
    }
+
+   var.key = "3dengine-scenewalker-pvs";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      bool enable = !strcmp(var.value, "enabled");
+
+      if (enable != pvs_enable)
+      {
+         pvs_enable = enable;
+
+         if (!first_init)
+            modelviewer_rebuild();
+      }
+   }
+
+   var.key = "3dengine-scenewalker-baked-lighting";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      bool enable = !strcmp(var.value, "enabled");
+
+      if (enable != baked_lighting_enable)
+      {
+         baked_lighting_enable = enable;
+
+         if (!first_init)
+            modelviewer_rebuild();
+      }
+   }
+
+   var.key = "3dengine-lighting";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      bool enable = !strcmp(var.value, "per-vertex");
+
+      if (enable != vertex_lighting)
+      {
+         vertex_lighting = enable;
+
+         if (!first_init)
+            modelviewer_rebuild();
+      }
+   }
+
+   var.key = "3dengine-point-lights";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      unsigned count = strtoul(var.value, NULL, 10);
+
+      if (count != point_light_count)
+      {
+         point_light_count = count;
+
+         if (!first_init)
+            modelviewer_rebuild();
+      }
+   }
+}
+
+static bool is_occluder(unsigned index)
+{
+   const GL::Mesh& mesh = *meshes[index];
+
+   if (mesh_passes[index] != GL::RenderQueue::PASS_OPAQUE ||
+         mesh.get_vertex_type() != GL_TRIANGLES ||
+         mesh.get_vertex()->size() > OCCLUDER_MAX_TRIANGLES * 3)
+      return false;
+
+   return occlusion.coverage(mesh.get_world_bounds()) * OCCLUDER_MIN_COVERAGE >=
+      occlusion.get_width() * occlusion.get_height();
 }
 
+// Drops the meshes in visible_meshes which are hidden behind the
+// occluders among them.
+static unsigned cull_occluded(const glm::mat4& view_projection)
+{
+   unsigned i, kept = 0;
+   std::vector<bool> occluder(visible_meshes.size());
+
+   occlusion.begin(view_projection, GL_CW);
+
+   for (i = 0; i < visible_meshes.size(); i++)
+   {
+      const GL::Mesh& mesh = *meshes[visible_meshes[i]];
+      occluder[i] = is_occluder(visible_meshes[i]);
+      if (occluder[i])
+         occlusion.draw_occluder(*mesh.get_vertex(), mesh.get_model());
+   }
+
+   for (i = 0; i < visible_meshes.size(); i++)
+   {
+      if (occluder[i] ||
+            occlusion.visible(meshes[visible_meshes[i]]->get_world_bounds()))
+         visible_meshes[kept++] = visible_meshes[i];
+   }
+
+   unsigned occluded = visible_meshes.size() - kept;
+   visible_meshes.resize(kept);
+   return occluded;
+}
+
+
+// Screens worth of front facing opaque triangles in view. Pixels are
+// covered about this many times over when drawn in the worst order.
+static float estimate_overdraw(const glm::mat4& view_projection)
+{
+   float area = 0.0f;
+
+   for (unsigned i = 0; i < visible_meshes.size(); i++)
+   {
+      const GL::Mesh& mesh = *meshes[visible_meshes[i]];
+      if (mesh_passes[visible_meshes[i]] != GL::RenderQueue::PASS_OPAQUE ||
+            mesh.get_vertex_type() != GL_TRIANGLES)
+         continue;
+
+      const std::vector<GL::Vertex>& vertices = *mesh.get_vertex();
+      mat4 mvp = view_projection * mesh.get_model();
+
+      for (unsigned v = 0; v + 2 < vertices.size(); v += 3)
+      {
+         vec4 clip[3];
+         vec2 ndc[4];
+         unsigned j, count = 0;
+
+         for (j = 0; j < 3; j++)
+            clip[j] = mvp * vec4(vertices[v + j].vert, 1.0f);
+
+         // Cut at the near plane, then clamp to the screen.
+         for (j = 0; j < 3; j++)
+         {
+            const vec4& a = clip[j];
+            const vec4& b = clip[(j + 1) % 3];
+            float da = a.z + a.w;
+            float db = b.z + b.w;
+
+            if (da >= 0.0f && a.w > 0.0f)
+               ndc[count++] = clamp(vec2(a) / a.w, vec2(-1.0f), vec2(1.0f));
+            if ((da >= 0.0f) != (db >= 0.0f))
+            {
+               vec4 c = a + (b - a) * (da / (da - db));
+               if (c.w > 0.0f)
+                  ndc[count++] = clamp(vec2(c) / c.w, vec2(-1.0f), vec2(1.0f));
+            }
+         }
+
+         // Clockwise is front facing, see modelviewer_run().
+         float twice = 0.0f;
+         for (j = 0; j < count; j++)
+            twice += ndc[j].x * ndc[(j + 1) % count].y - ndc[(j + 1) % count].x * ndc[j].y;
+         if (twice < 0.0f)
+            area -= 0.5f * twice;
+      }
+   }
+
+   return area / 4.0f;
+}
+
+static void update_depth_prepass(const glm::mat4& view_projection)
+{
+   if (prepass_mode != PREPASS_AUTO || prepass_countdown--)
+      return;
+
+   prepass_countdown = PREPASS_MEASURE_FRAMES;
+
+   float overdraw = estimate_overdraw(view_projection);
+   bool enable = render_queue.has_depth_prepass() ?
+      overdraw > PREPASS_OVERDRAW_OFF : overdraw > PREPASS_OVERDRAW_ON;
+
+   if (enable != render_queue.has_depth_prepass())
+   {
+      if (log_cb)
+         log_cb(RETRO_LOG_INFO, "Overdraw %.2f, depth pre-pass %s.\n",
+               overdraw, enable ? "on" : "off");
+      render_queue.set_depth_prepass(enable ? depth_shader : std1::shared_ptr<GL::Shader>());
+   }
+}
 
 static void modelviewer_run(void)
 {
@@ -626,22 +1296,63 @@ static void modelviewer_run(void)
    vec3 look_dir = modelviewer_check_input();
    (void)look_dir;
 
-   glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
-   glViewport(0, 0, engine_width, engine_height);
+   GL::DynamicResolution::begin(hw_render.get_current_framebuffer(), engine_width, engine_height);
    glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-   glEnable(GL_DEPTH_TEST);
-   glFrontFace(GL_CW); // When we flip vertically, orientation changes.
-   glEnable(GL_CULL_FACE);
-   glEnable(GL_BLEND);
+   if (!meshes.empty())
+   {
+      mat4 projection = GL::DynamicResolution::jitter(camera_projection, meshes[0]->get_view());
+      for (i = 0; i < meshes.size(); i++)
+         meshes[i]->set_projection(projection);
+   }
+
+   GL::State::enable(GL_DEPTH_TEST);
+   GL::State::front_face(GL_CW); // When we flip vertically, orientation changes.
+   GL::State::enable(GL_CULL_FACE);
+
+   if (bvh_dirty)
+   {
+      for (i = 0; i < meshes.size(); i++)
+         bvh.update(i, meshes[i]->get_world_bounds());
+      bvh.refit();
+      bvh_dirty = false;
+   }
+
+   visible_meshes.clear();
+   cull_stats.culled   = 0;
+   cull_stats.occluded = 0;
+   if (!meshes.empty())
+   {
+      GL::FrameUniforms frame;
+      meshes[0]->get_frame_uniforms(frame);
+      bvh.cull(GL::Frustum(frame.view_projection), visible_meshes);
+      cull_stats.culled  = pvs.filter(player_pos, visible_meshes);
+
+      if (occlusion_enable)
+         cull_stats.occluded = cull_occluded(frame.view_projection);
+
+      update_depth_prepass(frame.view_projection);
+   }
+
+   cull_stats.visible = visible_meshes.size();
+   cull_stats.culled += bvh.get_stats().culled;
+
+#ifdef HAVE_GL3
+   if (light_clusters)
+      update_point_lights();
+#endif
 
-   for (i = 0; i < meshes.size(); i++)
-      meshes[i]->render();
+   if (shader_variants && shader_variants->poll())
+      for (i = 0; i < meshes.size(); i++)
+         meshes[i]->set_shader(shader_variants->get(material_features(i)));
+   for (i = 0; i < visible_meshes.size(); i++)
+      render_queue.push(meshes[visible_meshes[i]], mesh_passes[visible_meshes[i]]);
+   render_queue.submit();
 
-   glDisable(GL_BLEND);
-   glDisable(GL_DEPTH_TEST);
-   glDisable(GL_CULL_FACE);
+   GL::State::disable(GL_DEPTH_TEST);
+   GL::State::disable(GL_CULL_FACE);
+   GL::DynamicResolution::end();
    video_cb(RETRO_HW_FRAME_BUFFER_VALID, engine_width, engine_height, 0);
 }
 